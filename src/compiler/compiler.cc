@@ -1,26 +1,25 @@
 #include "compiler/compiler.h"
+#include "compiler/optimizer.h"
 #include "core/value.h"
 #include "core/object.h"
+#include "core/memory.h"
 
 #include "utils/abi.h"
 #include "utils/math.h"
 
 #include "debug/disasm.h"
 
+#include <charconv>
 #include <cstdio>
 #include <iostream>
 
 static constexpr size_t kMaxLongConstant = math::ConstexprPow(2, 32);
 
-static CompilerState* current_state = nullptr;
-
-static Chunk* CurrentChunk() {
-  return &current_state->function->chunk;
-}
+// Compilations in progress on this thread, innermost first
+static thread_local Compiler* compiling = nullptr;
 
 
-/** TODO: make const */
-ParseRule rules[] = {
+static const ParseRule rules[] = {
   [TOKEN_LEFT_PAREN]    = {&Compiler::Grouping, &Compiler::Call,    PREC_CALL},
   [TOKEN_RIGHT_PAREN]   = {NULL,                NULL,               PREC_NONE},
   [TOKEN_LEFT_BRACE]    = {NULL,                NULL,               PREC_NONE},
@@ -43,12 +42,13 @@ ParseRule rules[] = {
   [TOKEN_IDENTIFIER]    = {&Compiler::Variable, NULL,               PREC_NONE},
   [TOKEN_STRING]        = {&Compiler::String,   NULL,               PREC_NONE},
   [TOKEN_NUMBER]        = {&Compiler::Number,   NULL,               PREC_NONE},
+  [TOKEN_INTERPOLATION] = {&Compiler::Interpolation, NULL,          PREC_NONE},
   [TOKEN_AND]           = {NULL,                &Compiler::And,     PREC_AND},
   [TOKEN_CLASS]         = {NULL,                NULL,               PREC_NONE},
   [TOKEN_ELSE]          = {NULL,                NULL,               PREC_NONE},
   [TOKEN_FALSE]         = {&Compiler::Literal,  NULL,               PREC_NONE},
   [TOKEN_FOR]           = {NULL,                NULL,               PREC_NONE},
-  [TOKEN_FN]            = {&Compiler::Lambda,   NULL,               PREC_LAMBDA}, // &Compiler::Lambda, <PREC_CALL
+  [TOKEN_FN]            = {&Compiler::Lambda,   NULL,               PREC_NONE}, // No infix rule, so no precedence
   [TOKEN_IF]            = {NULL,                NULL,               PREC_NONE},
   [TOKEN_NULL]          = {&Compiler::Literal,  NULL,               PREC_NONE},
   [TOKEN_OR]            = {NULL,                &Compiler::Or,      PREC_OR},
@@ -64,35 +64,72 @@ ParseRule rules[] = {
 };
 
 
-CompilerState::CompilerState(FunctionType type, std::string name)
-    : local_count(0), scope_depth(0), type(type) {
-  function = ObjFunction::New();
+CompilerState::CompilerState(Compiler* compiler, FunctionType type, std::string_view name,
+                             bool preparse)
+    : CompilerState(compiler, type, nullptr) {
+  if (preparse) return;
 
+  // Linked in first, so the collector sees the function while naming it
+  function = ObjFunction::New();
   if (type != TYPE_SCRIPT) {
-    function->name = ObjString::FromStr(name);
+    function->name = ObjString::FromStr(name, compiler->strings_);
+    memory::WriteBarrier(function, function->name->AsValue());
   }
+}
+
+
+CompilerState::CompilerState(Compiler* compiler, FunctionType type, ObjFunction* function)
+    : compiler(compiler), function(function), type(type), local_count(0), scope_depth(0) {
+  enclosing = compiler->state_;
+  compiler->state_ = this;
 
   Local* local = &locals[local_count++];
   local->depth = 0;
+  local->assignable = false;
   local->name.str = "";
+}
+
 
-  enclosing = current_state;
-  current_state = this;
+void MarkCompilerRoots() {
+  for (Compiler* compiler = compiling; compiler; compiler = compiler->enclosing_) {
+    for (CompilerState* state = compiler->state_; state; state = state->enclosing) {
+      memory::MarkObject(state->function);
+    }
+  }
 }
 
 
-ObjFunction* CompilerState::End(Compiler* compiler, bool emit_null_return) {
+ObjFunction* CompilerState::End(bool emit_null_return) {
   compiler->EndCompilation(emit_null_return);
+  if (!compiler->HadError() && function) Optimizer::Optimize(function, compiler->optimization_level_);
 #ifdef _DEBUG_DUMP_COMPILED
-  if (compiler->HadError())
-    debug::DisassembleChunk(*CurrentChunk(), function->name ? function->name->str : "<script>");
+  if (compiler->HadError() && function)
+    debug::DisassembleChunk(function->chunk, function->name ? function->name->chars : "<script>");
 #endif
-  current_state = current_state->enclosing;
+  compiler->state_ = enclosing;
   return function;
 }
 
 
-Compiler::Compiler(std::string& source) : scanner_(source) {}
+Compiler::Compiler(std::string_view source, GlobalTable& globals, StringTable& strings, int line)
+    : scanner_(source, line), globals_(globals), strings_(strings), enclosing_(compiling) {
+  compiling = this;
+}
+
+
+Compiler::~Compiler() {
+  compiling = enclosing_;
+}
+
+
+void Compiler::SetLazy(bool lazy) {
+  lazy_ = lazy;
+}
+
+
+void Compiler::SetOptimizationLevel(int level) {
+  optimization_level_ = level;
+}
 
 
 bool Compiler::HadError() const {
@@ -156,15 +193,14 @@ void Compiler::ErrorAtCurrent(std::string msg) {
 void Compiler::ErrorAt(Token& token, std::string msg) {
   if (panic_mode_) return;
   panic_mode_ = true;
-  fprintf(stderr, "[line %d] Error", token.line);
 
+  // One write, so errors of compilations on other threads can't cut in
   if (token.type == TOKEN_EOF) {
-    fprintf(stderr, " at the end");
+    fprintf(stderr, "[line %d] Error at the end: %s\n", token.line, msg.c_str());
   } else {
-    fprintf(stderr, " at '%.*s'", (int)token.str.size(), token.str.data());
+    fprintf(stderr, "[line %d] Error at '%.*s': %s\n", token.line,
+            (int)token.str.size(), token.str.data(), msg.c_str());
   }
-
-  fprintf(stderr, ": %s\n", msg.c_str());
   had_error_ = true;
 }
 
@@ -194,7 +230,24 @@ void Compiler::Syncronize() {
 }
 
 
+Chunk* Compiler::CurrentChunk() const {
+  return &state_->function->chunk;
+}
+
+
+// A pre-parsed body is checked, but makes no code or constants
+bool Compiler::Preparsing() const {
+  return state_->function == nullptr;
+}
+
+
+int Compiler::CodeSize() const {
+  return Preparsing() ? 0 : CurrentChunk()->code.size();
+}
+
+
 void Compiler::EmitByte(uint8_t byte) {
+  if (Preparsing()) return;
   CurrentChunk()->AppendCode(byte, previous_.line);
 }
 
@@ -212,6 +265,7 @@ void Compiler::EmitReturn() {
 
 
 int Compiler::EmitJump(uint8_t op) {
+  if (Preparsing()) return 0;
   EmitByte(op);
   EmitBytes(0xff, 0xff);
   return CurrentChunk()->code.size() - 2;
@@ -219,6 +273,7 @@ int Compiler::EmitJump(uint8_t op) {
 
 
 void Compiler::PatchJump(int offset) {
+  if (Preparsing()) return;
   int jump = CurrentChunk()->code.size() - offset - 2;
 
   abi::NumericData data;
@@ -235,6 +290,7 @@ void Compiler::PatchJump(int offset) {
 
 
 void Compiler::EmitLoop(int loop_start) {
+  if (Preparsing()) return;
   EmitByte(OP_LOOP);
 
   int offset = CurrentChunk()->code.size() - loop_start + 2;
@@ -250,7 +306,9 @@ void Compiler::EmitLoop(int loop_start) {
 }
 
 
-void Compiler::PatchRemoteJump(int loop, int offset) {
+void Compiler::PatchRemoteJump(int loop, int target) {
+  if (Preparsing()) return;
+  int offset = loop + 2 - target;
   if (offset > UINT16_MAX) {
     Error("Too much code to jump over.");
   }
@@ -283,8 +341,16 @@ void Compiler::EmitConstant(Value value) {
 }
 
 
+void Compiler::EmitString(std::string_view str) {
+  if (Preparsing()) return;
+  EmitConstant(Value(ObjString::FromStr(str, strings_)->AsObj()));
+}
+
+
 int Compiler::MakeConstant(Value value) {
+  if (Preparsing()) return 0;
   int constant = CurrentChunk()->AddConstant(value);
+  memory::WriteBarrier(state_->function, value);
   if (constant > kMaxLongConstant) {
       Error("Too many constant in one chunk.");
       return 0;
@@ -297,43 +363,47 @@ int Compiler::ParseVariable(const char* err_msg) {
   Consume(TOKEN_IDENTIFIER, err_msg);
 
   DeclareVariable();
-  if (current_state->scope_depth > 0) return 0;
+  if (state_->scope_depth > 0) return 0;
 
-  return IdentifierConstant(&previous_);
+  return GlobalSlot(&previous_);
 }
 
 
-int Compiler::IdentifierConstant(Token* name) {
-  ObjString* str = ObjString::FromStr(name->str);
-  return MakeConstant(str->AsValue());
+int Compiler::GlobalSlot(Token* name) {
+  if (Preparsing()) return 0;
+  ObjString* str = ObjString::FromStr(name->str, strings_);
+  return globals_.Resolve(str);
 }
 
 
 void Compiler::DefineVariable(int global, bool assignable) {
-  if (current_state->scope_depth > 0) {
+  if (state_->scope_depth > 0) {
     MarkInitialized();
-    if (!assignable) EmitByte(OP_MAKECONST);
+    state_->locals[state_->local_count - 1].assignable = assignable;
     return;
   }
 
-  if (!assignable) EmitByte(OP_MAKECONST);
-  EmitCheckLong(global, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG);
+  if (assignable) {
+    EmitCheckLong(global, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG);
+  } else {
+    EmitCheckLong(global, OP_DEFINE_CONST_GLOBAL, OP_DEFINE_CONST_GLOBAL_LONG);
+  }
 }
 
 
 void Compiler::DeclareVariable() {
-  if (current_state->scope_depth == 0) return;
+  if (state_->scope_depth == 0) return;
 
   Token* name = &previous_;
   
-  for (int i = current_state->local_count - 1; i >= 0; i--) {
-    Local* local = &current_state->locals[i];
-    if (local->depth != -1 && local->depth < current_state->scope_depth) {
+  for (int i = state_->local_count - 1; i >= 0; i--) {
+    Local* local = &state_->locals[i];
+    if (local->depth != -1 && local->depth < state_->scope_depth) {
       break;
     }
 
     if (name->str == local->name.str) {
-      Error("Redifinition of variable '" + name->str + "' in the same scope.");
+      Error("Redifinition of variable '" + std::string(name->str) + "' in the same scope.");
     }
   }
 
@@ -342,17 +412,20 @@ void Compiler::DeclareVariable() {
 
 
 void Compiler::NamedVariable(Token name, bool can_assign) {
-  int arg = ResolveLocal(current_state, &name);
+  int arg = ResolveLocal(state_, &name);
 
   if (arg != -1) {
     if (can_assign && Match(TOKEN_EQUAL)) {
+      if (!state_->locals[arg].assignable) {
+        Error("Cant assign to const variable '" + std::string(name.str) + "'.");
+      }
       Expression();
       EmitBytes(OP_SET_LOCAL, arg);
     } else {
       EmitBytes(OP_GET_LOCAL, arg);
     }
   } else {
-    arg = IdentifierConstant(&name);
+    arg = GlobalSlot(&name);
     if (can_assign && Match(TOKEN_EQUAL)) {
       Expression();
       EmitCheckLong(arg, OP_SET_GLOBAL, OP_SET_GLOBAL_LONG);
@@ -364,13 +437,14 @@ void Compiler::NamedVariable(Token name, bool can_assign) {
 
 
 void Compiler::AddLocal(Token name) {
-  if (current_state->local_count >= kLocalsSize) {
+  if (state_->local_count >= kLocalsSize) {
     Error("Too many local variables in one scope,");
     return;
   }
-  Local* local = &current_state->locals[current_state->local_count++];
+  Local* local = &state_->locals[state_->local_count++];
   local->name = name;
   local->depth = -1;
+  local->assignable = true;
 }
 
 
@@ -390,8 +464,8 @@ int Compiler::ResolveLocal(CompilerState* state, Token* name) {
 
 
 void Compiler::MarkInitialized() {
-  if (current_state->scope_depth == 0) return;
-  current_state->locals[current_state->local_count - 1].depth = current_state->scope_depth;
+  if (state_->scope_depth == 0) return;
+  state_->locals[state_->local_count - 1].depth = state_->scope_depth;
 }
 
 
@@ -413,23 +487,25 @@ uint8_t Compiler::ArgumentList() {
 
 
 void Compiler::BeginScope() {
-  current_state->scope_depth++;
+  state_->scope_depth++;
 }
 
 
 void Compiler::EndScope() {
-  current_state->scope_depth--;
+  state_->scope_depth--;
 
-  while (current_state->local_count > 0
-      && current_state->locals[current_state->local_count - 1].depth > current_state->scope_depth) {
+  while (state_->local_count > 0
+      && state_->locals[state_->local_count - 1].depth > state_->scope_depth) {
     EmitByte(OP_POP);
-    current_state->local_count--;
+    state_->local_count--;
   }
 }
 
 
 void Compiler::BeginLoop() {
-  loops_.push_back(LoopRecord());
+  LoopRecord loop;
+  loop.local_count = state_->local_count;
+  loops_.push_back(loop);
 }
 
 
@@ -438,6 +514,14 @@ void Compiler::EndLoop() {
 }
 
 
+// The jump leaves the body's scopes, so their locals go first
+void Compiler::PopLoopLocals() {
+  for (int i = state_->local_count; i > GetLoop().local_count; i--) {
+    EmitByte(OP_POP);
+  }
+}
+
+
 LoopRecord& Compiler::GetLoop(int nest) {
   return loops_[loops_.size()-1 - nest];
 }
@@ -466,7 +550,7 @@ void Compiler::ParsePrecedence(Precedence precedence) {
 }
 
 
-ParseRule* Compiler::GetRule(TokenType type) {
+const ParseRule* Compiler::GetRule(TokenType type) const {
   return &rules[type];
 }
 
@@ -569,7 +653,7 @@ void Compiler::IfStatement() {
 
 
 void Compiler::WhileStatement() {
-  int loop_start = CurrentChunk()->code.size();
+  int loop_start = CodeSize();
 
   Consume(TOKEN_LEFT_PAREN, "Expected '(' after 'while'.");
   Expression();
@@ -615,7 +699,7 @@ void Compiler::ForStatement() {
     ExpressionStatement();
   }
 
-  int loop_start = CurrentChunk()->code.size();
+  int loop_start = CodeSize();
 
   int exit_jump = -1;
   if (!Match(TOKEN_SEMICOLON)) {
@@ -629,7 +713,7 @@ void Compiler::ForStatement() {
   if (!Match(TOKEN_RIGHT_PAREN)) {
     int body_jump = EmitJump(OP_JUMP);
     
-    int increment_start = CurrentChunk()->code.size();
+    int increment_start = CodeSize();
     Expression();
     EmitByte(OP_POP);
     Consume(TOKEN_RIGHT_PAREN, "Expected ')' after 'for' increment.");
@@ -646,7 +730,7 @@ void Compiler::ForStatement() {
 
   if (exit_jump != -1) {
     PatchJump(exit_jump);
-    EmitJump(OP_POP); // Condition
+    EmitByte(OP_POP); // Condition
   }
 
   // Patch all 'continues'
@@ -667,6 +751,7 @@ void Compiler::ForStatement() {
 void Compiler::BreakStatement() {
   // TODO: check for Number for nested break
   Consume(TOKEN_SEMICOLON, "Expected ';' after expression.");
+  PopLoopLocals();
   int jump = EmitJump(OP_JUMP);
   GetLoop().end_jump.push_back(jump);
 }
@@ -674,13 +759,14 @@ void Compiler::BreakStatement() {
 
 void Compiler::ContinueStatement() {
   Consume(TOKEN_SEMICOLON, "Expected ';' after expression.");
+  PopLoopLocals();
   int jump = EmitJump(OP_LOOP);
   GetLoop().start_jump.push_back(jump);
 }
 
 
 void Compiler::ReturnStatement() {
-  if (current_state->type == TYPE_SCRIPT) {
+  if (state_->type == TYPE_SCRIPT) {
     Error("Can't return from top-level code.");
   }
   if (Match(TOKEN_SEMICOLON)) {
@@ -694,15 +780,45 @@ void Compiler::ReturnStatement() {
 
 
 void Compiler::Function(FunctionType type) {
-  CompilerState f_state(type, previous_.str); // function_state
-  
+  // Lazily the body is only checked, and so is everything nested in it
+  bool lazy = lazy_ && !Preparsing();
+  std::string_view name = previous_.str;
+  const char* start = current_.str.data();
+  int line = current_.line;
+
+  CompilerState f_state(this, type, name, lazy || Preparsing());
+  int arity;
+  bool emit_null_return = FunctionBody(&arity);
+  ObjFunction* function = f_state.End(emit_null_return);
+  if (Preparsing()) return;
+
+  int constant;
+  if (lazy) {
+    // Kept by the constant before naming it allocates
+    function = ObjFunction::New();
+    constant = MakeConstant(function->AsValue());
+    function->name = ObjString::FromStr(name, strings_);
+    memory::WriteBarrier(function, function->name->AsValue());
+    function->source = std::string_view(start, previous_.str.data() + previous_.str.size() - start);
+    function->line = line;
+  } else {
+    constant = MakeConstant(function->AsValue());
+  }
+  function->arity = arity;
+  EmitCheckLong(constant, OP_CONSTANT, OP_CONSTANT_LONG);
+}
+
+
+// The parameter list and the body. Returns whether a block body needs the
+// null return at its end.
+bool Compiler::FunctionBody(int* arity) {
   BeginScope();
 
+  *arity = 0;
   Consume(TOKEN_LEFT_PAREN, "Expected '(' after function name.");
   if (!Check(TOKEN_RIGHT_PAREN)) {
     do {
-      current_state->function->arity++;
-      if (current_state->function->arity > 255) {
+      if (++*arity > 255) {
         ErrorAtCurrent("Can't have more than 255 parameters.");
       }
 
@@ -712,19 +828,34 @@ void Compiler::Function(FunctionType type) {
   }
   Consume(TOKEN_RIGHT_PAREN, "Expected ')' after parameter declaration.");
 
-  bool emit_null_return = true;
   if (Match(TOKEN_RIGHT_ARROW)) {
     Expression();
     // Consume(TOKEN_SEMICOLON, "Expected ';' after expression.");
-    emit_null_return = false;
-  } else {
-    Consume(TOKEN_LEFT_BRACE, "Expected '{' before function body.");
-    Block();
+    return false;
   }
+  Consume(TOKEN_LEFT_BRACE, "Expected '{' before function body.");
+  Block();
+  return true;
+}
 
-  ObjFunction* function = f_state.End(this, emit_null_return);
-  int constant = MakeConstant(function->AsValue());
-  EmitCheckLong(constant, OP_CONSTANT, OP_CONSTANT_LONG);
+
+bool Compiler::CompileLazy(ObjFunction* function, GlobalTable& globals, StringTable& strings,
+                           int optimization_level) {
+  Compiler compiler(function->source, globals, strings, function->line);
+  compiler.SetOptimizationLevel(optimization_level);
+  CompilerState f_state(&compiler, TYPE_FUNCTION, function);
+
+  compiler.Advance();
+  int arity;
+  bool emit_null_return = compiler.FunctionBody(&arity);
+  f_state.End(emit_null_return);
+
+  if (compiler.HadError()) {
+    function->chunk = Chunk();
+    return false;
+  }
+  function->source = std::string_view();
+  return true;
 }
 
 
@@ -765,7 +896,7 @@ void Compiler::Unary(bool can_assign) {
 void Compiler::Binary(bool can_assign) {
   TokenType operator_type = previous_.type;
 
-  ParseRule* rule = GetRule(operator_type);
+  const ParseRule* rule = GetRule(operator_type);
   ParsePrecedence((Precedence)(rule->precedence + 1));
 
   switch (operator_type) { // TODO, when objects are implemented, use some kind of operator methods
@@ -786,7 +917,8 @@ void Compiler::Binary(bool can_assign) {
 
 
 void Compiler::Number(bool can_assign) {
-  double value = std::stod(previous_.str);
+  double value = 0;
+  std::from_chars(previous_.str.data(), previous_.str.data() + previous_.str.size(), value);
   EmitConstant(Value(value));
 }
 
@@ -803,10 +935,36 @@ void Compiler::Literal(bool can_assign) {
 
 
 void Compiler::String(bool can_assign) {
-  std::string s = previous_.str;
-  s.erase(s.begin());
-  s.pop_back();
-  EmitConstant(Value(ObjString::FromStr(s)->AsObj()));
+  std::string_view s(previous_.str);
+  EmitString(s.substr(1, s.size() - 2));
+}
+
+
+// "a${x}b" pushes "a", x and "b" (empty pieces are left out), and joins
+// them into one string with a single OP_FORMAT
+void Compiler::Interpolation(bool can_assign) {
+  int count = 0;
+  do {
+    std::string_view s(previous_.str); // "a${ or }b${
+    if (s.size() > 3) {
+      EmitString(s.substr(1, s.size() - 3));
+      count++;
+    }
+    Expression();
+    count++;
+  } while (Match(TOKEN_INTERPOLATION));
+
+  Consume(TOKEN_STRING, "Expected '}' after interpolated expression.");
+  std::string_view s(previous_.str); // }b"
+  if (previous_.type == TOKEN_STRING && s.size() > 2) {
+    EmitString(s.substr(1, s.size() - 2));
+    count++;
+  }
+
+  if (count > UINT8_MAX) {
+    Error("Can't have more than 255 pieces in an interpolated string.");
+  }
+  EmitBytes(OP_FORMAT, count);
 }
 
 
@@ -852,14 +1010,14 @@ ObjFunction* Compiler::Compile() {
   had_error_ = false;
   panic_mode_ = false;
 
-  CompilerState c_state(TYPE_SCRIPT, ""); // compiler state
+  CompilerState c_state(this, TYPE_SCRIPT, ""); // compiler state
 
   Advance();
   while (!Match(TOKEN_EOF)) {
     Declaration();
   }
 
-  ObjFunction* function = c_state.End(this);
+  ObjFunction* function = c_state.End();
 
   return HadError() ? nullptr : function;
 }
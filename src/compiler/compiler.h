@@ -7,6 +7,8 @@
 #include "core/chunk.h"
 #include "core/object.h"
 #include "core/config.h"
+#include "core/globals.h"
+#include "core/stringtable.h"
 #include "compiler/scanner.h"
 
 enum Precedence{
@@ -30,6 +32,7 @@ struct CompilerState;
 struct Local {
   Token name;
   int depth;
+  bool assignable;
 };
 
 enum FunctionType {
@@ -39,23 +42,51 @@ enum FunctionType {
 };
 
 struct LoopRecord {
+  int local_count; // Locals outside the loop body
   std::vector<int> start_jump;
   std::vector<int> end_jump;
 };
 
 
+// Everything a compilation changes is in its Compiler and the tables it is
+// given, so compilers on different threads don't share anything (see the
+// heap in core/memory.h). On one thread, the collector marks the functions
+// of every compilation in progress.
 class Compiler {
  private:
   Scanner scanner_;
+  GlobalTable& globals_;
+  StringTable& strings_; // Interns names and string constants
+  CompilerState* state_ = nullptr; // Innermost function being compiled
+  Compiler* enclosing_;  // Compilation in progress on this thread before this one
+  bool lazy_ = false;
+  int optimization_level_ = kDefaultOptimizationLevel;
   Token current_;
   Token previous_;
-  bool had_error_;
-  bool panic_mode_;
+  bool had_error_ = false;
+  bool panic_mode_ = false;
   std::vector<LoopRecord> loops_;
 
+  friend struct CompilerState;
+  friend void MarkCompilerRoots();
+
  public:
-  Compiler(std::string& source);
+  // The string table must be the one of the VM current on this thread, if
+  // there is one
+  Compiler(std::string_view source, GlobalTable& globals, StringTable& strings, int line = 1);
+  ~Compiler();
+  Compiler(const Compiler&) = delete;
+  Compiler& operator=(const Compiler&) = delete;
   ObjFunction* Compile();
+
+  // Lazily, function bodies are only checked while compiling the code
+  // around them, and compiled by CompileLazy on their first call. They
+  // keep pointing into the source, which must outlive them.
+  void SetLazy(bool lazy);
+  static bool CompileLazy(ObjFunction* function, GlobalTable& globals, StringTable& strings,
+                          int optimization_level = kDefaultOptimizationLevel);
+  void SetOptimizationLevel(int level); // See Optimizer::Optimize
+
   bool HadError() const;
   void EndCompilation(bool emit_null_return = true);
 
@@ -70,20 +101,25 @@ class Compiler {
   void ErrorAt(Token& token, std::string msg);
   void Syncronize();
 
+  Chunk* CurrentChunk() const;
+  bool Preparsing() const;
+  int CodeSize() const;
+
   void EmitByte(uint8_t byte);
   void EmitBytes(uint8_t byte1, uint8_t byte2);
   void EmitReturn();
   int  EmitJump(uint8_t op);
   void PatchJump(int offset);
   void EmitLoop(int loop_start);
-  void PatchRemoteJump(int loop, int offset);
+  void PatchRemoteJump(int loop, int target);
 
   void EmitCheckLong(int val, uint8_t op, uint8_t long_op);
   void EmitConstant(Value value);
+  void EmitString(std::string_view str);
   int  MakeConstant(Value value);
   
   int  ParseVariable(const char* err_msg);
-  int  IdentifierConstant(Token* name);
+  int  GlobalSlot(Token* name);
   void DefineVariable(int global, bool assignable);
   void DeclareVariable();
   void NamedVariable(Token name, bool can_assign);
@@ -98,9 +134,10 @@ class Compiler {
   void BeginLoop();
   void EndLoop();
   LoopRecord& GetLoop(int nest = 0);
+  void PopLoopLocals();
   
   void ParsePrecedence(Precedence precedence);
-  ParseRule* GetRule(TokenType type);
+  const ParseRule* GetRule(TokenType type) const;
 
  public: // for the rule table to work
   void Grouping(bool can_assign);
@@ -109,6 +146,7 @@ class Compiler {
   void Number(bool can_assign);
   void Literal(bool can_assign);
   void String(bool can_assign);
+  void Interpolation(bool can_assign);
   void Variable(bool can_assign);
   void And(bool can_assign);
   void Or(bool can_assign);
@@ -132,6 +170,7 @@ class Compiler {
   void ReturnStatement();
 
   void Function(FunctionType type);
+  bool FunctionBody(int* arity);
 };
 
 
@@ -146,9 +185,10 @@ struct ParseRule {
 
 
 struct CompilerState {
+  Compiler* compiler;
   CompilerState* enclosing;
 
-  ObjFunction* function;
+  ObjFunction* function; // nullptr while pre-parsing
   FunctionType type;
 
   Local locals[kLocalsSize];
@@ -156,9 +196,13 @@ struct CompilerState {
   int scope_depth;
 
  public:
-  CompilerState(FunctionType type, std::string name);
-  ObjFunction* End(Compiler* compiler, bool emit_null_return = true);
+  CompilerState(Compiler* compiler, FunctionType type, std::string_view name, bool preparse = false);
+  CompilerState(Compiler* compiler, FunctionType type, ObjFunction* function);
+  ObjFunction* End(bool emit_null_return = true);
 };
 
+// Marks the functions of all compilations in progress for the collector
+void MarkCompilerRoots();
+
 #endif
 
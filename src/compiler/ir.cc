@@ -0,0 +1,1010 @@
+#include "compiler/ir.h"
+
+#include "core/config.h"
+#include "utils/abi.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+
+static inline bool IsJump(uint8_t op) {
+  return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP;
+}
+
+static inline bool IsConstantOp(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NULL:
+    case OP_TRUE:
+    case OP_FALSE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Everything that can be computed twice, or not at all, without anyone
+// noticing other than by an error
+static inline bool IsPureOp(uint8_t op) {
+  switch (op) {
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static inline int PureArgCount(uint8_t op) {
+  return op == OP_NOT || op == OP_NEGATE ? 1 : 2;
+}
+
+
+IrFunction::IrFunction(ObjFunction* function)
+  : function_(function), chunk_(function->chunk), base_(function->arity + 1) {}
+
+
+bool IrFunction::Optimize(ObjFunction* function) {
+  IrFunction ir(function);
+  if (!ir.Decode() || !ir.BuildBlocks() || !ir.BuildValues()) return false;
+
+  ir.RemoveTrivialPhis();
+  ir.FindDominators();
+  ir.FindLoops();
+  ir.InferNumbers();
+
+  ir.EliminateCommonSubexpressions();
+  ir.FindDeadCode();
+  ir.HoistLoopInvariants();
+  if (!ir.Plan() || !ir.Lower()) return false;
+
+  Chunk& chunk = ir.chunk_;
+  chunk.code.clear();
+  chunk.lines.clear();
+  for (size_t i = 0; i < ir.out_code_.size(); i++) {
+    chunk.AppendCode(ir.out_code_[i], ir.out_lines_[i]);
+  }
+  return true;
+}
+
+
+bool IrFunction::Decode() {
+  const std::vector<uint8_t>& code = chunk_.code;
+  std::vector<int> index(code.size() + 1, -1);
+  std::vector<int> offsets;
+
+  for (int offset = 0; offset < (int)code.size(); ) {
+    uint8_t op = code[offset];
+    int size = Chunk::InstructionSize(op);
+    // Only what the compiler itself emits
+    if (op >= OP_POP_JUMP_IF_FALSE || offset + size > (int)code.size()) return false;
+
+    Instruction instruction;
+    instruction.op = op;
+    memcpy(instruction.operands, &code[offset + 1], size - 1);
+    instruction.line = chunk_.GetLine(offset);
+    instruction.block = -1;
+    index[offset] = code_.size();
+    offsets.push_back(offset);
+    code_.push_back(instruction);
+    offset += size;
+  }
+
+  for (int i = 0; i < (int)code_.size(); i++) {
+    Instruction& instruction = code_[i];
+    if (!IsJump(instruction.op)) continue;
+
+    int jump = abi::ReadU16(instruction.operands);
+    int target = instruction.op == OP_LOOP ? offsets[i] + 3 - jump : offsets[i] + 3 + jump;
+    if (target < 0 || target >= (int)code.size() || index[target] == -1) return false;
+    instruction.target = index[target];
+  }
+  return !code_.empty();
+}
+
+
+bool IrFunction::BuildBlocks() {
+  int count = code_.size();
+  std::vector<bool> leader(count + 1, false);
+  leader[0] = true;
+  for (int i = 0; i < count; i++) {
+    uint8_t op = code_[i].op;
+    if (IsJump(op)) leader[code_[i].target] = true;
+    if (IsJump(op) || op == OP_RETURN) leader[i + 1] = true;
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (leader[i]) {
+      if (!blocks_.empty()) blocks_.back().end = i;
+      Block block;
+      block.begin = i;
+      blocks_.push_back(block);
+    }
+    code_[i].block = blocks_.size() - 1;
+  }
+  blocks_.back().end = count;
+
+  for (int b = 0; b < (int)blocks_.size(); b++) {
+    Block& block = blocks_[b];
+    Instruction& last = code_[block.end - 1];
+    bool falls_through = last.op != OP_JUMP && last.op != OP_LOOP && last.op != OP_RETURN;
+    if (falls_through) {
+      if (b + 1 >= (int)blocks_.size()) return false;
+      block.successors.push_back(b + 1);
+    }
+    if (IsJump(last.op)) {
+      last.target = code_[last.target].block;
+      block.successors.push_back(last.target);
+    }
+  }
+
+  // Reverse postorder of what the entry reaches
+  std::vector<int> postorder;
+  std::vector<std::pair<int, int>> stack = {{0, 0}};
+  blocks_[0].order = 0;
+  while (!stack.empty()) {
+    auto& [b, next] = stack.back();
+    if (next < (int)blocks_[b].successors.size()) {
+      int successor = blocks_[b].successors[next++];
+      if (blocks_[successor].order == -1) {
+        blocks_[successor].order = 0;
+        stack.push_back({successor, 0});
+      }
+    } else {
+      postorder.push_back(b);
+      stack.pop_back();
+    }
+  }
+  order_.assign(postorder.rbegin(), postorder.rend());
+  for (int i = 0; i < (int)order_.size(); i++) {
+    blocks_[order_[i]].order = i;
+  }
+
+  for (int b : order_) {
+    for (int successor : blocks_[b].successors) {
+      blocks_[successor].predecessors.push_back(b);
+    }
+  }
+  // Entering the function is an edge too, so a loop can't start there
+  return blocks_[0].predecessors.empty();
+}
+
+
+bool IrFunction::BuildValues() {
+  for (int slot = 0; slot < base_; slot++) {
+    blocks_[0].entry.push_back(NewValue(VALUE_ENTRY, 0));
+  }
+
+  std::vector<int> headers;
+  for (int b : order_) {
+    Block& block = blocks_[b];
+
+    if (b != 0) {
+      bool header = false;
+      for (int predecessor : block.predecessors) {
+        if (blocks_[predecessor].order >= block.order) header = true;
+      }
+      // In reverse postorder a block's first predecessor always comes first
+      const std::vector<int>& first = blocks_[block.predecessors[0]].exit;
+      int depth = first.size();
+      if (header) {
+        // Loop headers get a phi for every slot, and lose the ones that
+        // turn out to be copies
+        headers.push_back(b);
+        for (int slot = 0; slot < depth; slot++) {
+          block.entry.push_back(NewValue(VALUE_PHI, b));
+        }
+      } else {
+        for (int predecessor : block.predecessors) {
+          if ((int)blocks_[predecessor].exit.size() != depth) return false;
+        }
+        for (int slot = 0; slot < depth; slot++) {
+          bool same = true;
+          for (int predecessor : block.predecessors) {
+            same = same && blocks_[predecessor].exit[slot] == first[slot];
+          }
+          if (same) {
+            block.entry.push_back(first[slot]);
+            continue;
+          }
+          int phi = NewValue(VALUE_PHI, b);
+          for (int predecessor : block.predecessors) {
+            values_[phi].inputs.push_back(blocks_[predecessor].exit[slot]);
+          }
+          block.entry.push_back(phi);
+        }
+      }
+    }
+
+    std::vector<int> state = block.entry;
+    for (int i = block.begin; i < block.end; i++) {
+      Instruction& instruction = code_[i];
+      int popped = 0;
+      int read = 0;
+      bool pushes = false;
+
+      switch (instruction.op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NULL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+          pushes = true;
+          break;
+        case OP_GET_LOCAL:
+          if (instruction.operands[0] >= state.size()) return false;
+          instruction.result = state[instruction.operands[0]];
+          state.push_back(instruction.result);
+          continue;
+        case OP_SET_LOCAL:
+          if (state.empty() || instruction.operands[0] >= state.size()) return false;
+          instruction.args.push_back(state.back());
+          state[instruction.operands[0]] = state.back();
+          continue;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        case OP_JUMP_IF_FALSE:
+          read = 1;
+          break;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_DEFINE_CONST_GLOBAL:
+        case OP_DEFINE_CONST_GLOBAL_LONG:
+        case OP_PRINT:
+        case OP_RETURN:
+          popped = read = 1;
+          break;
+        case OP_NOT:
+        case OP_NEGATE:
+          popped = read = 1;
+          pushes = true;
+          break;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+          popped = read = 2;
+          pushes = true;
+          break;
+        case OP_CALL:
+          popped = read = instruction.operands[0] + 1;
+          pushes = true;
+          break;
+        case OP_FORMAT:
+          popped = read = instruction.operands[0];
+          pushes = true;
+          break;
+        case OP_JUMP:
+        case OP_LOOP:
+          break;
+        default:
+          return false;
+      }
+
+      if (read > (int)state.size()) return false;
+      instruction.args.assign(state.end() - read, state.end());
+      state.resize(state.size() - popped);
+      if (pushes) {
+        instruction.result = NewValue(VALUE_DEFINED, b, i);
+        state.push_back(instruction.result);
+      }
+    }
+    block.exit = state;
+  }
+
+  for (int b : headers) {
+    Block& block = blocks_[b];
+    for (int predecessor : block.predecessors) {
+      if (blocks_[predecessor].exit.size() != block.entry.size()) return false;
+    }
+    for (int slot = 0; slot < (int)block.entry.size(); slot++) {
+      for (int predecessor : block.predecessors) {
+        values_[block.entry[slot]].inputs.push_back(blocks_[predecessor].exit[slot]);
+      }
+    }
+  }
+  return true;
+}
+
+
+void IrFunction::RemoveTrivialPhis() {
+  forward_.resize(values_.size());
+  for (int v = 0; v < (int)values_.size(); v++) forward_[v] = v;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int v = 0; v < (int)values_.size(); v++) {
+      if (values_[v].kind != VALUE_PHI || forward_[v] != v) continue;
+
+      int same = -1;
+      bool trivial = true;
+      for (int input : values_[v].inputs) {
+        input = Resolve(input);
+        if (input == v || input == same) continue;
+        if (same != -1) {
+          trivial = false;
+          break;
+        }
+        same = input;
+      }
+      if (trivial && same != -1) {
+        forward_[v] = same;
+        changed = true;
+      }
+    }
+  }
+}
+
+
+void IrFunction::FindDominators() {
+  blocks_[0].idom = 0;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int b : order_) {
+      if (b == 0) continue;
+
+      int idom = -1;
+      for (int predecessor : blocks_[b].predecessors) {
+        if (blocks_[predecessor].idom == -1) continue;
+        if (idom == -1) {
+          idom = predecessor;
+          continue;
+        }
+        int x = predecessor;
+        while (x != idom) {
+          while (blocks_[x].order > blocks_[idom].order) x = blocks_[x].idom;
+          while (blocks_[idom].order > blocks_[x].order) idom = blocks_[idom].idom;
+        }
+      }
+      if (blocks_[b].idom != idom) {
+        blocks_[b].idom = idom;
+        changed = true;
+      }
+    }
+  }
+
+  for (int b : order_) {
+    if (b != 0) blocks_[blocks_[b].idom].children.push_back(b);
+  }
+}
+
+
+void IrFunction::FindLoops() {
+  std::unordered_map<int, int> loop_of_header;
+
+  for (int b : order_) {
+    for (int header : blocks_[b].successors) {
+      if (!Dominates(header, b)) continue;
+
+      auto found = loop_of_header.find(header);
+      if (found == loop_of_header.end()) {
+        found = loop_of_header.emplace(header, loops_.size()).first;
+        Loop loop;
+        loop.header = header;
+        loop.blocks.assign(blocks_.size(), false);
+        loop.blocks[header] = true;
+        loops_.push_back(loop);
+      }
+
+      // Everything that reaches the back edge without going through the
+      // header is in the loop
+      Loop& loop = loops_[found->second];
+      std::vector<int> worklist = {b};
+      while (!worklist.empty()) {
+        int x = worklist.back();
+        worklist.pop_back();
+        if (loop.blocks[x]) continue;
+        loop.blocks[x] = true;
+        for (int predecessor : blocks_[x].predecessors) worklist.push_back(predecessor);
+      }
+    }
+  }
+
+  // Code can be put in front of the header only if the block before it is
+  // the single way in, by falling through
+  for (Loop& loop : loops_) {
+    int outside = 0;
+    for (int predecessor : blocks_[loop.header].predecessors) {
+      if (!loop.blocks[predecessor]) outside++;
+    }
+    int before = loop.header - 1;
+    loop.hoistable = outside == 1 && before >= 0 && blocks_[before].order != -1
+                  && !loop.blocks[before];
+    if (loop.hoistable) {
+      const Instruction& last = code_[blocks_[before].end - 1];
+      loop.hoistable = !IsJump(last.op) && last.op != OP_RETURN;
+    }
+  }
+
+  // Outermost first
+  std::stable_sort(loops_.begin(), loops_.end(), [](const Loop& a, const Loop& b) {
+    return std::count(a.blocks.begin(), a.blocks.end(), true)
+         > std::count(b.blocks.begin(), b.blocks.end(), true);
+  });
+}
+
+
+// Optimistic: a phi is a number until one of its inputs might not be
+void IrFunction::InferNumbers() {
+  for (Value& value : values_) value.number = value.kind != VALUE_ENTRY;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int v = 0; v < (int)values_.size(); v++) {
+      Value& value = values_[v];
+      if (!value.number) continue;
+
+      bool number = true;
+      if (value.kind == VALUE_PHI) {
+        for (int input : value.inputs) number = number && values_[Resolve(input)].number;
+      } else {
+        const Instruction& instruction = code_[value.instruction];
+        switch (instruction.op) {
+          case OP_CONSTANT:
+            number = chunk_.constants[instruction.operands[0]].IsNumber();
+            break;
+          case OP_CONSTANT_LONG:
+            number = chunk_.constants[abi::ReadI32(instruction.operands)].IsNumber();
+            break;
+          // Fail on anything else
+          case OP_NEGATE:
+          case OP_SUBTRACT:
+          case OP_MULTIPLY:
+          case OP_DIVIDE:
+            break;
+          case OP_ADD:
+            number = values_[Resolve(instruction.args[0])].number
+                  && values_[Resolve(instruction.args[1])].number;
+            break;
+          default:
+            number = false;
+        }
+      }
+      if (!number) {
+        value.number = false;
+        changed = true;
+      }
+    }
+  }
+}
+
+
+// Walks the dominator tree with the pure computations of the blocks above
+// in scope. A computation that was already done on the same values is
+// replaced by loading the earlier result: it is the same, and if that
+// one had failed, execution would not have got here.
+void IrFunction::EliminateCommonSubexpressions() {
+  std::unordered_map<uint64_t, int> available;
+  std::vector<uint64_t> added;
+
+  struct Frame {
+    int block;
+    size_t next_child;
+    size_t added_mark;
+  };
+  std::vector<Frame> stack;
+
+  // Equal constants are the same value wherever they are pushed
+  std::unordered_map<uint64_t, int> constants;
+  for (int b : order_) {
+    for (int i = blocks_[b].begin; i < blocks_[b].end; i++) {
+      Instruction& instruction = code_[i];
+      if (!IsConstantOp(instruction.op)) continue;
+      uint64_t key = (uint64_t)instruction.op << 56;
+      if (instruction.op == OP_CONSTANT) key |= instruction.operands[0];
+      if (instruction.op == OP_CONSTANT_LONG) key |= (uint32_t)abi::ReadI32(instruction.operands);
+      constants.emplace(key, instruction.result);
+      instruction.reuse = constants[key];
+    }
+  }
+
+  auto canon = [this](int value) {
+    value = Resolve(value);
+    const Value& v = values_[value];
+    if (v.kind == VALUE_DEFINED && code_[v.instruction].reuse != -1) {
+      return code_[v.instruction].reuse;
+    }
+    return value;
+  };
+
+  auto enter = [&](int b) {
+    stack.push_back({b, 0, added.size()});
+    for (int i = blocks_[b].begin; i < blocks_[b].end; i++) {
+      Instruction& instruction = code_[i];
+      if (!IsPureOp(instruction.op)) continue;
+
+      uint64_t key = (uint64_t)instruction.op << 56;
+      key |= (uint64_t)canon(instruction.args[0]) << 28;
+      if (instruction.args.size() > 1) key |= (uint64_t)canon(instruction.args[1]);
+
+      auto found = available.find(key);
+      if (found != available.end()) {
+        instruction.reuse = found->second;
+      } else {
+        available.emplace(key, instruction.result);
+        added.push_back(key);
+      }
+    }
+  };
+
+  // Value numbers share the key with the opcode
+  if (values_.size() >= (1u << 28)) return;
+
+  enter(0);
+  while (!stack.empty()) {
+    Frame& frame = stack.back();
+    const Block& block = blocks_[frame.block];
+    if (frame.next_child < block.children.size()) {
+      enter(block.children[frame.next_child++]);
+      continue;
+    }
+    while (added.size() > frame.added_mark) {
+      available.erase(added.back());
+      added.pop_back();
+    }
+    stack.pop_back();
+  }
+
+  // They are pushed again rather than loaded
+  for (int b : order_) {
+    for (int i = blocks_[b].begin; i < blocks_[b].end; i++) {
+      if (IsConstantOp(code_[i].op)) code_[i].reuse = -1;
+    }
+  }
+}
+
+
+// Pure computations nothing reads are dead. Popping or storing a value
+// isn't reading it, getting it from a local or merging it into a phi that
+// is read is.
+void IrFunction::FindDeadCode() {
+  for (int b : order_) {
+    for (int i = blocks_[b].begin; i < blocks_[b].end; i++) {
+      const Instruction& instruction = code_[i];
+      if (instruction.op == OP_POP || instruction.op == OP_SET_LOCAL) continue;
+      for (int arg : instruction.args) values_[Resolve(arg)].uses++;
+    }
+  }
+
+  std::vector<int> worklist;
+  for (int v = 0; v < (int)values_.size(); v++) {
+    if (values_[v].kind == VALUE_PHI && forward_[v] == v && values_[v].uses > 0) {
+      worklist.push_back(v);
+    }
+  }
+  while (!worklist.empty()) {
+    int phi = worklist.back();
+    worklist.pop_back();
+    for (int input : values_[phi].inputs) {
+      input = Resolve(input);
+      if (input == phi) continue;
+      if (values_[input].uses++ == 0 && values_[input].kind == VALUE_PHI) {
+        worklist.push_back(input);
+      }
+    }
+  }
+
+  for (int b : order_) {
+    for (int i = blocks_[b].begin; i < blocks_[b].end; i++) {
+      Instruction& instruction = code_[i];
+      instruction.dead = IsPure(i) && IsSafe(i) && values_[instruction.result].uses == 0;
+    }
+  }
+  // Unless something reuses the value
+  for (int b : order_) {
+    for (int i = blocks_[b].begin; i < blocks_[b].end; i++) {
+      const Instruction& instruction = code_[i];
+      if (instruction.reuse != -1 && !instruction.dead) {
+        code_[values_[instruction.reuse].instruction].dead = false;
+      }
+    }
+  }
+}
+
+
+// Computations on values from outside a loop are done once in front of the
+// outermost such loop, if they can't fail. The ones that can may still move
+// out of the header, when nothing before them there can fail either: the
+// header runs right after, so the error is the same.
+void IrFunction::HoistLoopInvariants() {
+  for (int b : order_) {
+    for (int i = blocks_[b].begin; i < blocks_[b].end; i++) {
+      Instruction& instruction = code_[i];
+      if (!IsPure(i) || instruction.reuse != -1 || instruction.dead) continue;
+
+      for (int l = 0; l < (int)loops_.size(); l++) {
+        Loop& loop = loops_[l];
+        if (!loop.blocks[b] || !loop.hoistable) continue;
+        if (!IsSafe(i) && (b != loop.header || !IsQuietBefore(i))) continue;
+
+        bool invariant = true;
+        for (int arg : instruction.args) {
+          int slot;
+          arg = Resolve(arg);
+          const Value& value = values_[arg];
+          invariant = invariant && IsInvariant(arg, loop)
+            && ((value.kind == VALUE_DEFINED
+                 && (IsConstantOp(code_[value.instruction].op) || code_[value.instruction].hoisted != -1))
+                || FindInSlot(arg, blocks_[loop.header - 1], &slot));
+        }
+        if (invariant) {
+          instruction.hoisted = l;
+          loop.hoisted.push_back(i);
+          break;
+        }
+      }
+    }
+  }
+}
+
+
+// Decides which instructions are left out: those that make the operands of
+// a computation which is loaded, dropped or hoisted instead. Those operands
+// are the instructions just before it, if they only push values.
+bool IrFunction::Plan() {
+  std::vector<int> starts(code_.size(), -1);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    // Values that must be computed where they are, and kept
+    std::vector<bool> needed(values_.size(), false);
+    for (int b : order_) {
+      for (int i = blocks_[b].begin; i < blocks_[b].end; i++) {
+        if (code_[i].reuse != -1 && !code_[i].dead) needed[code_[i].reuse] = true;
+      }
+    }
+
+    for (int b : order_) {
+      for (int i = blocks_[b].begin; i < blocks_[b].end; i++) {
+        Instruction& instruction = code_[i];
+        if (!instruction.dead && instruction.reuse == -1 && instruction.hoisted == -1) continue;
+
+        int start = OperandTreeStart(i);
+        for (int j = start; j >= 0 && j < i; j++) {
+          const Instruction& operand = code_[j];
+          if (operand.result != -1 && needed[operand.result] && operand.hoisted == -1
+              && values_[operand.result].instruction == j) {
+            start = -1;
+          }
+          // Its error has to happen where it is
+          if (IsPureOp(operand.op) && !IsSafe(j) && operand.reuse == -1 && operand.hoisted == -1) {
+            start = -1;
+          }
+        }
+        starts[i] = start;
+        if (start != -1) continue;
+
+        instruction.dead = false;
+        instruction.reuse = -1;
+        if (instruction.hoisted != -1) {
+          std::vector<int>& hoisted = loops_[instruction.hoisted].hoisted;
+          hoisted.erase(std::find(hoisted.begin(), hoisted.end(), i));
+          instruction.hoisted = -1;
+        }
+        changed = true;
+      }
+    }
+
+    // Hoisted computations whose operands are no longer hoisted stay, and
+    // so do ones that can fail after something that stayed
+    for (Loop& loop : loops_) {
+      for (size_t h = 0; h < loop.hoisted.size(); h++) {
+        Instruction& instruction = code_[loop.hoisted[h]];
+        if (!IsSafe(loop.hoisted[h]) && !IsQuietBefore(loop.hoisted[h])) {
+          instruction.hoisted = -1;
+          loop.hoisted.erase(loop.hoisted.begin() + h--);
+          changed = true;
+          continue;
+        }
+        for (int arg : instruction.args) {
+          int slot;
+          arg = Resolve(arg);
+          const Value& value = values_[arg];
+          if (value.kind == VALUE_DEFINED && !IsConstantOp(code_[value.instruction].op)
+              && code_[value.instruction].hoisted == -1
+              && !FindInSlot(arg, blocks_[loop.header - 1], &slot)) {
+            instruction.hoisted = -1;
+            loop.hoisted.erase(loop.hoisted.begin() + h--);
+            changed = true;
+            break;
+          }
+          if (value.kind == VALUE_DEFINED && code_[value.instruction].hoisted != -1
+              && !IsInvariant(arg, loop)) {
+            instruction.hoisted = -1;
+            loop.hoisted.erase(loop.hoisted.begin() + h--);
+            changed = true;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  // Extra slots, for reused and hoisted values
+  std::vector<bool> homed(values_.size(), false);
+  bool any = false;
+  for (int b : order_) {
+    for (int i = blocks_[b].begin; i < blocks_[b].end; i++) {
+      Instruction& instruction = code_[i];
+      if (instruction.dead || instruction.reuse != -1 || instruction.hoisted != -1) any = true;
+      int value = instruction.reuse != -1 && !instruction.dead ? instruction.reuse
+                : instruction.hoisted != -1 ? instruction.result : -1;
+      if (value != -1 && !homed[value]) {
+        homed[value] = true;
+        values_[value].home = base_ + homes_.size();
+        homes_.push_back(value);
+      }
+    }
+  }
+  if (!any || homes_.size() > kMaxIrSlots) return false;
+
+  for (int b : order_) {
+    for (int i = blocks_[b].begin; i < blocks_[b].end; i++) {
+      Instruction& instruction = code_[i];
+      if (instruction.op == OP_GET_LOCAL || instruction.op == OP_SET_LOCAL) {
+        if (MapSlot(instruction.operands[0]) > UINT8_MAX) return false;
+      }
+      if (instruction.skip || starts[i] == -1) continue;
+      if (!instruction.dead && instruction.reuse == -1 && instruction.hoisted == -1) continue;
+
+      for (int j = starts[i]; j < i; j++) code_[j].skip = true;
+      // Dropped along with the OP_POP of its expression statement
+      if (instruction.dead && i + 1 < blocks_[b].end && code_[i + 1].op == OP_POP) {
+        instruction.skip = true;
+        code_[i + 1].skip = true;
+      }
+    }
+  }
+  return true;
+}
+
+
+bool IrFunction::Lower() {
+  struct Fixup {
+    size_t offset;
+    int block;
+  };
+  std::vector<Fixup> fixups;
+
+  for (size_t h = 0; h < homes_.size(); h++) Emit(OP_NULL, nullptr, code_[0].line);
+
+  for (int b = 0; b < (int)blocks_.size(); b++) {
+    Block& block = blocks_[b];
+    if (block.order == -1) continue;
+
+    for (const Loop& loop : loops_) {
+      if (loop.header != b) continue;
+      for (int i : loop.hoisted) {
+        if (!EmitHoisted(loop, i)) return false;
+      }
+    }
+    block.label = out_code_.size();
+
+    for (int i = block.begin; i < block.end; i++) {
+      Instruction& instruction = code_[i];
+      if (instruction.skip) continue;
+
+      if (instruction.dead) {
+        Emit(OP_NULL, nullptr, instruction.line);
+        continue;
+      }
+      if (instruction.hoisted != -1 || instruction.reuse != -1) {
+        int value = instruction.hoisted != -1 ? instruction.result : instruction.reuse;
+        EmitByteOp(OP_GET_LOCAL, values_[value].home, instruction.line);
+        continue;
+      }
+
+      switch (instruction.op) {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+          EmitByteOp(instruction.op, MapSlot(instruction.operands[0]), instruction.line);
+          break;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+          fixups.push_back({out_code_.size(), instruction.target});
+          Emit(instruction.op, instruction.operands, instruction.line);
+          break;
+        default:
+          Emit(instruction.op, instruction.operands, instruction.line);
+      }
+
+      int result = instruction.result;
+      if (result != -1 && values_[result].home != -1 && values_[result].instruction == i
+          && values_[result].kind == VALUE_DEFINED) {
+        EmitByteOp(OP_SET_LOCAL, values_[result].home, instruction.line);
+      }
+    }
+  }
+
+  for (const Fixup& fixup : fixups) {
+    int label = blocks_[fixup.block].label;
+    int from = fixup.offset + 3;
+    int jump = out_code_[fixup.offset] == OP_LOOP ? from - label : label - from;
+    if (jump < 0 || jump > UINT16_MAX) return false;
+
+    abi::NumericData data;
+    data.u16[0] = jump;
+    out_code_[fixup.offset + 1] = data.u8[0];
+    out_code_[fixup.offset + 2] = data.u8[1];
+  }
+  return true;
+}
+
+
+bool IrFunction::EmitHoisted(const Loop& loop, int i) {
+  const Instruction& instruction = code_[i];
+  const Block& before = blocks_[loop.header - 1];
+
+  for (int arg : instruction.args) {
+    arg = Resolve(arg);
+    const Value& value = values_[arg];
+    int slot;
+    if (value.kind == VALUE_DEFINED && code_[value.instruction].hoisted != -1) {
+      EmitByteOp(OP_GET_LOCAL, value.home, instruction.line);
+    } else if (value.kind == VALUE_DEFINED && IsConstantOp(code_[value.instruction].op)) {
+      const Instruction& constant = code_[value.instruction];
+      Emit(constant.op, constant.operands, instruction.line);
+    } else if (FindInSlot(arg, before, &slot)) {
+      EmitByteOp(OP_GET_LOCAL, MapSlot(slot), instruction.line);
+    } else {
+      return false;
+    }
+  }
+  Emit(instruction.op, instruction.operands, instruction.line);
+  EmitByteOp(OP_SET_LOCAL, values_[instruction.result].home, instruction.line);
+  Emit(OP_POP, nullptr, instruction.line);
+  return true;
+}
+
+
+int IrFunction::Resolve(int value) const {
+  while (forward_[value] != value) value = forward_[value];
+  return value;
+}
+
+
+int IrFunction::NewValue(ValueKind kind, int block, int instruction) {
+  Value value;
+  value.kind = kind;
+  value.block = block;
+  value.instruction = instruction;
+  values_.push_back(value);
+  return values_.size() - 1;
+}
+
+
+bool IrFunction::IsPure(int instruction) const {
+  return IsPureOp(code_[instruction].op);
+}
+
+
+bool IrFunction::IsSafe(int instruction) const {
+  const Instruction& in = code_[instruction];
+  switch (in.op) {
+    case OP_NOT:
+    case OP_EQUAL:
+      return true;
+    case OP_NEGATE:
+      return values_[Resolve(in.args[0])].number;
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      return values_[Resolve(in.args[0])].number && values_[Resolve(in.args[1])].number;
+    default:
+      return false;
+  }
+}
+
+
+bool IrFunction::Dominates(int a, int b) const {
+  for (;;) {
+    if (a == b) return true;
+    if (b == 0) return false;
+    b = blocks_[b].idom;
+  }
+}
+
+
+bool IrFunction::IsInvariant(int value, const Loop& loop) const {
+  const Value& v = values_[value];
+  switch (v.kind) {
+    case VALUE_ENTRY: return true;
+    case VALUE_PHI:   return !loop.blocks[v.block];
+    default: break;
+  }
+
+  const Instruction& definition = code_[v.instruction];
+  if (IsConstantOp(definition.op)) return true;
+  // Hoisted in front of this loop, or one around it
+  if (definition.hoisted != -1) return loops_[definition.hoisted].blocks[loop.header];
+  return !loop.blocks[definition.block];
+}
+
+
+bool IrFunction::FindInSlot(int value, const Block& block, int* slot) const {
+  for (int s = 0; s < (int)block.exit.size(); s++) {
+    if (Resolve(block.exit[s]) == value) {
+      *slot = s;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+// Whether nothing before `instruction` in its block can fail or be seen
+bool IrFunction::IsQuietBefore(int instruction) const {
+  for (int j = blocks_[code_[instruction].block].begin; j < instruction; j++) {
+    uint8_t op = code_[j].op;
+    bool quiet = IsConstantOp(op) || op == OP_GET_LOCAL
+              || (IsPureOp(op) && (IsSafe(j) || code_[j].hoisted != -1));
+    if (!quiet) return false;
+  }
+  return true;
+}
+
+
+// First of the instructions just before `instruction` that push its
+// operands, -1 if they do anything else
+int IrFunction::OperandTreeStart(int instruction) const {
+  const Block& block = blocks_[code_[instruction].block];
+  int need = PureArgCount(code_[instruction].op);
+  int j = instruction;
+  while (need > 0) {
+    if (--j < block.begin) return -1;
+    uint8_t op = code_[j].op;
+    if (IsConstantOp(op) || op == OP_GET_LOCAL) {
+      need--;
+    } else if (IsPureOp(op)) {
+      need += PureArgCount(op) - 1;
+    } else {
+      return -1;
+    }
+  }
+  return j;
+}
+
+
+int IrFunction::MapSlot(int slot) const {
+  return slot < base_ ? slot : slot + homes_.size();
+}
+
+
+void IrFunction::Emit(uint8_t op, const uint8_t* operands, int line) {
+  int size = Chunk::InstructionSize(op);
+  out_code_.push_back(op);
+  out_lines_.push_back(line);
+  for (int i = 1; i < size; i++) {
+    out_code_.push_back(operands[i - 1]);
+    out_lines_.push_back(-1);
+  }
+}
+
+
+void IrFunction::EmitByteOp(uint8_t op, int operand, int line) {
+  uint8_t operands[1] = {(uint8_t)operand};
+  Emit(op, operands, line);
+}
@@ -0,0 +1,126 @@
+#ifndef FF_COMPILER_IR_H_
+#define FF_COMPILER_IR_H_
+
+#include <vector>
+
+#include "core/chunk.h"
+#include "core/object.h"
+
+// Whole-function tier between the compiler and the final Chunk, for -O2.
+// The compiler's stack code is split into a control flow graph, and every
+// stack slot (local or temporary) is turned into SSA values, with phis
+// where paths join, which makes copies through locals disappear. On that:
+// - common subexpressions are computed once, where they dominate the others
+// - loop invariant computations that can't fail move in front of the loop
+// - computations whose value is never used are dropped
+// The result is lowered back into stack code, where values that have to
+// outlive their place on the stack get extra slots at the bottom of the
+// frame, in front of the locals.
+class IrFunction {
+ private:
+  enum ValueKind {
+    VALUE_ENTRY,  // Callee or argument
+    VALUE_PHI,
+    VALUE_DEFINED,
+  };
+
+  struct Value {
+    ValueKind kind;
+    int block;
+    int instruction;         // Defining instruction, for VALUE_DEFINED
+    std::vector<int> inputs; // One per predecessor, for VALUE_PHI
+    bool number = false;     // Known to hold a number whenever it exists
+    int uses = 0;
+    int home = -1;           // Extra frame slot it is kept in
+  };
+
+  struct Instruction {
+    uint8_t op;
+    uint8_t operands[4];
+    int line;
+    int block;
+    int target = -1;       // Instruction a jump goes to, then its block
+    std::vector<int> args; // Values it reads, deepest first
+    int result = -1;       // Value it pushes
+
+    // Lowering
+    int reuse = -1;        // Value to load instead of computing it
+    int hoisted = -1;      // Loop it is computed in front of
+    bool dead = false;
+    bool skip = false;
+  };
+
+  struct Block {
+    int begin = 0;
+    int end = 0;
+    std::vector<int> predecessors;
+    std::vector<int> successors;
+    std::vector<int> entry; // Value in each stack slot on entry
+    std::vector<int> exit;
+    int order = -1;         // Reverse postorder, -1 when unreachable
+    int idom = -1;
+    std::vector<int> children;
+    int label = -1;
+  };
+
+  struct Loop {
+    int header = -1;
+    std::vector<bool> blocks;
+    bool hoistable = false;   // Entered only by falling into the header
+    std::vector<int> hoisted; // Instructions computed in front of it
+  };
+
+ private:
+  ObjFunction* function_;
+  Chunk& chunk_;
+  int base_; // First slot after the callee and its arguments
+
+  std::vector<Instruction> code_;
+  std::vector<Block> blocks_;
+  std::vector<int> order_; // Reachable blocks in reverse postorder
+  std::vector<Value> values_;
+  std::vector<int> forward_; // Trivial phis point at the value they copy
+  std::vector<Loop> loops_;
+  std::vector<int> homes_;   // Values with an extra slot, in slot order
+
+  std::vector<uint8_t> out_code_;
+  std::vector<int> out_lines_;
+
+ public:
+  // Returns whether the chunk was rewritten
+  static bool Optimize(ObjFunction* function);
+
+ private:
+  IrFunction(ObjFunction* function);
+
+  bool Decode();
+  bool BuildBlocks();
+  bool BuildValues();
+  void RemoveTrivialPhis();
+  void FindDominators();
+  void FindLoops();
+
+  void InferNumbers();
+  void EliminateCommonSubexpressions();
+  void HoistLoopInvariants();
+  void FindDeadCode();
+  bool Plan();
+  bool Lower();
+
+  int Resolve(int value) const;
+  int NewValue(ValueKind kind, int block, int instruction = -1);
+  bool IsPure(int instruction) const;
+  bool IsSafe(int instruction) const;
+  bool IsQuietBefore(int instruction) const;
+  bool Dominates(int a, int b) const;
+  bool IsInvariant(int value, const Loop& loop) const;
+  bool FindInSlot(int value, const Block& block, int* slot) const;
+  int OperandTreeStart(int instruction) const;
+
+  int MapSlot(int slot) const;
+  void Emit(uint8_t op, const uint8_t* operands, int line);
+  void EmitByteOp(uint8_t op, int operand, int line);
+  bool EmitHoisted(const Loop& loop, int instruction);
+};
+
+#endif
@@ -0,0 +1,514 @@
+#include "compiler/optimizer.h"
+
+#include "compiler/ir.h"
+#include "core/config.h"
+#include "core/memory.h"
+#include "utils/abi.h"
+
+#include <cstdint>
+#include <cstring>
+
+
+// Rewriting stops here even if a pass still finds something
+constexpr int kMaxRounds = 16;
+constexpr int kMaxJumpHops = 8;
+
+
+static inline bool IsJump(uint8_t op) {
+  switch (op) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// OP_JUMP and OP_LOOP are the same jump in two directions, the
+// conditional ones only go forward
+static inline bool IsUnconditional(uint8_t op) {
+  return op == OP_JUMP || op == OP_LOOP;
+}
+
+static inline bool EndsBlock(uint8_t op) {
+  return IsUnconditional(op) || op == OP_RETURN;
+}
+
+
+Optimizer::Optimizer(ObjFunction* function)
+  : function_(function), chunk_(function->chunk) {}
+
+
+void Optimizer::Optimize(ObjFunction* function, int level) {
+  if (level <= 0) return;
+  if (level >= 2) IrFunction::Optimize(function);
+
+  Optimizer optimizer(function);
+  if (!optimizer.Decode()) return;
+
+  bool rewritten = false;
+  for (int round = 0; round < kMaxRounds; round++) {
+    optimizer.changed_ = false;
+    optimizer.Pass();
+    if (!optimizer.changed_) break;
+    rewritten = true;
+  }
+
+  if (rewritten) optimizer.Encode();
+}
+
+
+bool Optimizer::Decode() {
+  const std::vector<uint8_t>& code = chunk_.code;
+  std::vector<int> index(code.size() + 1, -1);
+  std::vector<int> offsets;
+
+  for (int offset = 0; offset < (int)code.size(); ) {
+    uint8_t op = code[offset];
+    int size = Chunk::InstructionSize(op);
+    // Quickened code has already run, and is left alone
+    if (op >= OP_ADD_NUM || offset + size > (int)code.size()) return false;
+
+    Instruction instruction = {op, {}, chunk_.GetLine(offset), -1, true};
+    memcpy(instruction.operands, &code[offset + 1], size - 1);
+    index[offset] = code_.size();
+    offsets.push_back(offset);
+    code_.push_back(instruction);
+    offset += size;
+  }
+  index[code.size()] = code_.size();
+
+  incoming_.assign(code_.size() + 1, 0);
+  for (int i = 0; i < (int)code_.size(); i++) {
+    Instruction& instruction = code_[i];
+    if (!IsJump(instruction.op)) continue;
+
+    int jump = abi::ReadU16(instruction.operands);
+    int target = instruction.op == OP_LOOP ? offsets[i] + 3 - jump : offsets[i] + 3 + jump;
+    if (target < 0 || target > (int)code.size() || index[target] == -1) return false;
+    instruction.target = index[target];
+    incoming_[instruction.target]++;
+  }
+  return true;
+}
+
+
+bool Optimizer::Encode() {
+  int count = code_.size();
+  std::vector<int> offsets(count + 1);
+  int offset = 0;
+  for (int i = 0; i < count; i++) {
+    offsets[i] = offset;
+    if (code_[i].live) offset += Chunk::InstructionSize(code_[i].op);
+  }
+  offsets[count] = offset;
+
+  std::vector<uint8_t> code;
+  code.reserve(offset);
+  for (int i = 0; i < count; i++) {
+    Instruction& instruction = code_[i];
+    if (!instruction.live) continue;
+
+    if (IsJump(instruction.op)) {
+      // Targets of removed instructions moved on to the next live one
+      int target = instruction.target;
+      while (target < count && !code_[target].live) target++;
+      int jump = offsets[target] - (offsets[i] + 3);
+      if (IsUnconditional(instruction.op)) {
+        instruction.op = jump < 0 ? OP_LOOP : OP_JUMP;
+        if (jump < 0) jump = -jump;
+      }
+      if (jump < 0 || jump > UINT16_MAX) return false;
+
+      abi::NumericData data;
+      data.u16[0] = jump;
+      instruction.operands[0] = data.u8[0];
+      instruction.operands[1] = data.u8[1];
+    }
+
+    code.push_back(instruction.op);
+    code.insert(code.end(), instruction.operands,
+                instruction.operands + Chunk::InstructionSize(instruction.op) - 1);
+  }
+
+  chunk_.code.clear();
+  chunk_.lines.clear();
+  for (int i = 0; i < count; i++) {
+    if (!code_[i].live) continue;
+    int size = Chunk::InstructionSize(code_[i].op);
+    for (int byte = 0; byte < size; byte++) {
+      chunk_.AppendCode(code[offsets[i] + byte], byte == 0 ? code_[i].line : -1);
+    }
+  }
+  return true;
+}
+
+
+void Optimizer::Pass() {
+  for (int i = 0; i < (int)code_.size(); i++) {
+    if (!code_[i].live) continue;
+
+    if (FoldUnary(i) || FoldBinary(i) || FoldBranch(i) || RemovePushPop(i)
+        || RemoveStoreLoad(i) || FuseBranch(i) || FuseTest(i) || ThreadJump(i)) {
+      continue;
+    }
+    RemoveDeadCode(i);
+  }
+  RemoveUnreachable();
+}
+
+
+// -x and !x of a constant
+bool Optimizer::FoldUnary(int i) {
+  uint8_t op = code_[i].op;
+  if ((op != OP_NOT && op != OP_NEGATE) || IsLabel(i)) return false;
+
+  int operand = Previous(i);
+  if (!IsConstant(operand)) return false;
+
+  Value value = ConstantAt(operand);
+  if (op == OP_NEGATE && !value.IsNumber()) return false;
+
+  Kill(operand);
+  SetConstant(i, op == OP_NOT ? Value(value.IsFalse()) : Value(-value.AsNumber()));
+  return true;
+}
+
+
+// Arithmetic and comparisons on two constants, where the result is the one
+// the VM would compute and can't fail
+bool Optimizer::FoldBinary(int i) {
+  uint8_t op = code_[i].op;
+  switch (op) {
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      break;
+    default:
+      return false;
+  }
+
+  int right = Previous(i);
+  if (IsLabel(i) || !IsConstant(right) || IsLabel(right)) return false;
+  int left = Previous(right);
+  if (!IsConstant(left)) return false;
+
+  Value a = ConstantAt(left);
+  Value b = ConstantAt(right);
+  Value result;
+  if (op == OP_EQUAL) {
+    result = Value(a == b);
+  } else if (a.IsNumber() && b.IsNumber()) {
+    NumberType x = a.AsNumber();
+    NumberType y = b.AsNumber();
+    switch (op) {
+      case OP_GREATER:  result = Value(x > y); break;
+      case OP_LESS:     result = Value(x < y); break;
+      case OP_ADD:      result = Value(x + y); break;
+      case OP_SUBTRACT: result = Value(x - y); break;
+      case OP_MULTIPLY: result = Value(x * y); break;
+      case OP_DIVIDE:   result = Value(x / y); break;
+    }
+  } else if (op == OP_ADD && a.IsString() && b.IsString()) {
+    // Long results would be ropes, and copies in the constant pool
+    if (a.AsString()->length + b.AsString()->length >= kRopeMinLength) return false;
+    result = ObjString::Concat(a.AsString(), b.AsString())->AsValue();
+  } else if (op == OP_ADD && a.IsString() && b.IsNumber()) {
+    if (a.AsString()->length + kNumberBufferSize >= kRopeMinLength) return false;
+    result = ObjString::Concat(a.AsString(), b.AsNumber())->AsValue();
+  } else {
+    return false;
+  }
+
+  Kill(right);
+  Kill(left);
+  SetConstant(i, result);
+  return true;
+}
+
+
+// A test of a constant either always jumps or never does
+bool Optimizer::FoldBranch(int i) {
+  uint8_t op = code_[i].op;
+  if ((op != OP_JUMP_IF_FALSE && op != OP_POP_JUMP_IF_FALSE && op != OP_POP_JUMP_IF_TRUE)
+      || IsLabel(i)) {
+    return false;
+  }
+
+  int condition = Previous(i);
+  if (!IsConstant(condition)) return false;
+
+  bool truthy = !ConstantAt(condition).IsFalse();
+  bool jumps = op == OP_POP_JUMP_IF_TRUE ? truthy : !truthy;
+  // OP_JUMP_IF_FALSE leaves the constant for the OP_POPs on both edges
+  if (op != OP_JUMP_IF_FALSE) Kill(condition);
+  if (jumps) {
+    code_[i].op = OP_JUMP;
+    changed_ = true;
+  } else {
+    Kill(i);
+  }
+  return true;
+}
+
+
+// Expression statements whose value is a constant or a local
+bool Optimizer::RemovePushPop(int i) {
+  if (code_[i].op != OP_POP || IsLabel(i)) return false;
+
+  int push = Previous(i);
+  if (push < 0 || (!IsConstant(push) && code_[push].op != OP_GET_LOCAL)) return false;
+
+  Kill(i);
+  Kill(push);
+  return true;
+}
+
+
+// `x = ...; x` leaves the stored value on the stack
+bool Optimizer::RemoveStoreLoad(int i) {
+  if (code_[i].op != OP_POP || IsLabel(i)) return false;
+
+  int store = Previous(i);
+  int load = Next(i);
+  if (store < 0 || load >= (int)code_.size() || IsLabel(load)) return false;
+
+  uint8_t expected;
+  switch (code_[store].op) {
+    case OP_SET_LOCAL:       expected = OP_GET_LOCAL; break;
+    case OP_SET_GLOBAL:      expected = OP_GET_GLOBAL; break;
+    case OP_SET_GLOBAL_LONG: expected = OP_GET_GLOBAL_LONG; break;
+    default:
+      return false;
+  }
+  int size = Chunk::InstructionSize(expected) - 1;
+  if (code_[load].op != expected
+      || memcmp(code_[load].operands, code_[store].operands, size) != 0) {
+    return false;
+  }
+
+  Kill(i);
+  Kill(load);
+  return true;
+}
+
+
+// `if` and `while` pop the condition at the start of both edges. When the
+// jump is the only way to reach its OP_POP, both go into one instruction.
+bool Optimizer::FuseBranch(int i) {
+  if (code_[i].op != OP_JUMP_IF_FALSE) return false;
+
+  int fallthrough = Next(i);
+  int target = Target(i);
+  if (fallthrough >= (int)code_.size() || code_[fallthrough].op != OP_POP
+      || IsLabel(fallthrough)) {
+    return false;
+  }
+  if (target >= (int)code_.size() || code_[target].op != OP_POP || incoming_[target] != 1) {
+    return false;
+  }
+  int before = Previous(target);
+  if (before < 0 || !EndsBlock(code_[before].op)) return false;
+
+  code_[i].op = OP_POP_JUMP_IF_FALSE;
+  Kill(fallthrough);
+  Kill(target);
+  return true;
+}
+
+
+// Comparisons and negations feeding a popping jump
+bool Optimizer::FuseTest(int i) {
+  uint8_t op = code_[i].op;
+  if ((op != OP_POP_JUMP_IF_FALSE && op != OP_POP_JUMP_IF_TRUE) || IsLabel(i)) return false;
+
+  int test = Previous(i);
+  if (test < 0) return false;
+
+  bool if_true = op == OP_POP_JUMP_IF_TRUE;
+  switch (code_[test].op) {
+    case OP_NOT:
+      code_[i].op = if_true ? OP_POP_JUMP_IF_FALSE : OP_POP_JUMP_IF_TRUE;
+      break;
+    case OP_LESS:
+      code_[i].op = if_true ? OP_JUMP_IF_LESS : OP_JUMP_IF_NOT_LESS;
+      break;
+    case OP_GREATER:
+      code_[i].op = if_true ? OP_JUMP_IF_GREATER : OP_JUMP_IF_NOT_GREATER;
+      break;
+    default:
+      return false;
+  }
+  // Runtime errors are reported on the line of the comparison
+  if (code_[test].op != OP_NOT) code_[i].line = code_[test].line;
+  Kill(test);
+  return true;
+}
+
+
+// Jumps to unconditional jumps go straight to where those lead, and jumps
+// to the next instruction go away
+bool Optimizer::ThreadJump(int i) {
+  uint8_t op = code_[i].op;
+  if (!IsJump(op)) return false;
+
+  int target = Target(i);
+  int final = target;
+  for (int hops = 0; hops < kMaxJumpHops; hops++) {
+    if (final >= (int)code_.size() || final == i || !IsUnconditional(code_[final].op)) break;
+    int next = Target(final);
+    if (!IsUnconditional(op) && next <= i) break;
+    final = next;
+  }
+
+  if (IsUnconditional(op) && final == Next(i)) {
+    Kill(i);
+    return true;
+  }
+  if (final == target) return false;
+
+  SetTarget(i, final);
+  return true;
+}
+
+
+// Nothing falls through an unconditional jump or a return
+bool Optimizer::RemoveDeadCode(int i) {
+  if (!EndsBlock(code_[i].op)) return false;
+
+  bool removed = false;
+  for (int j = Next(i); j < (int)code_.size() && !IsLabel(j); j = Next(j)) {
+    Kill(j);
+    removed = true;
+  }
+  return removed;
+}
+
+
+// What RemoveDeadCode can't see: a loop nothing outside jumps into still
+// has its own jump landing on it
+void Optimizer::RemoveUnreachable() {
+  int count = code_.size();
+  std::vector<bool> reached(count, false);
+  std::vector<int> worklist = {Next(-1)};
+  while (!worklist.empty()) {
+    int i = worklist.back();
+    worklist.pop_back();
+    if (i >= count || reached[i]) continue;
+
+    reached[i] = true;
+    if (IsJump(code_[i].op)) worklist.push_back(Target(i));
+    if (!EndsBlock(code_[i].op)) worklist.push_back(Next(i));
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (code_[i].live && !reached[i]) Kill(i);
+  }
+}
+
+
+int Optimizer::Next(int i) const {
+  int next = i + 1;
+  while (next < (int)code_.size() && !code_[next].live) next++;
+  return next;
+}
+
+
+int Optimizer::Previous(int i) const {
+  int previous = i - 1;
+  while (previous >= 0 && !code_[previous].live) previous--;
+  return previous;
+}
+
+
+int Optimizer::Target(int i) {
+  int& target = code_[i].target;
+  while (target < (int)code_.size() && !code_[target].live) target++;
+  return target;
+}
+
+
+bool Optimizer::IsLabel(int i) const {
+  return incoming_[i] > 0;
+}
+
+
+bool Optimizer::IsConstant(int i) const {
+  if (i < 0) return false;
+  switch (code_[i].op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NULL:
+    case OP_TRUE:
+    case OP_FALSE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+
+Value Optimizer::ConstantAt(int i) const {
+  const Instruction& instruction = code_[i];
+  switch (instruction.op) {
+    case OP_CONSTANT:      return chunk_.constants[instruction.operands[0]];
+    case OP_CONSTANT_LONG: return chunk_.constants[abi::ReadI32(instruction.operands)];
+    case OP_TRUE:          return Value(true);
+    case OP_FALSE:         return Value(false);
+    default:
+      return Value();
+  }
+}
+
+
+void Optimizer::SetConstant(int i, Value value) {
+  Instruction& instruction = code_[i];
+  changed_ = true;
+
+  if (value.IsType(VAL_NULL)) {
+    instruction.op = OP_NULL;
+  } else if (value.IsType(VAL_BOOL)) {
+    instruction.op = value.AsBool() ? OP_TRUE : OP_FALSE;
+  } else {
+    int constant = chunk_.AddConstant(value);
+    memory::WriteBarrier(function_, value);
+    if (constant <= UINT8_MAX) {
+      instruction.op = OP_CONSTANT;
+      instruction.operands[0] = constant;
+    } else {
+      abi::NumericData data;
+      data.i32 = constant;
+      instruction.op = OP_CONSTANT_LONG;
+      memcpy(instruction.operands, data.u8, 4);
+    }
+  }
+}
+
+
+void Optimizer::SetTarget(int i, int target) {
+  incoming_[Target(i)]--;
+  incoming_[target]++;
+  code_[i].target = target;
+  changed_ = true;
+}
+
+
+// Jumps to a removed instruction land on the next live one instead
+void Optimizer::Kill(int i) {
+  if (IsJump(code_[i].op)) incoming_[Target(i)]--;
+  code_[i].live = false;
+  incoming_[Next(i)] += incoming_[i];
+  incoming_[i] = 0;
+  changed_ = true;
+}
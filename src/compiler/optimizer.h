@@ -0,0 +1,67 @@
+#ifndef FF_COMPILER_OPTIMIZER_H_
+#define FF_COMPILER_OPTIMIZER_H_
+
+#include <vector>
+
+#include "core/chunk.h"
+#include "core/object.h"
+
+// Peephole passes over a function's finished stack code: constant folding,
+// branches on constants, push/pop pairs, dead code, jump threading, and
+// fusing a test with the jump that consumes it. The code is decoded into a
+// list of instructions with jumps as indexes into it, rewritten until
+// nothing changes, and encoded back with fresh jump offsets and lines.
+class Optimizer {
+ private:
+  struct Instruction {
+    uint8_t op;
+    uint8_t operands[4];
+    int line;
+    int target; // Index of the instruction a jump lands on, -1 otherwise
+    bool live;
+  };
+
+ private:
+  ObjFunction* function_;
+  Chunk& chunk_;
+
+  // One past the last instruction stands for the end of the code
+  std::vector<Instruction> code_;
+  std::vector<int> incoming_; // Jumps landing on each instruction
+  bool changed_ = false;
+
+ public:
+  // Level 0 keeps the code as the compiler emitted it, 2 runs the IR tier
+  // first
+  static void Optimize(ObjFunction* function, int level);
+
+ private:
+  Optimizer(ObjFunction* function);
+
+  bool Decode();
+  bool Encode();
+  void Pass();
+
+  bool FoldUnary(int i);
+  bool FoldBinary(int i);
+  bool FoldBranch(int i);
+  bool RemovePushPop(int i);
+  bool RemoveStoreLoad(int i);
+  bool FuseBranch(int i);
+  bool FuseTest(int i);
+  bool ThreadJump(int i);
+  bool RemoveDeadCode(int i);
+  void RemoveUnreachable();
+
+  int Next(int i) const;
+  int Previous(int i) const;
+  int Target(int i);
+  bool IsLabel(int i) const;
+  bool IsConstant(int i) const;
+  Value ConstantAt(int i) const;
+  void SetConstant(int i, Value value);
+  void SetTarget(int i, int target);
+  void Kill(int i);
+};
+
+#endif
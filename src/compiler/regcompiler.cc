@@ -0,0 +1,485 @@
+#include "compiler/regcompiler.h"
+
+#include "utils/abi.h"
+#include "debug/disasm.h"
+
+#include <cstdint>
+
+
+static inline uint8_t GenericOp(uint8_t op) {
+  switch (op) {
+    case OP_ADD_NUM:
+    case OP_ADD_STR:       return OP_ADD;
+    case OP_SUBTRACT_NUM:  return OP_SUBTRACT;
+    case OP_MULTIPLY_NUM:  return OP_MULTIPLY;
+    case OP_DIVIDE_NUM:    return OP_DIVIDE;
+    case OP_GREATER_NUM:   return OP_GREATER;
+    case OP_LESS_NUM:      return OP_LESS;
+    default:
+      return op;
+  }
+}
+
+static inline bool IsJump(uint8_t op) {
+  switch (op) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static inline int JumpTarget(uint8_t op, int offset, const uint8_t* operands) {
+  int jump = abi::ReadU16(operands);
+  return op == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+
+RegCompiler::RegCompiler(ObjFunction* function)
+  : function_(function), chunk_(function->chunk), out_(function->regchunk) {}
+
+
+bool RegCompiler::Compile(ObjFunction* function) {
+  if (function->regchunk.ready) return true;
+  if (function->regchunk.stack_only) return false;
+
+  RegCompiler compiler(function);
+  if (!compiler.Run()) {
+    function->regchunk = RegChunk();
+    function->regchunk.stack_only = true;
+    return false;
+  }
+
+  function->regchunk.ready = true;
+#ifdef _DEBUG_DUMP_COMPILED
+  debug::DisassembleRegChunk(function->regchunk, function->chunk,
+                             function->name ? function->name->chars : "<script>");
+#endif
+  return true;
+}
+
+
+bool RegCompiler::Run() {
+  out_ = RegChunk();
+
+  // Frame starts with the callee and its arguments
+  for (int i = 0; i <= function_->arity; i++) {
+    Push(OPERAND_REGISTER);
+  }
+
+  FindLabels();
+
+  const std::vector<uint8_t>& code = chunk_.code;
+  for (offset_ = 0; offset_ < (int)code.size() && !failed_; ) {
+    uint8_t op = GenericOp(code[offset_]);
+    int size = Chunk::InstructionSize(op);
+    if (offset_ + size > (int)code.size()) {
+      Fail();
+      break;
+    }
+
+    if (is_label_[offset_]) BeginLabel();
+    if (reachable_) Instruction(op, &code[offset_ + 1]);
+
+    offset_ += size;
+  }
+
+  for (Fixup& fixup : fixups_) {
+    auto target = label_pc_.find(fixup.target);
+    if (target == label_pc_.end()) {
+      Fail();
+      break;
+    }
+    int jump = target->second - (fixup.instruction + 1);
+    if (jump < INT16_MIN || jump > INT16_MAX) {
+      Fail();
+      break;
+    }
+    RegInstruction& instruction = out_.code[fixup.instruction];
+    instruction = RegInstruction::ABx(instruction.op, instruction.a, (uint16_t)(int16_t)jump);
+  }
+
+  return !failed_ && out_.register_count <= UINT8_MAX;
+}
+
+
+void RegCompiler::FindLabels() {
+  const std::vector<uint8_t>& code = chunk_.code;
+  is_label_.assign(code.size() + 1, false);
+
+  for (int offset = 0; offset < (int)code.size(); ) {
+    uint8_t op = code[offset];
+    int size = Chunk::InstructionSize(op);
+    if (offset + size > (int)code.size()) break;
+
+    if (IsJump(op)) {
+      int target = JumpTarget(op, offset, &code[offset + 1]);
+      if (target < 0 || target > (int)code.size()) {
+        Fail();
+        return;
+      }
+      is_label_[target] = true;
+    }
+
+    offset += size;
+  }
+}
+
+
+void RegCompiler::BeginLabel() {
+  auto recorded = label_depth_.find(offset_);
+
+  if (reachable_) {
+    // Falling through: the compiler's own idea of the stack depth wins
+    MaterializeAll();
+  } else if (recorded != label_depth_.end()) {
+    stack_.resize(recorded->second, Operand{OPERAND_REGISTER, 0, -1});
+    reachable_ = true;
+  } else {
+    // Only reached by a later OP_LOOP (for increment clauses), which the
+    // compiler emits at the depth of the jump over it
+    reachable_ = true;
+  }
+
+  for (Operand& operand : stack_) {
+    operand = Operand{OPERAND_REGISTER, 0, -1};
+  }
+  label_depth_[offset_] = stack_.size();
+  label_pc_[offset_] = out_.code.size();
+}
+
+
+void RegCompiler::Instruction(uint8_t op, const uint8_t* operands) {
+  switch (op) {
+    case OP_CONSTANT:      Push(OPERAND_CONSTANT, operands[0]); break;
+    case OP_CONSTANT_LONG: {
+      int constant = abi::ReadI32(operands);
+      if (constant > UINT16_MAX) Fail();
+      Push(OPERAND_CONSTANT, constant);
+      break;
+    }
+    case OP_NULL:  Push(OPERAND_NULL); break;
+    case OP_TRUE:  Push(OPERAND_TRUE); break;
+    case OP_FALSE: Push(OPERAND_FALSE); break;
+    case OP_POP:   Pop(); break;
+    case OP_DEFINE_GLOBAL:            DefineGlobal(ROP_DEFINE_GLOBAL, operands[0]); break;
+    case OP_DEFINE_GLOBAL_LONG:       DefineGlobal(ROP_DEFINE_GLOBAL, abi::ReadI32(operands)); break;
+    case OP_DEFINE_CONST_GLOBAL:      DefineGlobal(ROP_DEFINE_CONST_GLOBAL, operands[0]); break;
+    case OP_DEFINE_CONST_GLOBAL_LONG: DefineGlobal(ROP_DEFINE_CONST_GLOBAL, abi::ReadI32(operands)); break;
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG: {
+      int slot = op == OP_GET_GLOBAL ? operands[0] : abi::ReadI32(operands);
+      if (slot > UINT16_MAX) Fail();
+      Emit(RegInstruction::ABx(ROP_GET_GLOBAL, stack_.size(), slot));
+      PushDefined();
+      break;
+    }
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG: {
+      int slot = op == OP_SET_GLOBAL ? operands[0] : abi::ReadI32(operands);
+      if (slot > UINT16_MAX) Fail();
+      Emit(RegInstruction::ABx(ROP_SET_GLOBAL, Source(Top()), slot));
+      break;
+    }
+    case OP_GET_LOCAL: {
+      int slot = operands[0];
+      if (slot >= (int)stack_.size()) {
+        Fail();
+        break;
+      }
+      Materialize(slot);
+      Push(OPERAND_LOCAL, slot);
+      break;
+    }
+    case OP_SET_LOCAL:  SetLocal(operands[0]); break;
+    case OP_NOT:        Unary(ROP_NOT); break;
+    case OP_NEGATE:     Unary(ROP_NEGATE); break;
+    case OP_EQUAL:      Binary(ROP_EQUAL, ROP_EQUALK); break;
+    case OP_GREATER:    Binary(ROP_GREATER, ROP_GREATERK); break;
+    case OP_LESS:       Binary(ROP_LESS, ROP_LESSK); break;
+    case OP_ADD:        Binary(ROP_ADD, ROP_ADDK); break;
+    case OP_SUBTRACT:   Binary(ROP_SUBTRACT, ROP_SUBTRACTK); break;
+    case OP_MULTIPLY:   Binary(ROP_MULTIPLY, ROP_MULTIPLYK); break;
+    case OP_DIVIDE:     Binary(ROP_DIVIDE, ROP_DIVIDEK); break;
+    case OP_JUMP:
+      Jump(ROP_JUMP, JumpTarget(op, offset_, operands));
+      reachable_ = false;
+      break;
+    case OP_JUMP_IF_FALSE: {
+      int target = JumpTarget(op, offset_, operands);
+      const std::vector<uint8_t>& code = chunk_.code;
+      // The condition is popped on both edges, so it does not need to be
+      // in its own slot, and can be tested wherever it already is.
+      bool popped = offset_ + 3 < (int)code.size() && code[offset_ + 3] == OP_POP
+                 && target < (int)code.size() && code[target] == OP_POP;
+      int condition;
+      if (popped) {
+        MaterializeAll(0, Top());
+        condition = Source(Top());
+      } else {
+        MaterializeAll();
+        condition = Top();
+      }
+      Jump(ROP_JUMP_IF_FALSE, target, condition);
+      break;
+    }
+    case OP_POP_JUMP_IF_FALSE:
+      PopJump(ROP_JUMP_IF_FALSE, JumpTarget(op, offset_, operands));
+      break;
+    case OP_POP_JUMP_IF_TRUE:
+      PopJump(ROP_JUMP_IF_TRUE, JumpTarget(op, offset_, operands));
+      break;
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+      Binary(ROP_LESS, ROP_LESSK);
+      PopJump(op == OP_JUMP_IF_LESS ? ROP_JUMP_IF_TRUE : ROP_JUMP_IF_FALSE,
+              JumpTarget(op, offset_, operands));
+      break;
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+      Binary(ROP_GREATER, ROP_GREATERK);
+      PopJump(op == OP_JUMP_IF_GREATER ? ROP_JUMP_IF_TRUE : ROP_JUMP_IF_FALSE,
+              JumpTarget(op, offset_, operands));
+      break;
+    case OP_LOOP: {
+      int target = JumpTarget(op, offset_, operands);
+      MaterializeAll();
+      auto pc = label_pc_.find(target);
+      if (pc == label_pc_.end() || label_depth_[target] != (int)stack_.size()) {
+        Fail();
+        break;
+      }
+      int jump = pc->second - ((int)out_.code.size() + 1);
+      if (jump < INT16_MIN) Fail();
+      Emit(RegInstruction::ABx(ROP_JUMP, 0, (uint16_t)(int16_t)jump));
+      reachable_ = false;
+      break;
+    }
+    case OP_PRINT:
+      Emit(RegInstruction::ABC(ROP_PRINT, Source(Top()), 0, 0));
+      Pop();
+      break;
+    case OP_CALL: {
+      int arg_count = operands[0];
+      int callee = (int)stack_.size() - 1 - arg_count;
+      if (callee < 0) {
+        Fail();
+        break;
+      }
+      MaterializeAll(callee);
+      Emit(RegInstruction::ABC(ROP_CALL, callee, arg_count, 0));
+      stack_.resize(callee);
+      PushDefined();
+      break;
+    }
+    case OP_FORMAT: {
+      int count = operands[0];
+      int first = (int)stack_.size() - count;
+      if (count == 0 || first < 0) {
+        Fail();
+        break;
+      }
+      MaterializeAll(first);
+      Emit(RegInstruction::ABC(ROP_FORMAT, first, count, 0));
+      stack_.resize(first);
+      PushDefined();
+      break;
+    }
+    case OP_RETURN:
+      Emit(RegInstruction::ABC(ROP_RETURN, Source(Top()), 0, 0));
+      Pop();
+      reachable_ = false;
+      break;
+    default:
+      Fail();
+      break;
+  }
+}
+
+
+void RegCompiler::Emit(RegInstruction instruction) {
+  out_.Append(instruction, chunk_.GetLine(offset_));
+}
+
+
+void RegCompiler::Fail() {
+  failed_ = true;
+}
+
+
+void RegCompiler::Push(OperandKind kind, int index, int def) {
+  stack_.push_back(Operand{kind, index, def});
+  if ((int)stack_.size() > out_.register_count) {
+    out_.register_count = stack_.size();
+  }
+}
+
+
+void RegCompiler::PushDefined() {
+  Push(OPERAND_REGISTER, 0, out_.code.size() - 1);
+}
+
+
+RegCompiler::Operand RegCompiler::Pop() {
+  if (stack_.empty()) {
+    Fail();
+    return Operand{OPERAND_REGISTER, 0, -1};
+  }
+  Operand operand = stack_.back();
+  stack_.pop_back();
+  return operand;
+}
+
+
+int RegCompiler::Top() const {
+  return stack_.empty() ? 0 : (int)stack_.size() - 1;
+}
+
+
+void RegCompiler::Materialize(int position) {
+  if (position < 0 || position >= (int)stack_.size()) {
+    Fail();
+    return;
+  }
+
+  Operand& operand = stack_[position];
+  switch (operand.kind) {
+    case OPERAND_REGISTER: return;
+    case OPERAND_LOCAL:    Emit(RegInstruction::ABC(ROP_MOVE, position, operand.index, 0)); break;
+    case OPERAND_CONSTANT: Emit(RegInstruction::ABx(ROP_LOADK, position, operand.index)); break;
+    case OPERAND_NULL:     Emit(RegInstruction::ABC(ROP_LOADNULL, position, 0, 0)); break;
+    case OPERAND_TRUE:     Emit(RegInstruction::ABC(ROP_LOADTRUE, position, 0, 0)); break;
+    case OPERAND_FALSE:    Emit(RegInstruction::ABC(ROP_LOADFALSE, position, 0, 0)); break;
+  }
+  operand = Operand{OPERAND_REGISTER, 0, (int)out_.code.size() - 1};
+}
+
+
+void RegCompiler::MaterializeAll(int from, int to) {
+  if (to == -1) to = stack_.size();
+  for (int i = from; i < to; i++) {
+    Materialize(i);
+  }
+}
+
+
+int RegCompiler::Source(int position) {
+  if (position < 0 || position >= (int)stack_.size()) {
+    Fail();
+    return 0;
+  }
+
+  const Operand& operand = stack_[position];
+  if (operand.kind == OPERAND_LOCAL) return operand.index;
+  Materialize(position);
+  return position;
+}
+
+
+void RegCompiler::Unary(RegOpCode op) {
+  int position = Top();
+  int source = Source(position);
+  Emit(RegInstruction::ABC(op, position, source, 0));
+  Pop();
+  PushDefined();
+}
+
+
+void RegCompiler::Binary(RegOpCode op, RegOpCode op_k) {
+  if (stack_.size() < 2) {
+    Fail();
+    return;
+  }
+
+  int position = Top() - 1;
+  Operand rhs = stack_[Top()];
+  if (rhs.kind == OPERAND_CONSTANT && rhs.index <= UINT8_MAX) {
+    int lhs = Source(position);
+    Emit(RegInstruction::ABC(op_k, position, lhs, rhs.index));
+  } else {
+    int lhs = Source(position);
+    int source = Source(Top());
+    Emit(RegInstruction::ABC(op, position, lhs, source));
+  }
+
+  Pop();
+  Pop();
+  PushDefined();
+}
+
+
+void RegCompiler::DefineGlobal(RegOpCode op, int slot) {
+  if (slot > UINT16_MAX) Fail();
+  Emit(RegInstruction::ABx(op, Source(Top()), slot));
+  Pop();
+}
+
+
+void RegCompiler::SetLocal(int slot) {
+  int top = Top();
+  if (slot >= top) {
+    if (slot != top) Fail();
+    return;
+  }
+
+  Operand& value = stack_[top];
+  if (value.kind == OPERAND_LOCAL && value.index == slot) return;
+
+  // Copies of the old value that are still pending need to be made now
+  for (int i = 0; i < (int)stack_.size(); i++) {
+    if (i != top && stack_[i].kind == OPERAND_LOCAL && stack_[i].index == slot) {
+      Materialize(i);
+    }
+  }
+
+  if (value.kind == OPERAND_REGISTER && value.def != -1 && value.def == (int)out_.code.size() - 1
+      && out_.code.back().op != ROP_CALL && out_.code.back().op != ROP_FORMAT) {
+    // Write the result straight into the local instead of the temporary
+    out_.code.back().a = slot;
+    value = Operand{OPERAND_LOCAL, slot, -1};
+  } else {
+    switch (value.kind) {
+      case OPERAND_REGISTER: Emit(RegInstruction::ABC(ROP_MOVE, slot, top, 0)); break;
+      case OPERAND_LOCAL:    Emit(RegInstruction::ABC(ROP_MOVE, slot, value.index, 0)); break;
+      case OPERAND_CONSTANT: Emit(RegInstruction::ABx(ROP_LOADK, slot, value.index)); break;
+      case OPERAND_NULL:     Emit(RegInstruction::ABC(ROP_LOADNULL, slot, 0, 0)); break;
+      case OPERAND_TRUE:     Emit(RegInstruction::ABC(ROP_LOADTRUE, slot, 0, 0)); break;
+      case OPERAND_FALSE:    Emit(RegInstruction::ABC(ROP_LOADFALSE, slot, 0, 0)); break;
+    }
+  }
+
+  stack_[slot] = Operand{OPERAND_REGISTER, 0, -1};
+}
+
+
+void RegCompiler::Jump(RegOpCode op, int target, int condition) {
+  if (op == ROP_JUMP) MaterializeAll();
+  RecordLabelDepth(target);
+  fixups_.push_back(Fixup{(int)out_.code.size(), target});
+  Emit(RegInstruction::ABx(op, condition, 0));
+}
+
+
+// Tests the top of the stack where it is, and pops it on both edges
+void RegCompiler::PopJump(RegOpCode op, int target) {
+  MaterializeAll(0, Top());
+  int condition = Source(Top());
+  Pop();
+  Jump(op, target, condition);
+}
+
+
+void RegCompiler::RecordLabelDepth(int target) {
+  auto recorded = label_depth_.find(target);
+  if (recorded == label_depth_.end() || (int)stack_.size() < recorded->second) {
+    label_depth_[target] = stack_.size();
+  }
+}
@@ -0,0 +1,84 @@
+#ifndef FF_COMPILER_REGCOMPILER_H_
+#define FF_COMPILER_REGCOMPILER_H_
+
+#include <vector>
+#include <unordered_map>
+
+#include "core/chunk.h"
+#include "core/regchunk.h"
+#include "core/object.h"
+
+// Generates register code (RegChunk) for a function from its stack code.
+// Every stack position maps to the frame slot with the same index, and
+// pushes of locals/constants are tracked symbolically and folded into the
+// operands of the instruction that consumes them, so that `a + b` on
+// locals becomes a single `ADD r, a, b`.
+class RegCompiler {
+ private:
+  enum OperandKind {
+    OPERAND_REGISTER, // Value lives in its own slot
+    OPERAND_LOCAL,    // Same value as the (lower) slot `index`
+    OPERAND_CONSTANT, // Constant `index`, not loaded yet
+    OPERAND_NULL,
+    OPERAND_TRUE,
+    OPERAND_FALSE,
+  };
+
+  struct Operand {
+    OperandKind kind;
+    int index;
+    int def; // Instruction that wrote the slot, if it is the last one emitted
+  };
+
+  struct Fixup {
+    int instruction;
+    int target;
+  };
+
+ private:
+  ObjFunction* function_;
+  const Chunk& chunk_;
+  RegChunk& out_;
+
+  std::vector<Operand> stack_;
+  std::unordered_map<int, int> label_depth_;
+  std::unordered_map<int, int> label_pc_;
+  std::vector<bool> is_label_;
+  std::vector<Fixup> fixups_;
+  int offset_ = 0;
+  bool reachable_ = true;
+  bool failed_ = false;
+
+ public:
+  static bool Compile(ObjFunction* function);
+
+ private:
+  RegCompiler(ObjFunction* function);
+  bool Run();
+
+  void FindLabels();
+  void BeginLabel();
+  void Instruction(uint8_t op, const uint8_t* operands);
+
+  void Emit(RegInstruction instruction);
+  void Fail();
+
+  void Push(OperandKind kind, int index = 0, int def = -1);
+  void PushDefined();
+  Operand Pop();
+  int Top() const;
+
+  void Materialize(int position);
+  void MaterializeAll(int from = 0, int to = -1);
+  int Source(int position);
+
+  void Unary(RegOpCode op);
+  void Binary(RegOpCode op, RegOpCode op_k);
+  void DefineGlobal(RegOpCode op, int slot);
+  void SetLocal(int slot);
+  void Jump(RegOpCode op, int target, int condition = 0);
+  void PopJump(RegOpCode op, int target);
+  void RecordLabelDepth(int target);
+};
+
+#endif
@@ -4,16 +4,21 @@
 #include <cstring>
 #include <iostream>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-Scanner::Scanner(std::string& source) {
-  start_ = source.begin();
-  current_ = source.begin();
-  line_ = 1;
+
+Scanner::Scanner(std::string_view source, int line) {
+  start_ = source.data();
+  current_ = source.data();
+  end_ = source.data() + source.size();
+  line_ = line;
 }
 
 
 bool Scanner::IsAtEnd() const {
-  return *current_ == '\0';
+  return current_ == end_;
 }
 
 
@@ -39,27 +44,62 @@ char Scanner::Peek() const {
 
 
 char Scanner::PeekNext() const {
+  if (end_ - current_ < 2) return '\0';
   return current_[1];
 }
 
 
 void Scanner::SkipWhitespace() {
   for (;;) {
-    char c = Peek();
-    switch (c) {
+    switch (Peek()) {
+      case '\n':
+      case ' ':
+      case '\r':
+      case '\t':
+        SkipBlanks();
+        break;
+      case '/': {
+        if (PeekNext() != '/') return;
+        const char* newline = (const char*)memchr(current_, '\n', end_ - current_);
+        current_ = newline ? newline : end_;
+        break;
+      }
+      default:
+        return;
+    }
+  }
+}
+
+
+// Indentation and blank lines are skipped 16 bytes at a time
+void Scanner::SkipBlanks() {
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i carriage_return = _mm_set1_epi8('\r');
+  const __m128i newline = _mm_set1_epi8('\n');
+  while (end_ - current_ >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)current_);
+    __m128i newlines = _mm_cmpeq_epi8(chunk, newline);
+    __m128i blanks = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+                                  _mm_or_si128(_mm_cmpeq_epi8(chunk, carriage_return), newlines));
+    unsigned others = ~_mm_movemask_epi8(blanks) & 0xffff;
+    int skipped = others ? __builtin_ctz(others) : 16;
+    unsigned skipped_newlines = _mm_movemask_epi8(newlines) & ((1u << skipped) - 1);
+    line_ += __builtin_popcount(skipped_newlines);
+    current_ += skipped;
+    if (skipped < 16) return;
+  }
+#endif
+  while (!IsAtEnd()) {
+    switch (*current_) {
       case '\n':
         line_++; [[fallthrough]];
-      case ' ':  [[fallthrough]];
-      case '\r': [[fallthrough]];
+      case ' ':
+      case '\r':
       case '\t':
-        Advance();
+        current_++;
         break;
-      case '/':
-        if (PeekNext() == '/') {
-          while (Peek() != '\n' && !IsAtEnd()) Advance();
-        } else {
-          return;
-        }
       default:
         return;
     }
@@ -70,7 +110,7 @@ void Scanner::SkipWhitespace() {
 Token Scanner::MakeToken(TokenType type) const {
   Token token;
   token.type = type;
-  token.str = std::string(start_, current_);
+  token.str = std::string_view(start_, current_ - start_);
   token.line = line_;
   return token;
 }
@@ -85,8 +125,16 @@ Token Scanner::ErrorToken(const char* msg) const {
 }
 
 
+// Also scans the rest of a literal after an interpolated expression, in
+// which case the token starts with its closing brace
 Token Scanner::String() {
   while (Peek() != '"' && !IsAtEnd()) {
+    if (Peek() == '$' && PeekNext() == '{') {
+      Advance();
+      Advance();
+      interpolations_.push_back(0);
+      return MakeToken(TOKEN_INTERPOLATION);
+    }
     if (Peek() == '\n') line_++;
     Advance();
   }
@@ -178,19 +226,10 @@ TokenType Scanner::IdentifierType() const {
 
 
 TokenType Scanner::CheckKeyword(int start, int length, const char* rest, TokenType type) const {
-  if (current_ - start_ == start + length
-   && IterSeqEquBuffer(start_+start, rest, length)) {
+  if (current_ - start_ == start + length && memcmp(start_ + start, rest, length) == 0) {
     return type;
-   }
-   return TOKEN_IDENTIFIER;
-}
-
-
-bool Scanner::IterSeqEquBuffer(std::string::iterator itr, const char* buffer, int length) const {
-  for (int i = 0; i < length; i++, itr++) {
-    if (*itr != buffer[i]) return false;
   }
-  return true;
+  return TOKEN_IDENTIFIER;
 }
 
 
@@ -209,8 +248,20 @@ Token Scanner::ScanToken() {
   switch (c) {
     case '(': return MakeToken(TOKEN_LEFT_PAREN);
     case ')': return MakeToken(TOKEN_RIGHT_PAREN);
-    case '{': return MakeToken(TOKEN_LEFT_BRACE);
-    case '}': return MakeToken(TOKEN_RIGHT_BRACE);
+    case '{': {
+      if (!interpolations_.empty()) interpolations_.back()++;
+      return MakeToken(TOKEN_LEFT_BRACE);
+    }
+    case '}': {
+      if (!interpolations_.empty()) {
+        if (interpolations_.back() == 0) {
+          interpolations_.pop_back();
+          return String();
+        }
+        interpolations_.back()--;
+      }
+      return MakeToken(TOKEN_RIGHT_BRACE);
+    }
     case ';': return MakeToken(TOKEN_SEMICOLON);
     case ',': return MakeToken(TOKEN_COMMA);
     case '.': return MakeToken(TOKEN_DOT);
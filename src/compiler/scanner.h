@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <string>
 #include <string_view>
+#include <vector>
 
 
 enum TokenType : uint8_t {
@@ -22,6 +23,7 @@ enum TokenType : uint8_t {
 
   // Literals.
   TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
+  TOKEN_INTERPOLATION, // A piece of string literal followed by ${
 
   // Keywords.
   TOKEN_AND, TOKEN_BREAK, TOKEN_CLASS, TOKEN_CONTINUE,
@@ -35,21 +37,25 @@ enum TokenType : uint8_t {
 };
 
 
+// str points into the source, or is a static error message
 struct Token {
   TokenType type;
-  std::string str;
+  std::string_view str;
   int line;
 };
 
 
 class Scanner {
  private:
-  std::string::iterator start_;
-  std::string::iterator current_;
+  const char* start_;
+  const char* current_;
+  const char* end_;
   int line_;
+  // Braces opened inside each ${ that is still open, innermost last
+  std::vector<int> interpolations_;
 
  public:
-  Scanner(std::string& source);
+  Scanner(std::string_view source, int line = 1); // Must outlive the tokens
 
   Token ScanToken();
  
@@ -60,6 +66,7 @@ class Scanner {
   char Peek() const;
   char PeekNext() const;
   void SkipWhitespace();
+  void SkipBlanks();
 
   Token MakeToken(TokenType type) const;
   Token ErrorToken(const char* msg) const;
@@ -69,7 +76,6 @@ class Scanner {
   Token Identifier();
   TokenType IdentifierType() const;
   TokenType CheckKeyword(int start, int length, const char* rest, TokenType type) const;
-  bool IterSeqEquBuffer(std::string::iterator itr, const char* buffer, int length) const;
 };
 
 #endif
@@ -1,8 +1,25 @@
 #include "core/api.h"
 #include "core/vm.h"
+#include "core/memory.h"
 
 VMContext::VMContext(VM* vm_ptr) : handle_(vm_ptr) {}
 
+// The memory functions work on the active heap, which is another VM's (or
+// the thread's own) while this one isn't current
+class UsingHeap {
+ private:
+  memory::Heap* previous_;
+
+ public:
+  explicit UsingHeap(memory::Heap* heap) : previous_(memory::ActiveHeap()) {
+    memory::Activate(heap);
+  }
+
+  ~UsingHeap() {
+    memory::Activate(previous_);
+  }
+};
+
 void VMContext::RuntimeError(const char* fmt, ...) {
   va_list args;
   va_start(args, fmt);
@@ -28,17 +45,46 @@ Value VMContext::Peek(int distance) {
 
 Value VMContext::GetGlobal(const std::string& name) {
   ObjString* str = ObjString::FromStr(name);
-  auto variable = handle_->globals_.find(str);
-  if (variable != handle_->globals_.end()) {
-    return variable->second;
+  int slot = handle_->globals_.Find(str);
+  if (slot != -1 && handle_->globals_[slot].defined) {
+    return handle_->globals_[slot].value;
   }
   return Value(VAL_NULL);
 }
 
-const std::unordered_map<ObjString*, Value>& VMContext::GetGlobals() {
+const GlobalTable& VMContext::GetGlobals() {
   return handle_->globals_;
 }
 
-std::unordered_map<std::string, ObjString*>& VMContext::GetStrings() {
+StringTable& VMContext::GetStrings() {
   return handle_->strings;
 }
+
+NumberType VMContext::GetMaxGCPause() {
+  UsingHeap heap(&handle_->heap_);
+  return std::chrono::duration<NumberType, std::micro>(memory::GetMaxPause()).count();
+}
+
+memory::HeapStats VMContext::GetHeapStats() {
+  UsingHeap heap(&handle_->heap_);
+  return memory::GetHeapStats();
+}
+
+void VMContext::SetMemoryLimit(size_t bytes) {
+  UsingHeap heap(&handle_->heap_);
+  memory::SetMemoryLimit(bytes);
+}
+
+void VMContext::SetAllocationProfiling(bool enabled) {
+  UsingHeap heap(&handle_->heap_);
+  memory::SetAllocationProfiling(enabled);
+}
+
+std::vector<memory::AllocationSite> VMContext::GetAllocationProfile() {
+  UsingHeap heap(&handle_->heap_);
+  return memory::GetAllocationProfile();
+}
+
+OutputBuffer& VMContext::GetOutput() {
+  return handle_->GetOutput();
+}
@@ -1,11 +1,15 @@
 #ifndef FF_CORE_API_H_
 #define FF_CORE_API_H_
 
-#define FF_API_VERSION 1
+#define FF_API_VERSION 2
 
 #include "version.h"
 #include "core/value.h"
 #include "core/object.h"
+#include "core/globals.h"
+#include "core/memory.h"
+#include "core/stringtable.h"
+#include "core/output.h"
 
 #include <string>
 #include <vector>
@@ -31,8 +35,14 @@ class VMContext {
   int GetStackSize();
   Value Peek(int distance);
   Value GetGlobal(const std::string& name);
-  const std::unordered_map<ObjString*, Value>& GetGlobals();
-  std::unordered_map<std::string, ObjString*>& GetStrings();
+  const GlobalTable& GetGlobals();
+  StringTable& GetStrings();
+  NumberType GetMaxGCPause(); // In microseconds
+  memory::HeapStats GetHeapStats();
+  void SetMemoryLimit(size_t bytes); // 0 for no limit
+  void SetAllocationProfiling(bool enabled);
+  std::vector<memory::AllocationSite> GetAllocationProfile();
+  OutputBuffer& GetOutput(); // Where print writes
 };
 
 struct FFModuleSymbol {
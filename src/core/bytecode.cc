@@ -0,0 +1,428 @@
+#include "core/bytecode.h"
+
+#include "core/api.h"
+#include "core/memory.h"
+#include "core/vm.h"
+#include "utils/abi.h"
+#include "utils/thread_pool.h"
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+
+constexpr char kBytecodeMagic[4] = {'F', 'F', 'B', 'C'};
+// Bumped whenever the layout below, or the meaning of an opcode, changes
+constexpr uint32_t kBytecodeFormat = 2;
+// Deeper function nesting than this is taken for a damaged file
+constexpr int kMaxFunctionNesting = 256;
+
+enum ConstantTag : uint8_t {
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION,
+  CONSTANT_NULL,
+  CONSTANT_TRUE,
+  CONSTANT_FALSE,
+};
+
+// Functions being read on this thread aren't referenced by anything else yet
+static thread_local std::vector<ObjFunction*> loading;
+
+
+uint64_t HashSource(std::string_view source) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (char c : source) {
+    hash ^= (uint8_t)c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+
+void MarkBytecodeRoots() {
+  for (ObjFunction* function : loading) {
+    memory::MarkObject(function);
+  }
+}
+
+
+bool BytecodeWriter::Write(const std::string& path, ObjFunction* script, const GlobalTable& globals,
+                           uint64_t source_hash, int optimization_level) {
+  std::string image;
+  return Serialize(script, globals, source_hash, optimization_level, &image)
+      && WriteImage(path, image);
+}
+
+
+bool BytecodeWriter::Serialize(ObjFunction* script, const GlobalTable& globals,
+                               uint64_t source_hash, int optimization_level, std::string* image) {
+  BytecodeWriter writer;
+  writer.out_.append(kBytecodeMagic, sizeof(kBytecodeMagic));
+  writer.WriteRaw<uint32_t>(kBytecodeFormat);
+  writer.WriteRaw<uint32_t>(FF_API_VERSION);
+  writer.WriteRaw<uint32_t>(sizeof(NumberType));
+  writer.WriteRaw<uint64_t>(source_hash);
+  writer.WriteRaw<uint32_t>(optimization_level);
+
+  writer.WriteRaw<uint32_t>(globals.Size());
+  for (const GlobalVariable& global : globals) {
+    writer.WriteString(global.name->View());
+  }
+  if (!writer.WriteFunction(script)) return false;
+
+  *image = std::move(writer.out_);
+  return true;
+}
+
+
+bool BytecodeWriter::WriteImage(const std::string& path, std::string_view image) {
+  std::string temp_path = path + ".tmp";
+  FILE* file = fopen(temp_path.c_str(), "wb");
+  if (file == nullptr) return false;
+  bool written = fwrite(image.data(), 1, image.size(), file) == image.size();
+  written = fclose(file) == 0 && written;
+  if (!written || rename(temp_path.c_str(), path.c_str()) != 0) {
+    remove(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+
+// Compiled in a VM of its own, like `ff --compile` would, so the globals
+// start with the builtins. Its heap goes away with it.
+static std::string CompileImage(std::string_view source, int optimization_level) {
+  std::string image;
+  auto vm = std::make_unique<VM>();
+  vm->SetOptimizationLevel(optimization_level);
+  SetCurrent(*vm);
+  vm->InitBuiltins();
+  ObjFunction* script = vm->Compile(source);
+  if (script) {
+    BytecodeWriter::Serialize(script, vm->this_context.GetGlobals(), HashSource(source),
+                              optimization_level, &image);
+  }
+  return image;
+}
+
+
+std::vector<std::string> BytecodeWriter::CompileAll(const std::vector<std::string_view>& sources,
+                                                    unsigned threads, int optimization_level) {
+  std::vector<std::string> images(sources.size());
+  ThreadPool pool(threads);
+  for (size_t i = 0; i < sources.size(); i++) {
+    pool.Run([&images, &sources, i, optimization_level] {
+      images[i] = CompileImage(sources[i], optimization_level);
+    });
+  }
+  pool.Wait();
+  return images;
+}
+
+
+bool BytecodeWriter::WriteFunction(ObjFunction* function) {
+  const Chunk& chunk = function->chunk;
+  if (function->IsLazy()) return false;
+
+  WriteRaw<int32_t>(function->arity);
+  WriteRaw<uint8_t>(function->name != nullptr);
+  if (function->name) WriteString(function->name->View());
+
+  WriteRaw<uint32_t>(chunk.code.size());
+  out_.append((const char*)chunk.code.data(), chunk.code.size());
+
+  WriteRaw<uint32_t>(chunk.lines.size());
+  for (const auto& run : chunk.lines) {
+    WriteRaw<uint32_t>(run.start_offset);
+    WriteRaw<int32_t>(run.line);
+  }
+
+  WriteRaw<uint32_t>(chunk.constants.size());
+  for (Value constant : chunk.constants) {
+    if (constant.IsNumber()) {
+      WriteRaw<uint8_t>(CONSTANT_NUMBER);
+      WriteRaw<NumberType>(constant.AsNumber());
+    } else if (constant.IsString()) {
+      WriteRaw<uint8_t>(CONSTANT_STRING);
+      WriteString(constant.AsString()->View());
+    } else if (constant.IsObj() && constant.AsObj()->IsType(OBJ_FUNCTION)) {
+      WriteRaw<uint8_t>(CONSTANT_FUNCTION);
+      if (!WriteFunction((ObjFunction*)constant.AsObj())) return false;
+    } else if (constant.IsType(VAL_NULL)) {
+      WriteRaw<uint8_t>(CONSTANT_NULL);
+    } else if (constant.IsType(VAL_BOOL)) {
+      WriteRaw<uint8_t>(constant.AsBool() ? CONSTANT_TRUE : CONSTANT_FALSE);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+void BytecodeWriter::WriteString(std::string_view str) {
+  WriteRaw<uint32_t>(str.size());
+  out_.append(str.data(), str.size());
+}
+
+
+template <typename T>
+void BytecodeWriter::WriteRaw(T value) {
+  out_.append((const char*)&value, sizeof(value));
+}
+
+
+BytecodeReader::BytecodeReader(std::string_view image, GlobalTable& globals)
+  : data_((const uint8_t*)image.data()), size_(image.size()), globals_(globals) {}
+
+
+ObjFunction* BytecodeReader::Load(std::string_view image, GlobalTable& globals,
+                                  const uint64_t* source_hash, int optimization_level) {
+  BytecodeReader reader(image, globals);
+  if (!reader.ReadHeader(source_hash, optimization_level) || !reader.ReadGlobals()) return nullptr;
+
+  ObjFunction* script = reader.ReadFunction(0);
+  if (reader.position_ != reader.size_) return nullptr;
+  return script;
+}
+
+
+bool BytecodeReader::IsBytecode(std::string_view image) {
+  return image.size() >= sizeof(kBytecodeMagic)
+      && memcmp(image.data(), kBytecodeMagic, sizeof(kBytecodeMagic)) == 0;
+}
+
+
+bool BytecodeReader::ReadHeader(const uint64_t* source_hash, int optimization_level) {
+  const uint8_t* magic;
+  uint32_t format, api_version, number_size, level;
+  uint64_t hash;
+  if (!ReadBytes(sizeof(kBytecodeMagic), &magic)
+      || memcmp(magic, kBytecodeMagic, sizeof(kBytecodeMagic)) != 0) {
+    return false;
+  }
+  if (!ReadRaw(&format) || !ReadRaw(&api_version) || !ReadRaw(&number_size) || !ReadRaw(&hash)
+      || !ReadRaw(&level)) {
+    return false;
+  }
+  return format == kBytecodeFormat && api_version == FF_API_VERSION
+      && number_size == sizeof(NumberType) && (source_hash == nullptr || hash == *source_hash)
+      && (optimization_level == -1 || level == (uint32_t)optimization_level);
+}
+
+
+bool BytecodeReader::ReadGlobals() {
+  uint32_t count;
+  if (!ReadRaw(&count)) return false;
+
+  for (uint32_t i = 0; i < count; i++) {
+    std::string_view name;
+    if (!ReadString(&name)) return false;
+    global_slots_.push_back(globals_.Resolve(ObjString::FromStr(name)));
+  }
+  return true;
+}
+
+
+ObjFunction* BytecodeReader::ReadFunction(int depth) {
+  if (depth > kMaxFunctionNesting) return nullptr;
+
+  ObjFunction* function = ObjFunction::New();
+  loading.push_back(function);
+  bool read = ReadFunctionParts(function, depth);
+  loading.pop_back();
+  return read ? function : nullptr;
+}
+
+
+bool BytecodeReader::ReadFunctionParts(ObjFunction* function, int depth) {
+  Chunk& chunk = function->chunk;
+  int32_t arity;
+  uint8_t named;
+  if (!ReadRaw(&arity) || arity < 0 || arity > UINT8_MAX || !ReadRaw(&named)) return false;
+  function->arity = arity;
+  if (named) {
+    std::string_view name;
+    if (!ReadString(&name)) return false;
+    function->name = ObjString::FromStr(name);
+    memory::WriteBarrier(function, function->name->AsValue());
+  }
+
+  uint32_t code_size;
+  const uint8_t* code;
+  if (!ReadRaw(&code_size) || !ReadBytes(code_size, &code)) return false;
+  chunk.code.assign(code, code + code_size);
+
+  uint32_t run_count;
+  if (!ReadRaw(&run_count)) return false;
+  for (uint32_t i = 0; i < run_count; i++) {
+    uint32_t start_offset;
+    int32_t line;
+    if (!ReadRaw(&start_offset) || !ReadRaw(&line)) return false;
+    if (start_offset >= code_size || (i > 0 && start_offset <= chunk.lines.back().start_offset)) {
+      return false;
+    }
+    chunk.lines.push_back({start_offset, line});
+  }
+
+  uint32_t constant_count;
+  if (!ReadRaw(&constant_count)) return false;
+  for (uint32_t i = 0; i < constant_count; i++) {
+    if (!ReadConstant(function, depth)) return false;
+  }
+  return CheckCode(function);
+}
+
+
+bool BytecodeReader::ReadConstant(ObjFunction* function, int depth) {
+  uint8_t tag;
+  if (!ReadRaw(&tag)) return false;
+
+  Value constant;
+  switch (tag) {
+    case CONSTANT_NUMBER: {
+      NumberType number;
+      if (!ReadRaw(&number)) return false;
+      constant = Value(number);
+      break;
+    }
+    case CONSTANT_STRING: {
+      std::string_view str;
+      if (!ReadString(&str)) return false;
+      constant = ObjString::FromStr(str)->AsValue();
+      break;
+    }
+    case CONSTANT_FUNCTION: {
+      ObjFunction* nested = ReadFunction(depth + 1);
+      if (nested == nullptr) return false;
+      constant = nested->AsValue();
+      break;
+    }
+    case CONSTANT_NULL:  constant = Value(); break;
+    case CONSTANT_TRUE:  constant = Value(true); break;
+    case CONSTANT_FALSE: constant = Value(false); break;
+    default:
+      return false;
+  }
+  function->chunk.constants.push_back(constant);
+  memory::WriteBarrier(function, constant);
+  return true;
+}
+
+
+bool BytecodeReader::ReadString(std::string_view* str) {
+  uint32_t length;
+  const uint8_t* chars;
+  if (!ReadRaw(&length) || !ReadBytes(length, &chars)) return false;
+  *str = std::string_view((const char*)chars, length);
+  return true;
+}
+
+
+bool BytecodeReader::ReadBytes(size_t count, const uint8_t** bytes) {
+  if (count > size_ - position_) return false;
+  *bytes = data_ + position_;
+  position_ += count;
+  return true;
+}
+
+
+template <typename T>
+bool BytecodeReader::ReadRaw(T* value) {
+  const uint8_t* bytes;
+  if (!ReadBytes(sizeof(T), &bytes)) return false;
+  memcpy(value, bytes, sizeof(T));
+  return true;
+}
+
+
+// Every instruction has to fit, refer to a constant and a global that
+// exist, and jump to the start of another one. Global operands are moved to
+// the slots the names have in this VM. No instruction leaves more than one
+// value more on the stack, and only those below do, so the frame never
+// holds more than the callee, its arguments and one value for each of
+// them: a local slot, or a count of values to take, beyond that is damage.
+bool BytecodeReader::CheckCode(ObjFunction* function) {
+  Chunk& chunk = function->chunk;
+  std::vector<uint8_t>& code = chunk.code;
+  std::vector<bool> starts(code.size(), false);
+  int constant_count = chunk.constants.size();
+  int global_count = global_slots_.size();
+  int max_slots = 1 + function->arity;
+
+  for (size_t offset = 0; offset < code.size(); ) {
+    uint8_t op = code[offset];
+    // Quickened forms are never written, the VM makes them
+    if (op >= OP_ADD_NUM) return false;
+    int size = Chunk::InstructionSize(op);
+    if (offset + size > code.size()) return false;
+    starts[offset] = true;
+
+    uint8_t* operands = &code[offset + 1];
+    switch (op) {
+      case OP_NULL:
+      case OP_TRUE:
+      case OP_FALSE:
+      case OP_GET_LOCAL:
+        max_slots++;
+        break;
+      case OP_FORMAT:
+        if (operands[0] == 0) max_slots++;
+        break;
+      case OP_CONSTANT:
+        max_slots++;
+        if (operands[0] >= constant_count) return false;
+        break;
+      case OP_CONSTANT_LONG: {
+        max_slots++;
+        int32_t constant = abi::ReadI32(operands);
+        if (constant < 0 || constant >= constant_count) return false;
+        break;
+      }
+      case OP_DEFINE_GLOBAL:
+      case OP_DEFINE_CONST_GLOBAL:
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL: {
+        if (op == OP_GET_GLOBAL) max_slots++;
+        if (operands[0] >= global_count || global_slots_[operands[0]] > UINT8_MAX) return false;
+        operands[0] = global_slots_[operands[0]];
+        break;
+      }
+      case OP_DEFINE_GLOBAL_LONG:
+      case OP_DEFINE_CONST_GLOBAL_LONG:
+      case OP_GET_GLOBAL_LONG:
+      case OP_SET_GLOBAL_LONG: {
+        if (op == OP_GET_GLOBAL_LONG) max_slots++;
+        int32_t global = abi::ReadI32(operands);
+        if (global < 0 || global >= global_count) return false;
+        abi::NumericData slot;
+        slot.i32 = global_slots_[global];
+        memcpy(operands, slot.u8, sizeof(slot.u8));
+        break;
+      }
+      default:
+        break;
+    }
+    offset += size;
+  }
+
+  for (size_t offset = 0; offset < code.size(); offset += Chunk::InstructionSize(code[offset])) {
+    uint8_t op = code[offset];
+    // Slot 0 is the callee, what a call (its own callee too) or a format
+    // takes is above it
+    if (op == OP_GET_LOCAL || op == OP_SET_LOCAL) {
+      if (code[offset + 1] >= max_slots) return false;
+    } else if (op == OP_CALL) {
+      if (2 + code[offset + 1] > max_slots) return false;
+    } else if (op == OP_FORMAT) {
+      if (1 + code[offset + 1] > max_slots) return false;
+    }
+    if (Chunk::InstructionSize(op) != 3) continue;
+
+    int jump = abi::ReadU16(&code[offset + 1]);
+    long target = op == OP_LOOP ? (long)offset + 3 - jump : (long)offset + 3 + jump;
+    if (target < 0 || target >= (long)code.size() || !starts[target]) return false;
+  }
+  return true;
+}
@@ -0,0 +1,87 @@
+#ifndef FF_CORE_BYTECODE_H_
+#define FF_CORE_BYTECODE_H_
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "core/config.h"
+#include "core/globals.h"
+#include "core/object.h"
+
+// Compiled scripts saved by `ff --compile`, so a run can skip the scanner
+// and the compiler. A file holds a header, the names of the globals the
+// code refers to in slot order, and the script's function tree: code, line
+// runs and constants, with nested functions inline. Numbers and offsets are
+// in the byte order of the machine that wrote it, the header rejects the
+// other one.
+class BytecodeWriter {
+ private:
+  std::string out_;
+
+ public:
+  // Writes to a temporary file first, so a script never reads a partial one
+  static bool Write(const std::string& path, ObjFunction* script, const GlobalTable& globals,
+                    uint64_t source_hash, int optimization_level);
+  static bool Serialize(ObjFunction* script, const GlobalTable& globals, uint64_t source_hash,
+                        int optimization_level, std::string* image);
+  static bool WriteImage(const std::string& path, std::string_view image);
+
+  // Compiles independent sources on a ThreadPool of that many threads (0
+  // for one per core), each into the image Write would save for it, with
+  // its own globals. An image is empty if its source didn't compile.
+  static std::vector<std::string> CompileAll(const std::vector<std::string_view>& sources,
+                                             unsigned threads = 0,
+                                             int optimization_level = kDefaultOptimizationLevel);
+
+ private:
+  BytecodeWriter() = default;
+
+  bool WriteFunction(ObjFunction* function);
+  void WriteString(std::string_view str);
+  template <typename T> void WriteRaw(T value);
+};
+
+
+// Builds the function tree straight from a mapped file, which is only read
+// once: code is copied into each Chunk (the VM quickens it in place), and
+// strings are interned as they are met. Global names are resolved against
+// the VM's table, and the operands of global instructions are rewritten
+// when a name ended up in another slot than when the file was written.
+class BytecodeReader {
+ private:
+  const uint8_t* data_;
+  size_t size_;
+  size_t position_ = 0;
+  GlobalTable& globals_;
+  std::vector<int> global_slots_; // VM slot of each global in the file
+
+ public:
+  // Returns nullptr if the image isn't for this build, was compiled from
+  // another source (when source_hash isn't nullptr) or at another
+  // optimization level (when it isn't -1), or is damaged
+  static ObjFunction* Load(std::string_view image, GlobalTable& globals,
+                           const uint64_t* source_hash = nullptr, int optimization_level = -1);
+  // Whether it starts like a file Write makes
+  static bool IsBytecode(std::string_view image);
+
+ private:
+  BytecodeReader(std::string_view image, GlobalTable& globals);
+
+  bool ReadHeader(const uint64_t* source_hash, int optimization_level);
+  bool ReadGlobals();
+  ObjFunction* ReadFunction(int depth);
+  bool ReadFunctionParts(ObjFunction* function, int depth);
+  bool ReadConstant(ObjFunction* function, int depth);
+  bool ReadString(std::string_view* str);
+  bool ReadBytes(size_t count, const uint8_t** bytes);
+  bool CheckCode(ObjFunction* function);
+  template <typename T> bool ReadRaw(T* value);
+};
+
+// 64-bit FNV-1a of the source a file was compiled from
+uint64_t HashSource(std::string_view source);
+
+void MarkBytecodeRoots();
+
+#endif
@@ -1,7 +1,9 @@
 #include "core/chunk.h"
+#include "core/object.h"
 #include "utils/abi.h"
 
 #include <algorithm>
+#include <cstring>
 #include <iostream>
 
 
@@ -16,29 +18,68 @@ void Chunk::AppendCode(uint8_t byte, int line) {
 
   if (line == -1) // Means the same line as in the instruction before
     return;
-  if (lines.size() == 0) {
-    lines.push_back({code.size()-1, line});
+  if (lines.empty() || lines.back().line != line) {
+    lines.push_back({(uint32_t)(code.size() - 1), line});
+  }
+}
+
+
+// Equal constants must hash the same. Strings hash by their characters,
+// which stay the same when the collector moves them.
+static uint32_t ConstantHash(Value value) {
+  uint64_t bits = 0;
+  if (value.IsNumber()) {
+    NumberType number = value.AsNumber();
+    memcpy(&bits, &number, sizeof(number));
+  } else if (value.IsString()) {
+    return value.AsString()->hash;
+  } else if (value.IsObj()) {
+    bits = (uint64_t)(uintptr_t)value.AsObj();
   } else {
-    if (lines[lines.size()-1].line != line) {
-      lines.push_back({code.size()-1, line});
-    }
+    bits = value.GetType() + value.IsFalse();
+  }
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+
+// Numbers match by their bits, so a folded -0 doesn't turn into 0
+static bool SameConstant(Value a, Value b) {
+  if (a.IsNumber() && b.IsNumber()) {
+    NumberType x = a.AsNumber(), y = b.AsNumber();
+    return memcmp(&x, &y, sizeof(x)) == 0;
   }
+  return a == b;
 }
 
+
+void Chunk::GrowConstantIndex() {
+  size_t capacity = constant_index_.empty() ? 64 : constant_index_.size() * 2;
+  constant_index_.assign(capacity, -1);
+  size_t mask = capacity - 1;
+  for (size_t i = 0; i < constants.size(); i++) {
+    size_t slot = ConstantHash(constants[i]) & mask;
+    while (constant_index_[slot] != -1) slot = (slot + 1) & mask;
+    constant_index_[slot] = i;
+  }
+}
+
+// The index holds positions rather than values, so it stays valid when the
+// collector moves a string constant out of the nursery
 int Chunk::AddConstant(Value value) {
-  /*std::cout << "AddConstant: " << constants.data() << " " << &value << "\n";
-  std::cout << "constants.size(): " << constants.size() << std::endl;
-  for (int i = 0; i < constants.size(); i++) {
-    std::cout << i << ": " << std::endl; //<< constants[i].ToString() << "\n";
-    std::cout << &constants[i] << " " << std::endl;
-    std::cout << (int)constants[i].type << " " << std::endl;
-  }*/
-  auto itr = std::find(constants.begin(), constants.end(), value);
-  if (itr == constants.end()) {
-    constants.push_back(value);
-    return constants.size() - 1;
+  if ((constants.size() + 1) * 2 > constant_index_.size()) GrowConstantIndex();
+
+  size_t mask = constant_index_.size() - 1;
+  size_t slot = ConstantHash(value) & mask;
+  for (; constant_index_[slot] != -1; slot = (slot + 1) & mask) {
+    if (SameConstant(constants[constant_index_[slot]], value)) return constant_index_[slot];
   }
-  return itr - constants.begin();
+
+  constants.push_back(value);
+  constant_index_[slot] = constants.size() - 1;
+  return constants.size() - 1;
 }
 
 void Chunk::WriteConstant(Value value, int line) {
@@ -56,21 +97,44 @@ void Chunk::WriteConstant(Value value, int line) {
 }
 
 int Chunk::GetLine(int offset) const {
-  int prev_start = 0;
-  for (int i = 0; i < lines.size(); i++) {
-    if (lines[i].start_offset == offset) {
-      return lines[i].line;
-    } else {
-      if (lines[i].start_offset < offset) {
-        if (i+1 == lines.size()) {
-          return lines[i].line;
-        }
-      } else if (lines[i].start_offset > offset) {
-        return lines[i-1].line;
-      }
-    }
-  }
-
-  return 0;
+  if (offset < 0) return 0;
+  // The last run starting at or before offset
+  auto after = std::upper_bound(lines.begin(), lines.end(), (uint32_t)offset,
+                                [](uint32_t offset, const LineInfo& info) { return offset < info.start_offset; });
+  if (after == lines.begin()) return 0;
+  return (after - 1)->line;
 }
 
+
+int Chunk::InstructionSize(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_CONST_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_CALL:
+    case OP_FORMAT:
+      return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+      return 3;
+    case OP_CONSTANT_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_DEFINE_CONST_GLOBAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+      return 5;
+    default:
+      return 1;
+  }
+}
@@ -15,13 +15,14 @@ enum OpCode : uint8_t {
   OP_POP,
   OP_DEFINE_GLOBAL,
   OP_DEFINE_GLOBAL_LONG,
+  OP_DEFINE_CONST_GLOBAL,
+  OP_DEFINE_CONST_GLOBAL_LONG,
   OP_GET_GLOBAL,
   OP_GET_GLOBAL_LONG,
   OP_SET_GLOBAL,
   OP_SET_GLOBAL_LONG,
   OP_GET_LOCAL,
   OP_SET_LOCAL,
-  OP_MAKECONST,
   OP_NOT,
   OP_NEGATE,
   OP_EQUAL,
@@ -37,21 +38,51 @@ enum OpCode : uint8_t {
   OP_PRINT,
   OP_CALL,
   OP_RETURN,
+  OP_FORMAT,
+
+  // Only the Optimizer emits these, in place of a test and the jump that
+  // consumes it. All of them jump forward, and pop what they test.
+  OP_POP_JUMP_IF_FALSE,
+  OP_POP_JUMP_IF_TRUE,
+  OP_JUMP_IF_LESS,
+  OP_JUMP_IF_NOT_LESS,
+  OP_JUMP_IF_GREATER,
+  OP_JUMP_IF_NOT_GREATER,
+
+  // Type-specialized (quickened) forms. The compiler never emits these,
+  // the VM rewrites generic instructions into them in place once it has
+  // seen the operand types, and back when the guard fails.
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
 };
 
+constexpr int kOpCodeCount = OP_LESS_NUM + 1;
+
 
 class Chunk {
  private:
+  // Where each run of code from the same line starts, ascending
   struct LineInfo {
-    size_t start_offset;
-    int line;
+    uint32_t start_offset;
+    int32_t line;
   };
- 
+
  public:
   std::vector<uint8_t> code;
   std::vector<Value> constants;
   std::vector<LineInfo> lines;
 
+ private:
+  // Open-addressing index into constants, for AddConstant to find equal
+  // ones. Slots hold an index, or -1 when empty. Size is zero or a power
+  // of two.
+  std::vector<int32_t> constant_index_;
+
  public:
   Chunk();
 
@@ -59,6 +90,11 @@ class Chunk {
   int AddConstant(Value value);
   void WriteConstant(Value value, int line = -1);
   int GetLine(int offset) const;
+
+  static int InstructionSize(uint8_t op);
+
+ private:
+  void GrowConstantIndex();
 };
 
 #endif
@@ -1,9 +1,81 @@
 #ifndef FF_CORE_CONFIG_H_
 #define FF_CORE_CONFIG_H_
 
+#include <cstddef>
+#include <cstdint>
+
 constexpr int kLocalsSize = 256;
 constexpr int kFramesMax = 128;
 constexpr int kStackMaxSize = kFramesMax * kLocalsSize;
 
+// Optimizer level a compiler uses unless told otherwise (see Optimizer)
+constexpr int kDefaultOptimizationLevel = 1;
+
+// At -O2, values the IR tier computes once and loads again live in extra
+// frame slots, at most this many per function.
+constexpr size_t kMaxIrSlots = 32;
+
+// What a script prints is written out in blocks of up to this many bytes
+constexpr size_t kOutputBufferSize = 64 * 1024;
+
+// The garbage collector runs once this many bytes were allocated, and then
+// again when the heap grows kGCHeapGrowFactor times past what survived.
+constexpr size_t kGCInitialThreshold = 1024 * 1024;
+constexpr size_t kGCHeapGrowFactor = 2;
+
+// In incremental mode, a collection cycle is split into slices of at most
+// this many microseconds, spaced at least as far apart.
+constexpr int kGCPauseBudgetUs = 500;
+
+// Strings are bump-allocated in a nursery of this size. When it fills up,
+// survivors are moved to the old generation at the next VM safepoint.
+constexpr size_t kNurserySize = 256 * 1024;
+constexpr size_t kNurseryMaxStringLength = 4 * 1024; // Longer ones start old
+
+// Adding strings makes a rope, which copies nothing until its characters are
+// needed, once the result is at least this long.
+constexpr size_t kRopeMinLength = 256;
+
+// Old objects of up to kPoolMaxBlockSize bytes are carved out of
+// kPoolSlabSize slabs, with a free list per kPoolGranularity-byte size class.
+// Build with -DFF_NO_POOL_ALLOCATOR to malloc every block instead (e.g. to
+// let a sanitizer see them).
+constexpr size_t kPoolGranularity = 16;
+constexpr size_t kPoolMaxBlockSize = 256;
+constexpr size_t kPoolSlabSize = 64 * 1024;
+
+// Per-thread state that is read on the VM's fast paths (see the heap in
+// core/memory.h). With GNU compilers it is declared __thread, which reads it
+// directly: a thread_local declared extern is read through a check for an
+// initializer on every access.
+#if defined(__GNUC__) || defined(__clang__)
+#define FF_THREAD_LOCAL __thread
+#else
+#define FF_THREAD_LOCAL thread_local
 #endif
 
+#ifndef FF_NO_POOL_ALLOCATOR
+#define FF_POOL_ALLOCATOR
+#endif
+
+// VM::Run uses direct threaded dispatch (computed goto) when the compiler
+// supports labels as values. Build with -DFF_NO_COMPUTED_GOTO to force the
+// portable switch loop.
+#if !defined(FF_NO_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define FF_COMPUTED_GOTO
+#endif
+
+// VM::Run rewrites generic arithmetic instructions into type-specialized
+// ones after observing their operands. Build with -DFF_NO_QUICKENING to
+// always execute the generic instructions.
+#ifndef FF_NO_QUICKENING
+#define FF_QUICKENING
+#endif
+
+// Value is NaN-boxed into 64 bits on targets with 64-bit pointers. Build with
+// -DFF_NO_NAN_BOXING to use the tagged union representation instead.
+#if !defined(FF_NO_NAN_BOXING) && UINTPTR_MAX == UINT64_MAX
+#define FF_NAN_BOXING
+#endif
+
+#endif
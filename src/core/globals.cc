@@ -0,0 +1,51 @@
+#include "core/globals.h"
+#include "core/object.h"
+
+
+int GlobalTable::Resolve(ObjString* name) {
+  auto itr = indices_.find(name);
+  if (itr != indices_.end()) {
+    return itr->second;
+  }
+
+  GlobalVariable global;
+  global.name = name;
+  slots_.push_back(global);
+  indices_[name] = slots_.size() - 1;
+  memory::Shade(name->AsValue());
+  if (memory::IsYoung(name)) Remember(slots_.size() - 1);
+  return slots_.size() - 1;
+}
+
+int GlobalTable::Find(ObjString* name) const {
+  auto itr = indices_.find(name);
+  return itr == indices_.end() ? -1 : itr->second;
+}
+
+void GlobalTable::Define(int slot, Value value, bool assignable) {
+  Set(slot, value);
+  slots_[slot].defined = true;
+  slots_[slot].assignable = assignable;
+}
+
+void GlobalTable::EvacuateRemembered() {
+  for (int slot : remembered_) {
+    GlobalVariable& global = slots_[slot];
+    global.remembered = false;
+    memory::EvacuateValue(global.value);
+
+    ObjString* name = (ObjString*)memory::Promote(global.name);
+    if (name != global.name) {
+      indices_.erase(global.name);
+      indices_[name] = slot;
+      global.name = name;
+    }
+  }
+  remembered_.clear();
+}
+
+void GlobalTable::Remember(int slot) {
+  if (slots_[slot].remembered) return;
+  slots_[slot].remembered = true;
+  remembered_.push_back(slot);
+}
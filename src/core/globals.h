@@ -0,0 +1,68 @@
+#ifndef FF_CORE_GLOBALS_H_
+#define FF_CORE_GLOBALS_H_
+
+#include <vector>
+#include <unordered_map>
+
+#include "core/value.h"
+#include "core/memory.h"
+
+struct ObjString;
+
+struct GlobalVariable {
+  Value value;
+  ObjString* name = nullptr;
+  bool defined = false;
+  bool assignable = true;
+  bool remembered = false; // May reference a young object
+};
+
+
+// Dense table of global variables. The compiler resolves every global name
+// to a slot once, and the VM then accesses globals by slot index only.
+class GlobalTable {
+ private:
+  std::vector<GlobalVariable> slots_;
+  std::unordered_map<ObjString*, int> indices_;
+  std::vector<int> remembered_;
+
+ public:
+  int Resolve(ObjString* name);
+  int Find(ObjString* name) const;
+  void Define(int slot, Value value, bool assignable = true);
+  void EvacuateRemembered();
+
+  // For a copy of the table made for another heap: points each name and
+  // value at copy_of(its object), which must be old
+  template <typename CopyOf>
+  void Relocate(CopyOf copy_of) {
+    indices_.clear();
+    remembered_.clear();
+    for (size_t slot = 0; slot < slots_.size(); slot++) {
+      GlobalVariable& global = slots_[slot];
+      global.name = (ObjString*)copy_of(global.name);
+      if (global.value.IsObj()) global.value = Value(copy_of(global.value.AsObj()));
+      global.remembered = false;
+      indices_[global.name] = slot;
+    }
+  }
+
+  // Every store of a value goes through here, for the write barrier
+  inline void Set(int slot, Value value) {
+    slots_[slot].value = value;
+    memory::Shade(value);
+    if (memory::IsYoung(value)) Remember(slot);
+  }
+
+  inline GlobalVariable& operator[](int slot) { return slots_[slot]; }
+  inline const GlobalVariable& operator[](int slot) const { return slots_[slot]; }
+  inline int Size() const { return slots_.size(); }
+
+  inline std::vector<GlobalVariable>::const_iterator begin() const { return slots_.begin(); }
+  inline std::vector<GlobalVariable>::const_iterator end() const { return slots_.end(); }
+
+ private:
+  void Remember(int slot);
+};
+
+#endif
@@ -1,32 +1,575 @@
 #include "core/memory.h"
+#include "core/object.h"
+#include "core/api.h"
+#include "core/bytecode.h"
+#include "core/vm.h"
+#include "compiler/compiler.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <tuple>
+
+#ifdef _DEBUG_LOG_GC
+#include <cstdio>
+#endif
+
+extern FF_THREAD_LOCAL VMContext* current;
 
 namespace memory {
-std::unordered_map<void*, AllocationTableEntry> _allocation_table;
+FF_THREAD_LOCAL FreeListNode* _free_lists[kSizeClassCount] = {};
+thread_local std::vector<void*> _slabs;
+FF_THREAD_LOCAL Obj* _objects = nullptr;
+thread_local std::vector<Obj*> _gray_stack;
+FF_THREAD_LOCAL size_t _bytes_allocated = 0;
+FF_THREAD_LOCAL size_t _next_gc = kGCInitialThreshold;
+
+FF_THREAD_LOCAL uint8_t* _nursery_start = nullptr;
+FF_THREAD_LOCAL uint8_t* _nursery_end = nullptr;
+FF_THREAD_LOCAL uint8_t* _nursery_top = nullptr;
+FF_THREAD_LOCAL bool _minor_gc_requested = false;
+thread_local std::vector<Obj*> _remembered;
+
+FF_THREAD_LOCAL GCPhase _gc_phase = GCPhase::kIdle;
+FF_THREAD_LOCAL bool _incremental = false;
+thread_local std::chrono::microseconds _pause_budget(kGCPauseBudgetUs);
+thread_local std::chrono::nanoseconds _max_pause(0);
+
+FF_THREAD_LOCAL size_t _peak_bytes = 0;
+FF_THREAD_LOCAL size_t _total_allocations = 0;
+FF_THREAD_LOCAL size_t _gc_cycles = 0;
+FF_THREAD_LOCAL size_t _minor_gc_cycles = 0;
+FF_THREAD_LOCAL bool _profile_allocations = false;
+
+FF_THREAD_LOCAL size_t _memory_limit = 0;
+FF_THREAD_LOCAL bool _out_of_memory = false;
 }; // namespace memory
 
-bool memory::IsAllocated(void* pointer) {
-  return _allocation_table.find((void*)pointer) != _allocation_table.end();
+// Set while promoting, so that allocating the old copies can't start a major cycle
+static thread_local bool in_minor_gc = false;
+
+// Blocks are linked in address order, so that objects allocated together
+// end up next to each other
+void memory::RefillFreeList(size_t size_class) {
+  size_t block_size = sizeof(BlockHeader) + (size_class + 1) * kPoolGranularity;
+  uint8_t* slab = (uint8_t*)malloc(kPoolSlabSize);
+  if (slab == nullptr) {
+    // Print allocation error
+    die();
+  }
+  _slabs.push_back(slab);
+
+  FreeListNode*& free_list = _free_lists[size_class];
+  for (size_t offset = kPoolSlabSize / block_size * block_size; offset > 0; offset -= block_size) {
+    FreeListNode* node = (FreeListNode*)(slab + offset - block_size);
+    node->next = free_list;
+    free_list = node;
+  }
+}
+
+
+void memory::MarkObject(Obj* obj) {
+  // Young objects are only ever freed by CollectYoung
+  if (obj == nullptr || obj->marked || IsYoung(obj)) return;
+  obj->marked = true;
+  _gray_stack.push_back(obj);
+}
+
+void memory::MarkValue(Value value) {
+  if (value.IsObj()) MarkObject(value.AsObj());
 }
 
-size_t memory::GetCount(void* pointer) {
-  if (IsAllocated(pointer)) {
-    return _allocation_table.at(pointer).count;
+static void BlackenObject(Obj* obj) {
+  switch (obj->type) {
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)obj;
+      memory::MarkObject(function->name);
+      for (Value& constant : function->chunk.constants) {
+        memory::MarkValue(constant);
+      }
+      break;
+    }
+    case OBJ_CLOSURE:
+      memory::MarkObject(((ObjClosure*)obj)->function);
+      break;
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*)obj;
+      memory::MarkObject(rope->left);
+      memory::MarkObject(rope->right);
+      memory::MarkObject(rope->flat);
+      break;
+    }
+    case OBJ_STRING:
+    case OBJ_NATIVE:
+      break;
   }
-  return 0;
 }
 
-size_t memory::GetSizeOfElement(void* pointer) {
-  if (IsAllocated(pointer)) {
-    return _allocation_table.at(pointer).sizeof_element;
+// Only strings are allocated in the nursery
+static void ForEachYoung(void (*fn)(ObjString*)) {
+  for (uint8_t* top = memory::_nursery_start; top < memory::_nursery_top;) {
+    ObjString* string = (ObjString*)top;
+    top += memory::YoungSize(ObjString::SizeFor(string->length));
+    fn(string);
+  }
+}
+
+
+// A cycle marks from the roots, and then sweeps the objects that existed
+// when marking finished (sweep_list). Objects allocated while marking are
+// black, objects allocated while sweeping go to _objects and aren't swept.
+using Clock = std::chrono::steady_clock;
+
+constexpr int kWorkPerClockCheck = 64;
+
+static thread_local Obj* sweep_list = nullptr;
+static thread_local Clock::time_point last_slice_end;
+
+// See ProfileAllocation
+static thread_local std::map<memory::SiteKey, memory::SiteCounts> allocation_sites;
+
+static void BeginMarking() {
+  memory::_gc_phase = memory::GCPhase::kMarking;
+  current->GetHandle()->MarkRoots();
+  MarkCompilerRoots();
+  MarkBytecodeRoots();
+}
+
+// Returns true once there is nothing gray left
+static bool MarkSlice(Clock::time_point deadline) {
+  for (int work = 1; !memory::_gray_stack.empty(); work++) {
+    Obj* obj = memory::_gray_stack.back();
+    memory::_gray_stack.pop_back();
+    BlackenObject(obj);
+    if (work % kWorkPerClockCheck == 0 && Clock::now() >= deadline) break;
+  }
+  return memory::_gray_stack.empty();
+}
+
+static void FinishMarking() {
+  // Stores into stack slots have no barrier, so they are scanned again
+  current->GetHandle()->MarkStack();
+  MarkCompilerRoots();
+  MarkBytecodeRoots();
+  MarkSlice(Clock::time_point::max());
+
+  // Swept objects must not stay remembered
+  auto live_end = std::remove_if(memory::_remembered.begin(), memory::_remembered.end(),
+                                 [](Obj* obj) { return !obj->marked; });
+  memory::_remembered.erase(live_end, memory::_remembered.end());
+
+  sweep_list = memory::_objects;
+  memory::_objects = nullptr;
+  memory::_gc_phase = memory::GCPhase::kSweeping;
+}
+
+// Returns true once sweep_list is empty
+static bool SweepSlice(Clock::time_point deadline) {
+  for (int work = 1; sweep_list; work++) {
+    Obj* obj = sweep_list;
+    sweep_list = obj->next;
+
+    if (obj->marked) {
+      obj->marked = false;
+      obj->next = memory::_objects;
+      memory::_objects = obj;
+    } else {
+      // Interned strings don't keep themselves alive
+      if (obj->type == OBJ_STRING) current->GetStrings().Remove((ObjString*)obj);
+      memory::FreeObject(obj);
+    }
+
+    if (work % kWorkPerClockCheck == 0 && Clock::now() >= deadline) break;
+  }
+  return sweep_list == nullptr;
+}
+
+// The next cycle starts no later than at the memory limit
+static void SetNextGC(size_t next_gc) {
+  memory::_next_gc = memory::_memory_limit ? std::min(next_gc, memory::_memory_limit) : next_gc;
+}
+
+static void FinishCycle() {
+  memory::_gc_phase = memory::GCPhase::kIdle;
+  memory::_gc_cycles++;
+  SetNextGC(std::max(memory::_bytes_allocated * kGCHeapGrowFactor, kGCInitialThreshold));
+}
+
+static void RecordPause(Clock::time_point start) {
+  last_slice_end = Clock::now();
+  memory::_max_pause = std::max(memory::_max_pause,
+      std::chrono::duration_cast<std::chrono::nanoseconds>(last_slice_end - start));
+}
+
+// Does up to one pause budget of work on the current cycle
+static void CollectSlice(bool forced) {
+  Clock::time_point start = Clock::now();
+  // Leave the VM at least as much time as the collector takes, unless the
+  // heap grows too fast for that
+  if (!forced && start - last_slice_end < memory::_pause_budget
+      && memory::_bytes_allocated < memory::_next_gc * kGCHeapGrowFactor) {
+    return;
+  }
+  Clock::time_point deadline = start + memory::_pause_budget;
+
+  if (memory::_gc_phase == memory::GCPhase::kIdle) BeginMarking();
+  if (memory::_gc_phase == memory::GCPhase::kMarking && MarkSlice(deadline)) FinishMarking();
+  if (memory::_gc_phase == memory::GCPhase::kSweeping && Clock::now() < deadline
+      && SweepSlice(deadline)) {
+    FinishCycle();
+  }
+
+  RecordPause(start);
+}
+
+static void CollectFull() {
+  Clock::time_point start = Clock::now();
+  if (memory::_gc_phase == memory::GCPhase::kIdle) BeginMarking();
+  if (memory::_gc_phase == memory::GCPhase::kMarking) FinishMarking();
+  SweepSlice(Clock::time_point::max());
+  FinishCycle();
+  RecordPause(start);
+}
+
+// Past the limit, garbage is collected right away, whatever the mode
+static void CheckMemoryLimit() {
+  if (memory::_memory_limit == 0 || memory::_out_of_memory
+      || memory::_bytes_allocated <= memory::_memory_limit) {
+    return;
+  }
+  CollectFull();
+  memory::_out_of_memory = memory::_bytes_allocated > memory::_memory_limit;
+}
+
+void memory::CollectGarbage() {
+  // Roots live in the VM, objects allocated before there is one are kept
+  if (current == nullptr || in_minor_gc) return;
+
+#ifdef _DEBUG_LOG_GC
+  size_t before = _bytes_allocated;
+  GCPhase phase = _gc_phase;
+#endif
+
+#ifdef _DEBUG_STRESS_GC
+  bool forced = true;
+#else
+  bool forced = _gc_phase == GCPhase::kIdle;
+#endif
+  if (_incremental) {
+    CollectSlice(forced);
+  } else {
+    CollectFull();
+  }
+  CheckMemoryLimit();
+
+#ifdef _DEBUG_LOG_GC
+  if (phase != _gc_phase || !_incremental) {
+    printf("-- gc %s: %zu bytes (was %zu), next at %zu\n",
+           _gc_phase == GCPhase::kIdle ? "end" : "slice", _bytes_allocated, before, _next_gc);
+  }
+#endif
+}
+
+void memory::SetIncremental(bool incremental, std::chrono::microseconds pause_budget) {
+  if (!incremental && _gc_phase != GCPhase::kIdle && current) CollectFull();
+  _incremental = incremental;
+  _pause_budget = pause_budget;
+}
+
+std::chrono::nanoseconds memory::GetMaxPause() {
+  return _max_pause;
+}
+
+bool memory::Safepoint() {
+  if (_minor_gc_requested) CollectYoung();
+  if (_gc_phase != GCPhase::kIdle && current && !in_minor_gc) CollectSlice(false);
+  if (_out_of_memory) {
+    _out_of_memory = false;
+    return false;
+  }
+  return true;
+}
+
+Obj* memory::Promote(Obj* obj) {
+  if (!IsYoung(obj)) return obj;
+  if (obj->next) return obj->next;
+
+  ObjString* young = (ObjString*)obj;
+  size_t size = ObjString::SizeFor(young->length);
+  ObjString* old = (ObjString*)ReallocateBytes(nullptr, size);
+  memcpy((void*)old, (void*)young, size);
+  old->next = _objects;
+  old->marked = _gc_phase == GCPhase::kMarking;
+  _objects = old;
+
+  young->next = old;
+  return old;
+}
+
+void memory::WriteBarrier(Obj* owner, Value value) {
+  Shade(value);
+  if (!IsYoung(value) || IsYoung(owner) || owner->remembered) return;
+  owner->remembered = true;
+  _remembered.push_back(owner);
+}
+
+static void EvacuateChildren(Obj* obj) {
+  switch (obj->type) {
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)obj;
+      function->name = (ObjString*)memory::Promote(function->name);
+      for (Value& constant : function->chunk.constants) {
+        memory::EvacuateValue(constant);
+      }
+      break;
+    }
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*)obj;
+      rope->left = memory::Promote(rope->left);
+      rope->right = memory::Promote(rope->right);
+      rope->flat = (ObjString*)memory::Promote(rope->flat);
+      break;
+    }
+    case OBJ_STRING:
+    case OBJ_NATIVE:
+    case OBJ_CLOSURE:
+      break;
+  }
+}
+
+// Promotes everything in the nursery that is reachable from the roots or
+// from remembered objects. Moves objects, so it may only run where the VM
+// holds no raw pointers to young objects (see VM::Run safepoints).
+void memory::CollectYoung() {
+  _minor_gc_requested = false;
+  if (current == nullptr) return;
+  in_minor_gc = true;
+  Clock::time_point start = Clock::now();
+
+#ifdef _DEBUG_LOG_GC
+  size_t young_bytes = _nursery_top - _nursery_start;
+  size_t before = _bytes_allocated;
+#endif
+
+  current->GetHandle()->EvacuateRoots();
+  for (Obj* obj : _remembered) {
+    obj->remembered = false;
+    EvacuateChildren(obj);
+  }
+  _remembered.clear();
+
+  // Strings have no references, so promoted objects don't need a scan.
+  // Interned strings move with their object, or leave the table.
+  ForEachYoung([](ObjString* string) {
+    ObjString* promoted = (ObjString*)string->next;
+    if (promoted) {
+      current->GetStrings().Replace(string, promoted);
+    } else {
+      current->GetStrings().Remove(string);
+    }
+  });
+  _nursery_top = _nursery_start;
+
+  in_minor_gc = false;
+  _minor_gc_cycles++;
+  RecordPause(start);
+
+  // Promoting couldn't start a major cycle by itself
+  if (_bytes_allocated > _next_gc) CollectGarbage();
+
+#ifdef _DEBUG_LOG_GC
+  printf("-- minor gc: promoted %zu of %zu young bytes\n", _bytes_allocated - before, young_bytes);
+#endif
+}
+
+void memory::FreeObject(Obj* obj) {
+  switch (obj->type) {
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*)obj;
+      string->~ObjString();
+      ReallocateBytes(string, 0);
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)obj;
+      function->~ObjFunction();
+      Reallocate(function, 0);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)obj;
+      closure->~ObjClosure();
+      Reallocate(closure, 0);
+      break;
+    }
+    case OBJ_NATIVE: {
+      ObjNative* native = (ObjNative*)obj;
+      native->~ObjNative();
+      Reallocate(native, 0);
+      break;
+    }
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*)obj;
+      rope->~ObjRope();
+      Reallocate(rope, 0);
+      break;
+    }
   }
-  return 0;
 }
 
 void memory::Cleanup() {
-  for (auto& entry : _allocation_table) {
-    // Print debug
-    free(entry.first);
+  _nursery_top = _nursery_start;
+  _remembered.clear();
+  _gray_stack.clear();
+  _gc_phase = GCPhase::kIdle;
+
+  while (sweep_list) {
+    Obj* next = sweep_list->next;
+    FreeObject(sweep_list);
+    sweep_list = next;
+  }
+
+  while (_objects) {
+    Obj* next = _objects->next;
+    FreeObject(_objects);
+    _objects = next;
+  }
+
+  // Every object was freed above, so no pooled block is in use anymore
+  for (void* slab : _slabs) {
+    free(slab);
+  }
+  _slabs.clear();
+  std::fill(std::begin(_free_lists), std::end(_free_lists), nullptr);
+}
+
+
+memory::Heap::Heap(size_t nursery_size)
+    : incremental(_incremental), pause_budget(_pause_budget),
+      profile_allocations(_profile_allocations), memory_limit(_memory_limit) {
+  if (memory_limit) next_gc = std::min(next_gc, memory_limit);
+  if (nursery_size == 0) return;
+  nursery.reset(new uint8_t[nursery_size]);
+  nursery_start = nursery.get();
+  nursery_end = nursery_start + nursery_size;
+  nursery_top = nursery_start;
+}
+
+static void Exchange(memory::Heap& heap) {
+  using namespace memory;
+  using std::swap;
+  swap(_free_lists, heap.free_lists);
+  swap(_slabs, heap.slabs);
+  swap(_objects, heap.objects);
+  swap(_gray_stack, heap.gray_stack);
+  swap(_bytes_allocated, heap.bytes_allocated);
+  swap(_next_gc, heap.next_gc);
+
+  swap(_nursery_start, heap.nursery_start);
+  swap(_nursery_end, heap.nursery_end);
+  swap(_nursery_top, heap.nursery_top);
+  swap(_minor_gc_requested, heap.minor_gc_requested);
+  swap(_remembered, heap.remembered);
+
+  swap(_gc_phase, heap.gc_phase);
+  swap(_incremental, heap.incremental);
+  swap(_pause_budget, heap.pause_budget);
+  swap(_max_pause, heap.max_pause);
+  swap(sweep_list, heap.sweep_list);
+  swap(last_slice_end, heap.last_slice_end);
+
+  swap(_peak_bytes, heap.peak_bytes);
+  swap(_total_allocations, heap.total_allocations);
+  swap(_gc_cycles, heap.gc_cycles);
+  swap(_minor_gc_cycles, heap.minor_gc_cycles);
+  swap(_profile_allocations, heap.profile_allocations);
+  swap(allocation_sites, heap.allocation_sites);
+
+  swap(_memory_limit, heap.memory_limit);
+  swap(_out_of_memory, heap.out_of_memory);
+}
+
+// nullptr while the thread's own heap is active
+static thread_local memory::Heap* active_heap = nullptr;
+
+// The parked heap always holds the inactive state: the thread's own heap
+// goes into thread_heap first, then the new one comes out of its Heap
+void memory::Activate(Heap* heap) {
+  if (heap == active_heap) return;
+  static thread_local Heap thread_heap;
+  Exchange(active_heap ? *active_heap : thread_heap);
+  Exchange(heap ? *heap : thread_heap);
+  active_heap = heap;
+}
+
+memory::Heap* memory::ActiveHeap() {
+  return active_heap;
+}
+
+void memory::FreeHeap(Heap* heap) {
+  Heap* active = active_heap;
+  Activate(heap);
+  Cleanup();
+  Activate(active == heap ? nullptr : active);
+}
+
+
+static void AddTypeStats(memory::HeapStats& stats, Obj* obj, size_t size) {
+  memory::TypeStats& type = stats.types[obj->type];
+  type.objects++;
+  type.bytes += size;
+}
+
+// Walks the heap, so it's meant for diagnostics only
+memory::HeapStats memory::GetHeapStats() {
+  HeapStats stats = {};
+  stats.bytes = _bytes_allocated;
+  stats.peak_bytes = _peak_bytes;
+  stats.nursery_bytes = _nursery_top - _nursery_start;
+  stats.allocations = _total_allocations;
+  stats.gc_cycles = _gc_cycles;
+  stats.minor_gc_cycles = _minor_gc_cycles;
+  stats.memory_limit = _memory_limit;
+
+  for (Obj* list : {_objects, sweep_list}) {
+    for (Obj* obj = list; obj; obj = obj->next) AddTypeStats(stats, obj, GetSize(obj));
+  }
+  for (uint8_t* top = _nursery_start; top < _nursery_top;) {
+    size_t size = YoungSize(ObjString::SizeFor(((ObjString*)top)->length));
+    AddTypeStats(stats, (Obj*)top, size);
+    top += size;
   }
+  return stats;
+}
+
+void memory::SetMemoryLimit(size_t bytes) {
+  _memory_limit = bytes;
+  _out_of_memory = false;
+  SetNextGC(_next_gc);
 }
 
 
+void memory::SetAllocationProfiling(bool enabled) {
+  if (enabled && !_profile_allocations) allocation_sites.clear();
+  _profile_allocations = enabled;
+}
+
+void memory::ProfileAllocation(ObjType type, size_t bytes) {
+  std::string function = "<compiler>";
+  int line = 0;
+  if (current) current->GetHandle()->GetLocation(function, line);
+
+  SiteCounts& counts = allocation_sites[SiteKey(function, line, type)];
+  counts.count++;
+  counts.bytes += bytes;
+}
+
+std::vector<memory::AllocationSite> memory::GetAllocationProfile() {
+  std::vector<AllocationSite> sites;
+  for (auto& [key, counts] : allocation_sites) {
+    sites.push_back({std::get<0>(key), std::get<1>(key), std::get<2>(key), counts.count, counts.bytes});
+  }
+  std::stable_sort(sites.begin(), sites.end(),
+                   [](const AllocationSite& a, const AllocationSite& b) { return a.bytes > b.bytes; });
+  return sites;
+}
@@ -1,48 +1,324 @@
 #ifndef FF_CORE_MEMORY_H_
 #define FF_CORE_MEMORY_H_
 
-#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <cstring>
 #include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
 
+#include "core/value.h"
+#include "core/object.h"
+#include "core/config.h"
 #include "utils/die.h"
 
 
 namespace memory {
 
-struct AllocationTableEntry {
-  size_t sizeof_element;
+// Every block starts with a header holding the size it was allocated with,
+// so resizing and freeing it don't need a lookup
+struct alignas(std::max_align_t) BlockHeader {
+  size_t size;
+};
+
+// A free pooled block links to the next one of its size class in place of
+// its header
+struct FreeListNode {
+  FreeListNode* next;
+};
+
+constexpr size_t kSizeClassCount = kPoolMaxBlockSize / kPoolGranularity;
+
+// Each VM has a heap of its own (see Heap), and the variables below hold
+// the one of the VM current on this thread, so that allocation and the
+// barriers don't have to look it up. Objects must not be used from another
+// VM than the one that allocated them. A thread without a current VM uses
+// a heap of its own, which has no nursery and is never collected.
+
+extern FF_THREAD_LOCAL FreeListNode* _free_lists[kSizeClassCount];
+extern thread_local std::vector<void*> _slabs;
+
+enum class GCPhase {
+  kIdle,
+  kMarking,
+  kSweeping,
+};
+
+// All old objects, linked through Obj::next, and what the collector needs
+extern FF_THREAD_LOCAL Obj* _objects;
+extern thread_local std::vector<Obj*> _gray_stack;
+extern FF_THREAD_LOCAL size_t _bytes_allocated;
+extern FF_THREAD_LOCAL size_t _next_gc;
+
+// Incremental mode runs a cycle in bounded slices, interleaved with the VM
+extern FF_THREAD_LOCAL GCPhase _gc_phase;
+extern FF_THREAD_LOCAL bool _incremental;
+extern thread_local std::chrono::microseconds _pause_budget;
+extern thread_local std::chrono::nanoseconds _max_pause;
+
+// Heap accounting, see GetHeapStats()
+extern FF_THREAD_LOCAL size_t _peak_bytes;
+extern FF_THREAD_LOCAL size_t _total_allocations;
+extern FF_THREAD_LOCAL size_t _gc_cycles;
+extern FF_THREAD_LOCAL size_t _minor_gc_cycles;
+extern FF_THREAD_LOCAL bool _profile_allocations;
+
+// Once the collector can't bring the heap below _memory_limit (0 for no
+// limit), _out_of_memory is set until the VM reports it at a safepoint
+extern FF_THREAD_LOCAL size_t _memory_limit;
+extern FF_THREAD_LOCAL bool _out_of_memory;
+
+// Young objects are bump-allocated in [_nursery_start, _nursery_top), and
+// use Obj::next as the forwarding pointer once they were promoted. Old
+// objects that may point into the nursery are kept in _remembered. Without
+// a current VM there is no nursery (all three are nullptr).
+extern FF_THREAD_LOCAL uint8_t* _nursery_start;
+extern FF_THREAD_LOCAL uint8_t* _nursery_end;
+extern FF_THREAD_LOCAL uint8_t* _nursery_top;
+extern FF_THREAD_LOCAL bool _minor_gc_requested;
+extern thread_local std::vector<Obj*> _remembered;
+
+constexpr size_t SizeClass(size_t size) {
+  return (size - 1) / kPoolGranularity;
+}
+
+// Carves a new slab into blocks of the given size class
+void RefillFreeList(size_t size_class);
+
+inline BlockHeader* GetHeader(void* pointer) {
+  return (BlockHeader*)pointer - 1;
+}
+
+inline size_t GetSize(void* pointer) {
+  return pointer ? GetHeader(pointer)->size : 0;
+}
+
+inline void* AllocateBlock(size_t size) {
+  BlockHeader* header;
+#ifdef FF_POOL_ALLOCATOR
+  if (size <= kPoolMaxBlockSize) {
+    FreeListNode*& free_list = _free_lists[SizeClass(size)];
+    if (free_list == nullptr) RefillFreeList(SizeClass(size));
+    header = (BlockHeader*)free_list;
+    free_list = free_list->next;
+  } else
+#endif
+  {
+    header = (BlockHeader*)malloc(sizeof(BlockHeader) + size);
+    if (header == nullptr) {
+      // Print allocation error
+      die();
+    }
+  }
+  header->size = size;
+  return header + 1;
+}
+
+inline void FreeBlock(void* pointer) {
+  BlockHeader* header = GetHeader(pointer);
+#ifdef FF_POOL_ALLOCATOR
+  if (header->size <= kPoolMaxBlockSize) {
+    FreeListNode*& free_list = _free_lists[SizeClass(header->size)];
+    FreeListNode* node = (FreeListNode*)header;
+    node->next = free_list;
+    free_list = node;
+    return;
+  }
+#endif
+  free(header);
+}
+
+void MarkObject(Obj* obj);
+void MarkValue(Value value);
+void CollectGarbage();
+void FreeObject(Obj* obj);
+
+struct TypeStats {
+  size_t objects = 0;
+  size_t bytes = 0;
+};
+
+struct HeapStats {
+  size_t bytes;           // Old objects, as accounted by the collector
+  size_t peak_bytes;
+  size_t nursery_bytes;
+  size_t allocations;     // Since the start of the process
+  size_t gc_cycles;
+  size_t minor_gc_cycles;
+  size_t memory_limit;
+  TypeStats types[kObjTypeCount]; // Young and old objects not freed yet
+};
+
+// Allocations made by one line of one function, while profiling
+struct AllocationSite {
+  std::string function;
+  int line;
+  ObjType type;
   size_t count;
+  size_t bytes;
 };
 
-// Keeps track of all allocated chunks of memory
-extern std::unordered_map<void*, AllocationTableEntry> _allocation_table;
+HeapStats GetHeapStats();
+void SetMemoryLimit(size_t bytes);
+void SetAllocationProfiling(bool enabled);
+std::vector<AllocationSite> GetAllocationProfile(); // Most bytes first
+void ProfileAllocation(ObjType type, size_t bytes);
 
-bool IsAllocated(void* pointer);
-size_t GetCount(void* pointer);
-size_t GetSizeOfElement(void* pointer);
+inline void RecordAllocation(ObjType type, size_t bytes) {
+  _total_allocations++;
+  if (_profile_allocations) ProfileAllocation(type, bytes);
+}
 
-void Cleanup();
+inline void AccountBytes(size_t bytes) {
+  _bytes_allocated += bytes;
+  _peak_bytes = std::max(_peak_bytes, _bytes_allocated);
+}
 
-template <typename T>
-inline T* Reallocate(T* pointer, size_t new_count) {
-  if (new_count == 0) {
-    _allocation_table.erase((void*)pointer);
-    free((void*)pointer);
+void SetIncremental(bool incremental, std::chrono::microseconds pause_budget =
+                    std::chrono::microseconds(kGCPauseBudgetUs));
+std::chrono::nanoseconds GetMaxPause();
+bool Safepoint(); // False if the VM must stop with an out of memory error
+
+void CollectYoung();
+Obj* Promote(Obj* obj);
+void WriteBarrier(Obj* owner, Value value);
+
+inline bool IsYoung(const void* pointer) {
+  return (const uint8_t*)pointer >= _nursery_start && (const uint8_t*)pointer < _nursery_end;
+}
+
+inline bool IsYoung(Value value) {
+  return value.IsObj() && IsYoung(value.AsObj());
+}
+
+inline void EvacuateValue(Value& value) {
+  if (IsYoung(value)) value = Value(Promote(value.AsObj()));
+}
+
+// Incremental marking can't miss a reference stored into a scanned object
+inline void Shade(Value value) {
+  if (_gc_phase == GCPhase::kMarking) MarkValue(value);
+}
+
+// Whether the VM should call Safepoint() at its next safepoint
+inline bool SafepointRequested() {
+  return _minor_gc_requested || _gc_phase != GCPhase::kIdle || _out_of_memory;
+}
+
+constexpr size_t YoungSize(size_t size) {
+  return (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+}
+
+// Returns nullptr, and asks for a minor collection, if the nursery is full
+inline void* AllocateYoung(size_t size) {
+  size = YoungSize(size);
+#ifdef _DEBUG_STRESS_GC
+  _minor_gc_requested = true;
+#endif
+  if (size > (size_t)(_nursery_end - _nursery_top)) {
+    _minor_gc_requested = true;
+    return nullptr;
+  }
+  void* result = _nursery_top;
+  _nursery_top += size;
+  return result;
+}
+
+void Cleanup(); // Frees every object of the active heap
+
+// Allocations are counted by (function, line, type) of the innermost frame
+// running when they happen. Allocations made while compiling have no frame.
+using SiteKey = std::tuple<std::string, int, ObjType>;
+
+struct SiteCounts {
+  size_t count = 0;
+  size_t bytes = 0;
+};
+
+// The state of a heap while it isn't active. Activate swaps it with the
+// variables above, so switching VMs costs a few dozen moves and nothing is
+// shared between heaps: VMs on different threads never synchronize.
+struct Heap {
+  FreeListNode* free_lists[kSizeClassCount] = {};
+  std::vector<void*> slabs;
+  Obj* objects = nullptr;
+  std::vector<Obj*> gray_stack;
+  size_t bytes_allocated = 0;
+  size_t next_gc = kGCInitialThreshold;
+
+  uint8_t* nursery_start = nullptr;
+  uint8_t* nursery_end = nullptr;
+  uint8_t* nursery_top = nullptr;
+  bool minor_gc_requested = false;
+  std::vector<Obj*> remembered;
+  std::unique_ptr<uint8_t[]> nursery; // Stays here while the heap is active
+
+  GCPhase gc_phase = GCPhase::kIdle;
+  bool incremental = false;
+  std::chrono::microseconds pause_budget{kGCPauseBudgetUs};
+  std::chrono::nanoseconds max_pause{0};
+  Obj* sweep_list = nullptr;
+  std::chrono::steady_clock::time_point last_slice_end;
+
+  size_t peak_bytes = 0;
+  size_t total_allocations = 0;
+  size_t gc_cycles = 0;
+  size_t minor_gc_cycles = 0;
+  bool profile_allocations = false;
+  std::map<SiteKey, SiteCounts> allocation_sites;
+
+  size_t memory_limit = 0;
+  bool out_of_memory = false;
+
+  // Starts empty, with the collector settings of the active heap, which
+  // main sets before there is a VM
+  explicit Heap(size_t nursery_size = 0);
+  Heap(const Heap& rhs) = delete;
+  Heap& operator=(const Heap& rhs) = delete;
+};
+
+// Makes the heap active on this thread, nullptr for the thread's own. It
+// must not be active on another thread.
+void Activate(Heap* heap);
+Heap* ActiveHeap();
+// Frees every object of a heap that isn't active on another thread
+void FreeHeap(Heap* heap);
+
+// Objects are moved bytewise, like realloc would
+inline void* ReallocateBytes(void* pointer, size_t new_size) {
+  size_t old_size = GetSize(pointer);
+  AccountBytes(new_size - old_size);
+
+  if (new_size == 0) {
+    if (pointer) FreeBlock(pointer);
     return nullptr;
   }
 
-  // Delete old entry
-  if (IsAllocated((void*)pointer)) {
-    _allocation_table.erase((void*)pointer);
+  if (new_size > old_size) {
+#ifdef _DEBUG_STRESS_GC
+    CollectGarbage();
+#else
+    if (_gc_phase != GCPhase::kIdle || _bytes_allocated > _next_gc) CollectGarbage();
+#endif
   }
-  
-  void* result = realloc(pointer, new_count * sizeof(T));
-  if (result == NULL) {
-    // Print allocation error
-    die();
+
+  void* result = AllocateBlock(new_size);
+  if (pointer) {
+    memcpy(result, pointer, std::min(old_size, new_size));
+    FreeBlock(pointer);
   }
-  _allocation_table[result] = {sizeof(T), new_count};
-  return (T*)result;
+  return result;
+}
+
+template <typename T>
+inline T* Reallocate(T* pointer, size_t new_count) {
+  return (T*)ReallocateBytes((void*)pointer, new_count * sizeof(T));
 }
 
 template <typename T>
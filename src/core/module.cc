@@ -11,6 +11,7 @@ FFModule::FFModule(const std::string& lib_name) {
 }
 
 FFModule::FFModule(FFModule&& rhs) {
+  name_ = std::move(rhs.name_);
   mod_lib_ = std::move(rhs.mod_lib_);
   mod_info_ = rhs.mod_info_;
   symbols_ = std::move(rhs.symbols_);
@@ -19,6 +20,7 @@ FFModule::FFModule(FFModule&& rhs) {
 FFModule::~FFModule() {}
 
 int FFModule::Load(const std::string& lib_name) {
+  name_ = lib_name;
   int lib_load_ret = mod_lib_.Load(lib_name);
   if (lib_load_ret != 0) {
     fprintf(stderr, "Failed to load module '%s' (%d)\n", lib_name.c_str(), lib_load_ret);
@@ -49,3 +51,11 @@ FFModuleSymbol* FFModule::GetSymbol(const char* symbol_name) {
 std::vector<FFModuleSymbol>& FFModule::GetAllSymbols() {
   return symbols_;
 }
+
+const std::string& FFModule::GetName() const {
+  return name_;
+}
+
+bool FFModule::IsLoaded() const {
+  return mod_info_ != nullptr;
+}
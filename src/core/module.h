@@ -4,10 +4,12 @@
 #include "utils/shared_lib.h"
 #include "core/api.h"
 
+#include <string>
 #include <vector>
 
 class FFModule {
  private:
+  std::string name_;
   SharedLibrary mod_lib_;
   FFModuleInfo* mod_info_ = nullptr;
   std::vector<FFModuleSymbol> symbols_;
@@ -22,6 +24,8 @@ class FFModule {
   int Load(const std::string& lib_name);
   FFModuleSymbol* GetSymbol(const char* symbol_name);
   std::vector<FFModuleSymbol>& GetAllSymbols();
+  const std::string& GetName() const;
+  bool IsLoaded() const;
 };
 
 #endif
\ No newline at end of file
@@ -4,65 +4,269 @@
 #include "core/api.h"
 
 #include <iostream>
+#include <vector>
 
-extern VMContext* current;
+extern FF_THREAD_LOCAL VMContext* current;
 
 
 std::string Obj::ToString() const {
   switch (type) {
     case OBJ_STRING:
-      return ((ObjString*)this)->str;
+      return std::string(((ObjString*)this)->View());
     case OBJ_NATIVE:
       return "<native fn>";
     case OBJ_FUNCTION: {
       ObjFunction* func = (ObjFunction*)this;
-      if (func->name) return "<fn " + func->name->str + ">";
+      if (func->name) return "<fn " + std::string(func->name->View()) + ">";
       return "<script>";
     }
+    case OBJ_ROPE: {
+      const ObjRope* rope = (const ObjRope*)this;
+      std::string str(rope->length, '\0');
+      rope->CopyTo(str.data());
+      return str;
+    }
     default:
       return "<object>";
   }
 }
 
 Value Obj::AsValue() {
-  Value val;
-  val.type = VAL_OBJ;
-  val.as.obj = this;
-  return val;
+  return Value(this);
 }
 
 
-ObjString* ObjString::New() {
-  ObjString* obj = memory::Allocate<ObjString>(1);
-  new (obj) ObjString();
-  obj->type = OBJ_STRING;
+// Objects are linked into memory::_objects, so the collector can find them
+template <typename T>
+static T* AllocateObject(ObjType type, size_t size = sizeof(T)) {
+  T* obj = (T*)memory::ReallocateBytes(nullptr, size);
+  new (obj) T();
+  obj->type = type;
+  obj->marked = memory::_gc_phase == memory::GCPhase::kMarking;
+  obj->next = memory::_objects;
+  memory::_objects = obj;
   return obj;
 }
 
-ObjString* ObjString::FromStr(const std::string& str) {
-  if (current) {
-    auto interned = current->GetStrings().find(str);
-    if (interned != current->GetStrings().end()) {
-      return current->GetStrings()[str];
-    }
+
+// Strings are allocated in the nursery while there is space, most of them
+// are temporaries. The characters are left for the caller to fill in.
+ObjString* ObjString::Allocate(size_t length) {
+  size_t size = SizeFor(length);
+  ObjString* obj = nullptr;
+  if (length <= kNurseryMaxStringLength) obj = (ObjString*)memory::AllocateYoung(size);
+  if (obj == nullptr) {
+    obj = AllocateObject<ObjString>(OBJ_STRING, size);
+  } else {
+    new (obj) ObjString();
+    obj->type = OBJ_STRING;
   }
-  ObjString* obj = ObjString::New();
-  obj->str = std::string(str);
-  if (current) {
-    current->GetStrings()[str] = obj;
+  obj->length = length;
+  obj->chars[length] = '\0';
+  return obj;
+}
+
+static StringTable* CurrentStrings() {
+  return current ? &current->GetStrings() : nullptr;
+}
+
+static ObjString* FindInterned(StringTable* strings, std::string_view str, uint32_t hash) {
+  if (strings == nullptr) return nullptr;
+  ObjString* interned = strings->Find(str.data(), str.size(), hash);
+  // May be unreachable but not swept yet. Strings have no references, so
+  // marking it is enough to keep it.
+  if (interned && memory::_gc_phase != memory::GCPhase::kIdle) interned->marked = true;
+  return interned;
+}
+
+static ObjString* AddInterned(StringTable* strings, ObjString* obj) {
+  memory::RecordAllocation(OBJ_STRING, ObjString::SizeFor(obj->length));
+  if (strings) {
+    strings->Insert(obj);
   }
   return obj;
 }
 
+ObjString* ObjString::FromStr(std::string_view str, StringTable* strings) {
+  uint32_t hash = HashChars(str.data(), str.size());
+  ObjString* interned = FindInterned(strings, str, hash);
+  if (interned) return interned;
+
+  ObjString* obj = Allocate(str.size());
+  memcpy(obj->chars, str.data(), str.size());
+  obj->hash = hash;
+  return AddInterned(strings, obj);
+}
+
+// Returns the interned string equal to this one, which is this one if there
+// was none. Nothing may have been allocated since this string was.
+ObjString* ObjString::Intern() {
+  hash = HashChars(chars, length);
+  StringTable* strings = CurrentStrings();
+  ObjString* interned = FindInterned(strings, View(), hash);
+  if (interned) {
+    // Young strings are given back right away, old ones are left for the
+    // collector
+    if (memory::IsYoung(this)) memory::_nursery_top = (uint8_t*)this;
+    return interned;
+  }
+  return AddInterned(strings, this);
+}
+
+ObjString* ObjString::FromStr(std::string_view str) {
+  return FromStr(str, CurrentStrings());
+}
+
+ObjString* ObjString::FromStr(std::string_view str, StringTable& strings) {
+  return FromStr(str, &strings);
+}
+
+// Built in place, a new string is never copied
+ObjString* ObjString::Concat(std::string_view a, std::string_view b) {
+  ObjString* obj = Allocate(a.size() + b.size());
+  memcpy(obj->chars, a.data(), a.size());
+  memcpy(obj->chars + a.size(), b.data(), b.size());
+  return obj->Intern();
+}
+
+ObjString* ObjString::Concat(ObjString* a, ObjString* b) {
+  return Concat(a->View(), b->View());
+}
+
+ObjString* ObjString::Concat(ObjString* a, NumberType b) {
+  char buffer[kNumberBufferSize];
+  return Concat(a->View(), std::string_view(buffer, FormatNumber(b, buffer)));
+}
+
+
+// Pieces that aren't text are formatted into scratch while measuring, so the
+// result is allocated once at its final length, and written in one pass
+ObjString* ObjString::Format(const Value* values, int count) {
+  static thread_local std::string scratch;
+  static thread_local std::vector<size_t> scratch_ends;
+  scratch.clear();
+  scratch_ends.clear();
+
+  size_t length = 0;
+  for (int i = 0; i < count; i++) {
+    Value value = values[i];
+    if (value.IsString()) {
+      length += value.AsString()->length;
+    } else if (IsRope(value)) {
+      length += ((ObjRope*)value.AsObj())->length;
+    } else {
+      if (value.IsNumber()) {
+        char buffer[kNumberBufferSize];
+        scratch.append(buffer, FormatNumber(value.AsNumber(), buffer));
+      } else {
+        scratch += value.ToString();
+      }
+      length += scratch.size() - (scratch_ends.empty() ? 0 : scratch_ends.back());
+      scratch_ends.push_back(scratch.size());
+    }
+  }
+
+  ObjString* string = Allocate(length);
+  char* out = string->chars;
+  size_t start = 0;
+  int piece = 0;
+  for (int i = 0; i < count; i++) {
+    Value value = values[i];
+    if (value.IsString()) {
+      memcpy(out, value.AsString()->chars, value.AsString()->length);
+      out += value.AsString()->length;
+    } else if (IsRope(value)) {
+      ((ObjRope*)value.AsObj())->CopyTo(out);
+      out += ((ObjRope*)value.AsObj())->length;
+    } else {
+      size_t end = scratch_ends[piece++];
+      memcpy(out, scratch.data() + start, end - start);
+      out += end - start;
+      start = end;
+    }
+  }
+  return string->Intern();
+}
+
+
+static size_t TextLength(Obj* text) {
+  return text->type == OBJ_STRING ? ((ObjString*)text)->length : ((ObjRope*)text)->length;
+}
+
+// A flattened rope stands for its string
+static Obj* Unwrap(Obj* text) {
+  if (text->type == OBJ_ROPE && ((ObjRope*)text)->flat) return ((ObjRope*)text)->flat;
+  return text;
+}
+
+// Without recursion, ropes built in a loop are as deep as it ran
+void ObjRope::CopyTo(char* out) const {
+  std::vector<const Obj*> pending = {this};
+  while (!pending.empty()) {
+    const Obj* text = pending.back();
+    pending.pop_back();
+    if (text->type == OBJ_STRING) {
+      const ObjString* string = (const ObjString*)text;
+      memcpy(out, string->chars, string->length);
+      out += string->length;
+    } else if (((const ObjRope*)text)->flat) {
+      pending.push_back(((const ObjRope*)text)->flat);
+    } else {
+      pending.push_back(((const ObjRope*)text)->right);
+      pending.push_back(((const ObjRope*)text)->left);
+    }
+  }
+}
+
+ObjString* ObjRope::Flatten() {
+  if (flat) return flat;
+  ObjString* string = ObjString::Allocate(length);
+  CopyTo(string->chars);
+  flat = string->Intern();
+  left = nullptr;
+  right = nullptr;
+  memory::WriteBarrier(this, flat->AsValue());
+  return flat;
+}
+
+// Both operands must be reachable by the collector
+Obj* ObjRope::Concat(Obj* a, Obj* b) {
+  a = Unwrap(a);
+  b = Unwrap(b);
+  size_t length = TextLength(a) + TextLength(b);
+  // Ropes are never shorter than that, so both are strings
+  if (length < kRopeMinLength) return ObjString::Concat((ObjString*)a, (ObjString*)b);
+
+  memory::RecordAllocation(OBJ_ROPE, sizeof(ObjRope));
+  ObjRope* rope = AllocateObject<ObjRope>(OBJ_ROPE);
+  rope->left = a;
+  rope->right = b;
+  rope->length = length;
+  memory::WriteBarrier(rope, a->AsValue());
+  memory::WriteBarrier(rope, b->AsValue());
+  return rope;
+}
+
+Obj* ObjRope::Concat(Obj* a, NumberType b) {
+  a = Unwrap(a);
+  if (a->type == OBJ_STRING) return ObjString::Concat((ObjString*)a, b);
+
+  // Nothing refers to the number until the rope does, so it's marked to
+  // outlive a collection started by allocating the rope
+  char buffer[kNumberBufferSize];
+  ObjString* number = ObjString::FromStr(std::string_view(buffer, FormatNumber(b, buffer)));
+  if (!memory::IsYoung(number)) number->marked = true;
+  return Concat(a, number);
+}
+
 
 ObjFunction::ObjFunction() {
   type = OBJ_FUNCTION;
 }
 
 ObjFunction* ObjFunction::New() {
-  ObjFunction* obj = memory::Allocate<ObjFunction>(1);
-  new (obj) ObjFunction();
-  return obj;
+  memory::RecordAllocation(OBJ_FUNCTION, sizeof(ObjFunction));
+  return AllocateObject<ObjFunction>(OBJ_FUNCTION);
 }
 
 
@@ -72,9 +276,8 @@ ObjClosure* ObjClosure::New(ObjFunction* function) {
 
 
 ObjNative* ObjNative::New(NativeFn func) {
-  ObjNative* obj = memory::Allocate<ObjNative>(1);
-  new (obj) ObjNative();
-  obj->type = OBJ_NATIVE;
+  memory::RecordAllocation(OBJ_NATIVE, sizeof(ObjNative));
+  ObjNative* obj = AllocateObject<ObjNative>(OBJ_NATIVE);
   obj->function = func;
   return obj;
 }
@@ -2,12 +2,15 @@
 #define FF_CORE_OBJECT_H_
 
 #include <string>
+#include <string_view>
 #include <functional>
 
 #include "core/value.h"
 #include "core/chunk.h"
+#include "core/regchunk.h"
 
 struct Value;
+class StringTable;
 
 //typedef std::function<Value(int, Value*)> NativeFn;
 typedef Value(*NativeFn)(void*, int, Value*);
@@ -17,13 +20,18 @@ enum ObjType {
   OBJ_NATIVE,
   OBJ_FUNCTION,
   OBJ_CLOSURE,
+  OBJ_ROPE,
 };
 
+constexpr int kObjTypeCount = OBJ_ROPE + 1;
+
 
 struct Obj {
  public:
   ObjType type;
-  // Obj* next = nullptr;
+  bool marked = false;
+  bool remembered = false; // In memory::_remembered
+  Obj* next = nullptr; // Next object in memory::_objects
 
  public:
   inline bool IsType(ObjType expected_type) const { return type == expected_type; }
@@ -34,25 +42,83 @@ struct Obj {
 };
 
 
+// Strings are interned, so equal strings are the same object. The
+// characters are stored in the object itself, followed by a '\0'.
 struct ObjString : public Obj {
  public:
-  std::string str;
+  uint32_t length = 0;
+  uint32_t hash = 0;
+  char chars[];
+
+ public:
+  inline std::string_view View() const { return std::string_view(chars, length); }
+
+  // Interned in the current VM's table
+  static ObjString* FromStr(std::string_view str);
+  // Interned in the given one, which must be the current VM's, if there is
+  // one on this thread: the collector removes the strings it frees from that
+  static ObjString* FromStr(std::string_view str, StringTable& strings);
+  static ObjString* Concat(std::string_view a, std::string_view b);
+  static ObjString* Concat(ObjString* a, ObjString* b);
+  static ObjString* Concat(ObjString* a, NumberType b);
+  // Joins the values as print would show them. They must be reachable by
+  // the collector.
+  static ObjString* Format(const Value* values, int count);
+
+  static constexpr size_t SizeFor(size_t length) { return sizeof(ObjString) + length + 1; }
+
+ private:
+  friend struct ObjRope;
+
+  static ObjString* Allocate(size_t length);
+  static ObjString* FromStr(std::string_view str, StringTable* strings); // nullptr to not intern
+  ObjString* Intern();
+};
+
+
+// Concatenation of two strings or ropes, made by adding long strings. It's
+// flattened into an interned string once something needs the characters in
+// one piece, or the identity of the string (comparing, calling a native).
+struct ObjRope : public Obj {
+ public:
+  Obj* left = nullptr;  // Both are nullptr once flattened
+  Obj* right = nullptr;
+  ObjString* flat = nullptr;
+  size_t length = 0;
 
  public:
-  static ObjString* FromStr(const std::string& str);
-  static ObjString* New();
+  ObjString* Flatten();
+  void CopyTo(char* out) const;
+
+  // Each of these returns a plain string while the result is short
+  static Obj* Concat(Obj* a, Obj* b);
+  static Obj* Concat(Obj* a, NumberType b);
 };
 
+inline bool IsRope(Value value) {
+  return value.IsObj() && value.AsObj()->type == OBJ_ROPE;
+}
+
+// The value must be reachable by the collector, flattening allocates
+inline void FlattenValue(Value& value) {
+  if (IsRope(value)) value = ((ObjRope*)value.AsObj())->Flatten()->AsValue();
+}
+
 
 struct ObjFunction : public Obj {
  public:
   int arity = 0;
   Chunk chunk;
+  RegChunk regchunk;
   ObjString* name = nullptr;
+  // Body left to compile on the first call, from a source that outlives it
+  std::string_view source;
+  int line = 0;
  
  public:
   ObjFunction();
   static ObjFunction* New();
+  inline bool IsLazy() const { return source.data() != nullptr; }
 };
 
 
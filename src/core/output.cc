@@ -0,0 +1,76 @@
+#include "core/output.h"
+#include "core/object.h"
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+
+OutputBuffer::OutputBuffer(int fd) : fd_(fd), line_buffered_(isatty(fd)) {}
+
+
+OutputBuffer::~OutputBuffer() {
+  Flush();
+}
+
+
+void OutputBuffer::Write(const char* data, size_t length) {
+  if (size_ + length > kOutputBufferSize) {
+    Flush();
+    // Too long to be worth copying
+    if (length > kOutputBufferSize) {
+      while (length > 0) {
+        ssize_t written = write(fd_, data, length);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return;
+        data += written;
+        length -= written;
+      }
+      return;
+    }
+  }
+  memcpy(buffer_ + size_, data, length);
+  size_ += length;
+}
+
+
+void OutputBuffer::Write(char c) {
+  if (size_ == kOutputBufferSize) Flush();
+  buffer_[size_++] = c;
+}
+
+
+void OutputBuffer::WriteValue(Value value) {
+  if (value.IsNumber()) {
+    if (size_ + kNumberBufferSize > kOutputBufferSize) Flush();
+    size_ += FormatNumber(value.AsNumber(), buffer_ + size_);
+  } else if (value.IsString()) {
+    Write(value.AsString()->View());
+  } else if (IsRope(value) && ((ObjRope*)value.AsObj())->length <= kOutputBufferSize) {
+    ObjRope* rope = (ObjRope*)value.AsObj();
+    if (size_ + rope->length > kOutputBufferSize) Flush();
+    rope->CopyTo(buffer_ + size_);
+    size_ += rope->length;
+  } else {
+    Write(value.ToString());
+  }
+}
+
+
+void OutputBuffer::EndLine() {
+  Write('\n');
+  if (line_buffered_) Flush();
+}
+
+
+void OutputBuffer::Flush() {
+  const char* data = buffer_;
+  while (size_ > 0) {
+    ssize_t written = write(fd_, data, size_);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) break; // Nowhere to write it, e.g. a closed pipe
+    data += written;
+    size_ -= written;
+  }
+  size_ = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef FF_CORE_OUTPUT_H_
+#define FF_CORE_OUTPUT_H_
+
+#include <cstddef>
+#include <string_view>
+
+#include "core/config.h"
+#include "core/value.h"
+
+// Buffered writes to a file descriptor, for everything a script prints.
+// The buffer is written out when it fills up, on Flush() and when the VM
+// finishes a script, and after every line when the descriptor is a terminal.
+class OutputBuffer {
+ private:
+  int fd_;
+  bool line_buffered_;
+  size_t size_ = 0;
+  char buffer_[kOutputBufferSize];
+
+ public:
+  explicit OutputBuffer(int fd);
+  ~OutputBuffer();
+
+  void Write(const char* data, size_t length);
+  inline void Write(std::string_view str) { Write(str.data(), str.size()); }
+  void Write(char c);
+  void WriteValue(Value value); // As print shows it
+  void EndLine();
+  void Flush();
+
+  inline bool IsLineBuffered() const { return line_buffered_; }
+  inline void SetLineBuffered(bool enabled) { line_buffered_ = enabled; }
+};
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef FF_CORE_REGCHUNK_H_
+#define FF_CORE_REGCHUNK_H_
+
+#include <vector>
+
+#include "common.h"
+
+// Three-address instructions for the register backend. Registers are the
+// slots of the current CallFrame (R[0] is the function itself, followed by
+// parameters, locals and temporaries), K is the constant pool of the
+// function's Chunk, which the register code shares with the stack code.
+enum RegOpCode : uint8_t {
+  ROP_MOVE,               // R[a] = R[b]
+  ROP_LOADK,              // R[a] = K[bx]
+  ROP_LOADNULL,           // R[a] = null
+  ROP_LOADTRUE,           // R[a] = true
+  ROP_LOADFALSE,          // R[a] = false
+  ROP_DEFINE_GLOBAL,      // G[bx] = R[a]
+  ROP_DEFINE_CONST_GLOBAL,// G[bx] = R[a], not assignable
+  ROP_GET_GLOBAL,         // R[a] = G[bx]
+  ROP_SET_GLOBAL,         // G[bx] = R[a]
+  ROP_NOT,                // R[a] = !R[b]
+  ROP_NEGATE,             // R[a] = -R[b]
+  ROP_EQUAL,              // R[a] = R[b] == R[c]
+  ROP_GREATER,            // R[a] = R[b] > R[c]
+  ROP_LESS,               // R[a] = R[b] < R[c]
+  ROP_ADD,                // R[a] = R[b] + R[c]
+  ROP_SUBTRACT,           // R[a] = R[b] - R[c]
+  ROP_MULTIPLY,           // R[a] = R[b] * R[c]
+  ROP_DIVIDE,             // R[a] = R[b] / R[c]
+  ROP_EQUALK,             // R[a] = R[b] == K[c]
+  ROP_GREATERK,           // R[a] = R[b] > K[c]
+  ROP_LESSK,              // R[a] = R[b] < K[c]
+  ROP_ADDK,               // R[a] = R[b] + K[c]
+  ROP_SUBTRACTK,          // R[a] = R[b] - K[c]
+  ROP_MULTIPLYK,          // R[a] = R[b] * K[c]
+  ROP_DIVIDEK,            // R[a] = R[b] / K[c]
+  ROP_JUMP,               // pc += sbx
+  ROP_JUMP_IF_FALSE,      // if (!R[a]) pc += sbx
+  ROP_JUMP_IF_TRUE,       // if (R[a]) pc += sbx
+  ROP_PRINT,              // print R[a]
+  ROP_CALL,               // R[a] = R[a](R[a+1], ..., R[a+b])
+  ROP_RETURN,             // return R[a]
+  ROP_FORMAT,             // R[a] = R[a] .. R[a+1] .. ... .. R[a+b-1], as one string
+};
+
+constexpr int kRegOpCodeCount = ROP_FORMAT + 1;
+
+
+struct RegInstruction {
+  uint8_t op;
+  uint8_t a;
+  uint8_t b;
+  uint8_t c;
+
+ public:
+  inline uint16_t Bx() const { return b | (c << 8); }
+  inline int16_t SBx() const { return (int16_t)Bx(); }
+
+  static inline RegInstruction ABC(uint8_t op, uint8_t a, uint8_t b, uint8_t c) {
+    return {op, a, b, c};
+  }
+
+  static inline RegInstruction ABx(uint8_t op, uint8_t a, uint16_t bx) {
+    return {op, a, (uint8_t)(bx & 0xff), (uint8_t)(bx >> 8)};
+  }
+};
+
+static_assert(sizeof(RegInstruction) == 4, "RegInstruction must be 32 bits wide");
+
+
+class RegChunk {
+ public:
+  std::vector<RegInstruction> code;
+  std::vector<int> lines;
+  int register_count = 0;
+  bool ready = false;
+  bool stack_only = false; // The generator can't handle it, it runs on the stack VM
+
+ public:
+  inline void Append(RegInstruction instruction, int line) {
+    code.push_back(instruction);
+    lines.push_back(line);
+  }
+
+  inline int GetLine(int offset) const {
+    return (offset >= 0 && offset < (int)lines.size()) ? lines[offset] : 0;
+  }
+};
+
+#endif
@@ -0,0 +1,282 @@
+#include "core/vm.h"
+
+#include <iostream>
+#include <string>
+
+#include "compiler/regcompiler.h"
+#include "core/memory.h"
+
+
+InterpretResult VM::RunRegister() {
+  // Same layout as VM::Run: the interpreter state lives in locals, and is
+  // written back to the CallFrame only when something else needs to see it.
+  CallFrame* frame;
+  const RegInstruction* pc;
+  Value* R;
+  Value* K;
+  RegInstruction instruction;
+
+#define STORE_FRAME() \
+    (frame->pc = pc)
+#define LOAD_FRAME() \
+    (frame = &frames_[frame_count_ - 1], \
+     pc = frame->pc, \
+     R = frame->slots, \
+     K = frame->function->chunk.constants.data())
+
+#define A  (instruction.a)
+#define B  (instruction.b)
+#define C  (instruction.c)
+#define BX (instruction.Bx())
+
+#define RUNTIME_ERROR(...) \
+    do { \
+      STORE_FRAME(); \
+      RuntimeError(__VA_ARGS__); \
+      return InterpretResult::kRuntimeError; \
+    } while (0)
+
+#define SAFEPOINT() \
+    do { \
+      if (memory::SafepointRequested()) { \
+        STORE_FRAME(); \
+        if (!memory::Safepoint()) RUNTIME_ERROR("Out of memory."); \
+      } \
+    } while (0)
+
+#define NUMBER_OP(op, rhs) \
+    do { \
+      Value lhs = R[B]; \
+      Value right = (rhs); \
+      if (!lhs.IsNumber() || !right.IsNumber()) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
+      } \
+      R[A] = Value(lhs.AsNumber() op right.AsNumber()); \
+    } while (0)
+
+#define ADD_OP(rhs) \
+    do { \
+      Value lhs = R[B]; \
+      Value right = (rhs); \
+      if (lhs.IsNumber() && right.IsNumber()) { \
+        R[A] = Value(lhs.AsNumber() + right.AsNumber()); \
+      } else if (lhs.IsText() && right.IsText()) { \
+        STORE_FRAME(); \
+        R[A] = ObjRope::Concat(lhs.AsObj(), right.AsObj())->AsValue(); \
+      } else if (lhs.IsText() && right.IsNumber()) { \
+        STORE_FRAME(); \
+        R[A] = ObjRope::Concat(lhs.AsObj(), right.AsNumber())->AsValue(); \
+      } else { \
+        RUNTIME_ERROR("Operands must be numbers or strings."); \
+      } \
+    } while (0)
+
+#if defined(_DEBUG_EXECUTION_TRACING) || defined(_DEBUG_TRACE_STACK) || defined(_DEBUG_STEP)
+#define DEBUG_HOOK() \
+    do { STORE_FRAME(); if (!DebugHook()) return InterpretResult::kOk; } while (0)
+#else
+#define DEBUG_HOOK() do {} while (0)
+#endif
+
+// Interned strings are equal only if they're the same, ropes are flattened
+#define EQUAL_OP(rhs) \
+    do { \
+      if (IsRope(R[B]) || IsRope(rhs)) { \
+        STORE_FRAME(); \
+        FlattenValue(R[B]); \
+        FlattenValue(rhs); \
+      } \
+      R[A] = Value(R[B] == (rhs)); \
+    } while (0)
+
+#ifdef FF_COMPUTED_GOTO
+  // Must list every RegOpCode, in declaration order
+  static void* dispatch_table[] = {
+    [ROP_MOVE]                = &&L_ROP_MOVE,
+    [ROP_LOADK]               = &&L_ROP_LOADK,
+    [ROP_LOADNULL]            = &&L_ROP_LOADNULL,
+    [ROP_LOADTRUE]            = &&L_ROP_LOADTRUE,
+    [ROP_LOADFALSE]           = &&L_ROP_LOADFALSE,
+    [ROP_DEFINE_GLOBAL]       = &&L_ROP_DEFINE_GLOBAL,
+    [ROP_DEFINE_CONST_GLOBAL] = &&L_ROP_DEFINE_CONST_GLOBAL,
+    [ROP_GET_GLOBAL]          = &&L_ROP_GET_GLOBAL,
+    [ROP_SET_GLOBAL]          = &&L_ROP_SET_GLOBAL,
+    [ROP_NOT]                 = &&L_ROP_NOT,
+    [ROP_NEGATE]              = &&L_ROP_NEGATE,
+    [ROP_EQUAL]               = &&L_ROP_EQUAL,
+    [ROP_GREATER]             = &&L_ROP_GREATER,
+    [ROP_LESS]                = &&L_ROP_LESS,
+    [ROP_ADD]                 = &&L_ROP_ADD,
+    [ROP_SUBTRACT]            = &&L_ROP_SUBTRACT,
+    [ROP_MULTIPLY]            = &&L_ROP_MULTIPLY,
+    [ROP_DIVIDE]              = &&L_ROP_DIVIDE,
+    [ROP_EQUALK]              = &&L_ROP_EQUALK,
+    [ROP_GREATERK]            = &&L_ROP_GREATERK,
+    [ROP_LESSK]               = &&L_ROP_LESSK,
+    [ROP_ADDK]                = &&L_ROP_ADDK,
+    [ROP_SUBTRACTK]           = &&L_ROP_SUBTRACTK,
+    [ROP_MULTIPLYK]           = &&L_ROP_MULTIPLYK,
+    [ROP_DIVIDEK]             = &&L_ROP_DIVIDEK,
+    [ROP_JUMP]                = &&L_ROP_JUMP,
+    [ROP_JUMP_IF_FALSE]       = &&L_ROP_JUMP_IF_FALSE,
+    [ROP_JUMP_IF_TRUE]        = &&L_ROP_JUMP_IF_TRUE,
+    [ROP_PRINT]               = &&L_ROP_PRINT,
+    [ROP_CALL]                = &&L_ROP_CALL,
+    [ROP_RETURN]              = &&L_ROP_RETURN,
+    [ROP_FORMAT]              = &&L_ROP_FORMAT,
+  };
+  static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) == kRegOpCodeCount,
+                "dispatch_table is out of sync with RegOpCode");
+
+#define VM_CASE(op)   L_##op
+#define VM_DISPATCH() \
+    do { DEBUG_HOOK(); instruction = *pc++; goto *dispatch_table[instruction.op]; } while (0)
+#define VM_BEGIN()    VM_DISPATCH();
+#define VM_END()
+#else
+#define VM_CASE(op)   case op
+#define VM_DISPATCH() continue
+#define VM_BEGIN()    for (;;) { DEBUG_HOOK(); instruction = *pc++; switch (instruction.op) {
+#define VM_END()      } }
+#endif
+
+  LOAD_FRAME();
+
+  VM_BEGIN()
+    VM_CASE(ROP_MOVE):      R[A] = R[B]; VM_DISPATCH();
+    VM_CASE(ROP_LOADK):     R[A] = K[BX]; VM_DISPATCH();
+    VM_CASE(ROP_LOADNULL):  R[A] = Value(); VM_DISPATCH();
+    VM_CASE(ROP_LOADTRUE):  R[A] = Value(true); VM_DISPATCH();
+    VM_CASE(ROP_LOADFALSE): R[A] = Value(false); VM_DISPATCH();
+    VM_CASE(ROP_DEFINE_GLOBAL): {
+      globals_.Define(BX, R[A]);
+      VM_DISPATCH();
+    }
+    VM_CASE(ROP_DEFINE_CONST_GLOBAL): {
+      globals_.Define(BX, R[A], false);
+      VM_DISPATCH();
+    }
+    VM_CASE(ROP_GET_GLOBAL): {
+      GlobalVariable& global = globals_[BX];
+      if (!global.defined) {
+        RUNTIME_ERROR("Reference to undefined variable '%s'.", global.name->chars);
+      }
+      R[A] = global.value;
+      VM_DISPATCH();
+    }
+    VM_CASE(ROP_SET_GLOBAL): {
+      GlobalVariable& global = globals_[BX];
+      if (!global.defined) {
+        RUNTIME_ERROR("Reference to undefined variable '%s'.", global.name->chars);
+      }
+      if (!global.assignable) {
+        RUNTIME_ERROR("Cant assign to const variable.");
+      }
+      globals_.Set(BX, R[A]);
+      VM_DISPATCH();
+    }
+    VM_CASE(ROP_NOT): R[A] = Value(R[B].IsFalse()); VM_DISPATCH();
+    VM_CASE(ROP_NEGATE): {
+      if (!R[B].IsNumber()) {
+        RUNTIME_ERROR("Operand must be a number.");
+      }
+      R[A] = Value(-R[B].AsNumber());
+      VM_DISPATCH();
+    }
+    VM_CASE(ROP_EQUAL):     EQUAL_OP(R[C]); VM_DISPATCH();
+    VM_CASE(ROP_GREATER):   NUMBER_OP(>, R[C]); VM_DISPATCH();
+    VM_CASE(ROP_LESS):      NUMBER_OP(<, R[C]); VM_DISPATCH();
+    VM_CASE(ROP_ADD):       ADD_OP(R[C]); VM_DISPATCH();
+    VM_CASE(ROP_SUBTRACT):  NUMBER_OP(-, R[C]); VM_DISPATCH();
+    VM_CASE(ROP_MULTIPLY):  NUMBER_OP(*, R[C]); VM_DISPATCH();
+    VM_CASE(ROP_DIVIDE):    NUMBER_OP(/, R[C]); VM_DISPATCH();
+    VM_CASE(ROP_EQUALK):    EQUAL_OP(K[C]); VM_DISPATCH();
+    VM_CASE(ROP_GREATERK):  NUMBER_OP(>, K[C]); VM_DISPATCH();
+    VM_CASE(ROP_LESSK):     NUMBER_OP(<, K[C]); VM_DISPATCH();
+    VM_CASE(ROP_ADDK):      ADD_OP(K[C]); VM_DISPATCH();
+    VM_CASE(ROP_SUBTRACTK): NUMBER_OP(-, K[C]); VM_DISPATCH();
+    VM_CASE(ROP_MULTIPLYK): NUMBER_OP(*, K[C]); VM_DISPATCH();
+    VM_CASE(ROP_DIVIDEK):   NUMBER_OP(/, K[C]); VM_DISPATCH();
+    VM_CASE(ROP_JUMP): {
+      pc += instruction.SBx();
+      if (instruction.SBx() < 0) SAFEPOINT();
+      VM_DISPATCH();
+    }
+    VM_CASE(ROP_JUMP_IF_FALSE): {
+      if (R[A].IsFalse()) pc += instruction.SBx();
+      VM_DISPATCH();
+    }
+    VM_CASE(ROP_JUMP_IF_TRUE): {
+      if (!R[A].IsFalse()) pc += instruction.SBx();
+      VM_DISPATCH();
+    }
+    VM_CASE(ROP_PRINT): {
+      output_.WriteValue(R[A]);
+      output_.EndLine();
+      VM_DISPATCH();
+    }
+    VM_CASE(ROP_CALL): {
+      int frame_count = frame_count_;
+      SAFEPOINT();
+      STORE_FRAME();
+      stack_top_ = R + A + B + 1;
+      if (!CallValue(R[A], B)) {
+        return InterpretResult::kRuntimeError;
+      }
+      if (frame_count_ > frame_count) {
+        // Functions the generator can't handle run on the stack VM, and so
+        // does everything they call
+        if (!RegCompiler::Compile(frames_[frame_count_ - 1].function)) {
+          InterpretResult result = Run(frame_count);
+          if (result != InterpretResult::kOk) return result;
+          stack_top_ = R + frame->function->regchunk.register_count;
+        } else if (!PrepareRegisterFrame()) {
+          return InterpretResult::kRuntimeError;
+        }
+      } else {
+        stack_top_ = R + frame->function->regchunk.register_count;
+      }
+      LOAD_FRAME();
+      VM_DISPATCH();
+    }
+    VM_CASE(ROP_RETURN): {
+      Value result = R[A];
+
+      frame_count_--;
+      if (frame_count_ == 0) {
+        stack_top_ = frame->slots;
+        return InterpretResult::kOk;
+      }
+
+      frame->slots[0] = result;
+      LOAD_FRAME();
+      stack_top_ = R + frame->function->regchunk.register_count;
+      SAFEPOINT();
+      VM_DISPATCH();
+    }
+    VM_CASE(ROP_FORMAT): {
+      STORE_FRAME();
+      R[A] = ObjString::Format(R + A, B)->AsValue();
+      VM_DISPATCH();
+    }
+  VM_END()
+
+#undef VM_END
+#undef VM_BEGIN
+#undef VM_DISPATCH
+#undef VM_CASE
+#undef DEBUG_HOOK
+#undef EQUAL_OP
+#undef ADD_OP
+#undef NUMBER_OP
+#undef SAFEPOINT
+#undef RUNTIME_ERROR
+#undef BX
+#undef C
+#undef B
+#undef A
+#undef LOAD_FRAME
+#undef STORE_FRAME
+
+  return InterpretResult::kRuntimeError;
+}
@@ -0,0 +1,188 @@
+#include "core/snapshot.h"
+
+#include <cstring>
+#include <utility>
+
+extern FF_THREAD_LOCAL VMContext* current;
+
+
+template <typename Fn>
+static void ForEachChild(const Obj* obj, Fn fn) {
+  switch (obj->type) {
+    case OBJ_STRING:
+    case OBJ_NATIVE:
+      break;
+    case OBJ_FUNCTION: {
+      const ObjFunction* function = (const ObjFunction*)obj;
+      if (function->name) fn(function->name);
+      for (Value constant : function->chunk.constants) {
+        if (constant.IsObj()) fn(constant.AsObj());
+      }
+      break;
+    }
+    case OBJ_CLOSURE:
+      fn(((const ObjClosure*)obj)->function);
+      break;
+    case OBJ_ROPE: {
+      const ObjRope* rope = (const ObjRope*)obj;
+      for (Obj* child : {rope->left, rope->right, (Obj*)rope->flat}) {
+        if (child) fn(child);
+      }
+      break;
+    }
+  }
+}
+
+// Objects reachable from the globals, each after its children. Nothing
+// refers to an object that refers to it, so there is always such an order.
+// Without recursion, ropes built in a loop are as deep as it ran.
+static std::vector<Obj*> FindReachable(const GlobalTable& globals,
+                                       std::unordered_map<const Obj*, size_t>& indices) {
+  std::vector<Obj*> order;
+  std::vector<std::pair<Obj*, bool>> pending; // Whether its children were pushed
+  auto visit = [&](Obj* obj) {
+    if (indices.count(obj) == 0) pending.push_back({obj, false});
+  };
+
+  for (const GlobalVariable& global : globals) {
+    visit(global.name);
+    if (global.value.IsObj()) visit(global.value.AsObj());
+    while (!pending.empty()) {
+      Obj* obj = pending.back().first;
+      if (indices.count(obj)) {
+        pending.pop_back();
+      } else if (!pending.back().second) {
+        pending.back().second = true;
+        ForEachChild(obj, visit);
+      } else {
+        pending.pop_back();
+        indices[obj] = order.size();
+        order.push_back(obj);
+      }
+    }
+  }
+  return order;
+}
+
+// A copy of obj in the active heap, referring to copy_of(each child)
+template <typename CopyOf>
+static Obj* CopyObject(const Obj* obj, CopyOf copy_of) {
+  Obj* copy = nullptr;
+  switch (obj->type) {
+    case OBJ_STRING: {
+      size_t size = ObjString::SizeFor(((const ObjString*)obj)->length);
+      copy = (Obj*)memory::ReallocateBytes(nullptr, size);
+      memcpy((void*)copy, (const void*)obj, size);
+      break;
+    }
+    case OBJ_NATIVE:
+      copy = new (memory::Allocate<ObjNative>(1)) ObjNative(*(const ObjNative*)obj);
+      break;
+    case OBJ_FUNCTION: {
+      ObjFunction* function = new (memory::Allocate<ObjFunction>(1)) ObjFunction(*(const ObjFunction*)obj);
+      if (function->name) function->name = (ObjString*)copy_of(function->name);
+      for (Value& constant : function->chunk.constants) {
+        if (constant.IsObj()) constant = Value(copy_of(constant.AsObj()));
+      }
+      copy = function;
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = new (memory::Allocate<ObjClosure>(1)) ObjClosure(*(const ObjClosure*)obj);
+      closure->function = (ObjFunction*)copy_of(closure->function);
+      copy = closure;
+      break;
+    }
+    case OBJ_ROPE: {
+      ObjRope* rope = new (memory::Allocate<ObjRope>(1)) ObjRope(*(const ObjRope*)obj);
+      if (rope->left) rope->left = copy_of(rope->left);
+      if (rope->right) rope->right = copy_of(rope->right);
+      if (rope->flat) rope->flat = (ObjString*)copy_of(rope->flat);
+      copy = rope;
+      break;
+    }
+  }
+
+  copy->marked = memory::_gc_phase == memory::GCPhase::kMarking;
+  copy->remembered = false;
+  copy->next = memory::_objects;
+  memory::_objects = copy;
+  memory::RecordAllocation(copy->type, memory::GetSize(copy));
+  return copy;
+}
+
+// Copies are made in the heap with no VM current, so no collection can
+// free them before the globals refer to them
+class CopyingInto {
+ private:
+  VMContext* context_;
+  memory::Heap* heap_;
+
+ public:
+  explicit CopyingInto(memory::Heap* heap) : context_(current), heap_(memory::ActiveHeap()) {
+    current = nullptr;
+    memory::Activate(heap);
+  }
+
+  ~CopyingInto() {
+    memory::Activate(heap_);
+    current = context_;
+  }
+};
+
+
+Snapshot::Snapshot(Backend backend, int optimization_level)
+    : backend_(backend), optimization_level_(optimization_level) {}
+
+
+Snapshot::~Snapshot() {
+  memory::FreeHeap(&heap_);
+}
+
+
+std::unique_ptr<Snapshot> Snapshot::Take(VM& vm) {
+  std::unique_ptr<Snapshot> snapshot(new Snapshot(vm.backend_, vm.optimization_level_));
+  std::unordered_map<const Obj*, size_t> indices;
+  std::vector<Obj*> originals = FindReachable(vm.globals_, indices);
+
+  std::vector<Obj*>& copies = snapshot->objects_;
+  auto copy_of = [&](const Obj* obj) { return copies[indices.at(obj)]; };
+  {
+    CopyingInto scope(&snapshot->heap_);
+    copies.reserve(originals.size());
+    for (Obj* obj : originals) {
+      copies.push_back(CopyObject(obj, copy_of));
+    }
+    snapshot->globals_ = vm.globals_;
+    snapshot->globals_.Relocate(copy_of);
+  }
+  for (size_t i = 0; i < copies.size(); i++) {
+    snapshot->indices_[copies[i]] = i;
+  }
+
+  // Loaded again, so the natives stay valid after the VM closes its own
+  for (FFModule& module : vm.modules_) {
+    if (module.IsLoaded()) snapshot->modules_.emplace_back(module.GetName());
+  }
+  return snapshot;
+}
+
+
+std::unique_ptr<VM> Snapshot::Clone() const {
+  auto vm = std::make_unique<VM>(backend_);
+  vm->SetOptimizationLevel(optimization_level_);
+  CopyingInto scope(&vm->heap_);
+
+  std::vector<Obj*> copies;
+  copies.reserve(objects_.size());
+  auto copy_of = [&](const Obj* obj) { return copies[indices_.at(obj)]; };
+  for (const Obj* obj : objects_) {
+    Obj* copy = CopyObject(obj, copy_of);
+    // Every string a VM reaches is its interned one, so the copies differ
+    if (copy->type == OBJ_STRING) vm->strings.Insert((ObjString*)copy);
+    copies.push_back(copy);
+  }
+  vm->globals_ = globals_;
+  vm->globals_.Relocate(copy_of);
+  return vm;
+}
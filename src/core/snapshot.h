@@ -0,0 +1,49 @@
+#ifndef FF_CORE_SNAPSHOT_H_
+#define FF_CORE_SNAPSHOT_H_
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "core/globals.h"
+#include "core/memory.h"
+#include "core/module.h"
+#include "core/object.h"
+#include "core/vm.h"
+
+// A frozen copy of an initialized VM: its globals with the functions,
+// strings and natives they reach, and its modules. Clone makes a VM in that
+// state without running anything: the objects are copied into its heap in
+// one pass, children first, pointing each copy at the copies of its
+// children, and the strings are interned in its table.
+class Snapshot {
+ private:
+  memory::Heap heap_;         // Never active, nothing in it is collected
+  std::vector<Obj*> objects_; // Every object refers to earlier ones only
+  std::unordered_map<const Obj*, size_t> indices_;
+  GlobalTable globals_;       // Referring to objects_
+  std::vector<FFModule> modules_;
+  Backend backend_;
+  int optimization_level_;
+
+ public:
+  // Of a VM between runs, on the thread it is current on (if any). The VM
+  // can go on running, or go away, afterwards.
+  static std::unique_ptr<Snapshot> Take(VM& vm);
+
+  Snapshot(const Snapshot& rhs) = delete;
+  ~Snapshot();
+
+  Snapshot& operator=(const Snapshot& rhs) = delete;
+
+  // Safe to call from any number of threads at once. The clone isn't made
+  // current, and doesn't need InitBuiltins. The snapshot must outlive it:
+  // its natives live in the snapshot's modules, and its functions not
+  // compiled yet in the source the snapshotted VM compiled.
+  std::unique_ptr<VM> Clone() const;
+
+ private:
+  Snapshot(Backend backend, int optimization_level);
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "core/stringtable.h"
+#include "core/object.h"
+
+#include <cstring>
+
+// Removed entries keep probe sequences going
+static ObjString* const kTombstone = (ObjString*)(uintptr_t)alignof(ObjString);
+
+// Strings and tombstones fill at most 3/4 of the table, and just after a
+// rehash, strings fill at most half of it
+constexpr size_t kMinCapacity = 64;
+
+
+uint32_t HashChars(const char* chars, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)chars[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+
+ObjString* StringTable::Find(const char* chars, size_t length, uint32_t hash) const {
+  if (entries_.empty()) return nullptr;
+  size_t mask = entries_.size() - 1;
+  for (size_t index = hash & mask;; index = (index + 1) & mask) {
+    ObjString* entry = entries_[index];
+    if (entry == nullptr) return nullptr;
+    if (entry != kTombstone && entry->hash == hash && entry->length == length
+        && memcmp(entry->chars, chars, length) == 0) {
+      return entry;
+    }
+  }
+}
+
+void StringTable::Insert(ObjString* string) {
+  if ((used_ + 1) * 4 > entries_.size() * 3) Rehash();
+
+  size_t mask = entries_.size() - 1;
+  size_t index = string->hash & mask;
+  while (entries_[index] != nullptr && entries_[index] != kTombstone) {
+    index = (index + 1) & mask;
+  }
+  if (entries_[index] == nullptr) used_++;
+  entries_[index] = string;
+  count_++;
+}
+
+void StringTable::Remove(ObjString* string) {
+  ObjString** entry = FindEntry(string);
+  if (entry == nullptr) return;
+  *entry = kTombstone;
+  count_--;
+}
+
+void StringTable::Replace(ObjString* string, ObjString* moved_to) {
+  ObjString** entry = FindEntry(string);
+  if (entry) *entry = moved_to;
+}
+
+// Looks for the object itself, not for its contents
+ObjString** StringTable::FindEntry(ObjString* string) {
+  if (entries_.empty()) return nullptr;
+  size_t mask = entries_.size() - 1;
+  for (size_t index = string->hash & mask;; index = (index + 1) & mask) {
+    if (entries_[index] == string) return &entries_[index];
+    if (entries_[index] == nullptr) return nullptr;
+  }
+}
+
+// Sized for the strings only, so a table that lost most of them shrinks
+void StringTable::Rehash() {
+  size_t capacity = kMinCapacity;
+  while ((count_ + 1) * 2 > capacity) capacity *= 2;
+
+  std::vector<ObjString*> entries(capacity, nullptr);
+  entries_.swap(entries);
+  used_ = 0;
+  count_ = 0;
+  for (ObjString* string : entries) {
+    if (string != nullptr && string != kTombstone) Insert(string);
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef FF_CORE_STRINGTABLE_H_
+#define FF_CORE_STRINGTABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct ObjString;
+
+// FNV-1a, cached in ObjString::hash
+uint32_t HashChars(const char* chars, size_t length);
+
+
+// Interned strings, in an open-addressing table with linear probing. The
+// table doesn't keep its strings alive, the collector removes every string
+// it frees.
+class StringTable {
+ private:
+  std::vector<ObjString*> entries_; // Size is zero or a power of two
+  size_t used_ = 0;                 // Strings plus tombstones
+  size_t count_ = 0;
+
+ public:
+  ObjString* Find(const char* chars, size_t length, uint32_t hash) const;
+  void Insert(ObjString* string); // Must not be interned yet
+  void Remove(ObjString* string); // Only if it's the interned one
+  void Replace(ObjString* string, ObjString* moved_to);
+
+  inline size_t Size() const { return count_; }
+
+ private:
+  ObjString** FindEntry(ObjString* string);
+  void Rehash();
+};
+
+#endif
@@ -2,119 +2,45 @@
 #include "core/object.h"
 #include "core/memory.h"
 
+#include <charconv>
+#include <cmath>
 #include <iostream>
-#include <iomanip>
-#include <sstream>
-#include <cstdio>
 
 
-Value::Value(const Value& rhs) {
-  // std::cout << "cc: " << &rhs << " -> " << this << "\n";
-  type = rhs.type;
-  assignable = rhs.assignable;
-  switch (type) {
-    case VAL_NULL: as.number = 0; break;
-    case VAL_BOOL: as.boolean = rhs.as.boolean; break;
-    case VAL_NUMBER: as.number = rhs.as.number; break;
-    case VAL_OBJ: as.obj = rhs.as.obj; break;
+size_t FormatNumber(NumberType number, char* out) {
+  // Integral numbers are the common case, and print without an exponent
+  // for as long as they are exact
+  constexpr NumberType kMaxExactInteger = 9007199254740992.0; // 2^53
+  if (std::fabs(number) <= kMaxExactInteger) {
+    int64_t integer = (int64_t)number;
+    if (integer == number && !(integer == 0 && std::signbit(number))) {
+      return std::to_chars(out, out + kNumberBufferSize, integer).ptr - out;
+    }
   }
-}
-
-
-Value::Value(ValueType type) : type(type) {
-  as.number = 0;
-}
-
-
-Value::Value(bool val) {
-  type = VAL_BOOL;
-  as.boolean = val;
-}
-
-
-Value::Value(NumberType val) {
-  type = VAL_NUMBER;
-  as.number = val;
-}
-
-
-Value::Value(Obj* obj) {
-  type = VAL_OBJ;
-  as.obj = obj;
-}
-
-
-bool Value::AsBool() const {
-  return as.boolean;
-}
-
-
-NumberType Value::AsNumber() const {
-  return as.number;
-}
-
-
-struct Obj* Value::AsObj() const {
-  return as.obj;
-}
-
-
-ObjString* Value::AsString() const {
-  return (ObjString*)as.obj;
-}
-
-
-bool Value::IsType(ValueType expected_type) const {
-  return type == expected_type;
-}
-
-
-bool Value::IsNumber() const {
-  return type == VAL_NUMBER;
+  // Shortest round trip, with an exponent only for very large or small ones
+  return std::to_chars(out, out + kNumberBufferSize, number, std::chars_format::general).ptr - out;
 }
 
 
 bool Value::IsString() const {
-  return type == VAL_OBJ && as.obj->type == OBJ_STRING;
+  return IsObj() && AsObj()->type == OBJ_STRING;
 }
 
-
-bool Value::IsFalse() const {
-  return IsType(VAL_NULL) || (IsType(VAL_BOOL) && !AsBool()) || (IsType(VAL_NUMBER) && AsNumber() == 0);
+bool Value::IsText() const {
+  return IsObj() && (AsObj()->type == OBJ_STRING || AsObj()->type == OBJ_ROPE);
 }
 
 
-bool Value::operator==(const Value& rhs) {
-  // std::cout << "== " << this << " " << &rhs << "\n";
-  if (type != rhs.type) return false;
-
-  switch (type) {
-    case VAL_NULL:   return true;
-    case VAL_BOOL:   return AsBool() == rhs.AsBool();
-    case VAL_NUMBER: return AsNumber() == rhs.AsNumber();
-    case VAL_OBJ: {
-      switch (AsObj()->type) {
-        case OBJ_STRING: return AsString()->str == rhs.AsString()->str;
-        default:
-          return AsObj() == rhs.AsObj();
-      }
-    }
-    default:
-      return false;
-  }
-}
-
 std::string Value::ToString() const {
   // std::cout << "Value::ToString " << this << "\n";
-  switch (this->type) {
+  switch (GetType()) {
     case VAL_NULL:
       return "null";
     case VAL_BOOL:
       return AsBool() ? "true" : "false";
     case VAL_NUMBER: {
-      std::ostringstream oss;
-      oss << std::setprecision(8) << std::noshowpoint << AsNumber();
-      return oss.str();
+      char buffer[kNumberBufferSize];
+      return std::string(buffer, FormatNumber(AsNumber(), buffer));
     }
     case VAL_OBJ: return AsObj()->ToString();
   }
@@ -122,6 +48,10 @@ std::string Value::ToString() const {
 }
 
 void Value::Print() const {
+  if (IsNumber()) {
+    char buffer[kNumberBufferSize];
+    std::cout.write(buffer, FormatNumber(AsNumber(), buffer));
+    return;
+  }
   std::cout << ToString();
 }
-
@@ -4,6 +4,10 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "core/config.h"
 
 struct Obj;
 struct ObjString;
@@ -18,24 +22,55 @@ enum ValueType {
 };
 
 
+#ifdef FF_NAN_BOXING
+namespace nanbox {
+// Every quiet NaN with these bits set is free for our own encoding.
+// Obj pointers additionally set the sign bit, and keep the pointer in the
+// low 48 bits. null/false/true are tagged in the lowest 2 bits.
+constexpr uint64_t kSignBit  = 0x8000000000000000;
+constexpr uint64_t kQNaN     = 0x7ffc000000000000;
+
+constexpr uint64_t kTagNull  = 1;
+constexpr uint64_t kTagFalse = 2;
+constexpr uint64_t kTagTrue  = 3;
+
+constexpr uint64_t kNull  = kQNaN | kTagNull;
+constexpr uint64_t kFalse = kQNaN | kTagFalse;
+constexpr uint64_t kTrue  = kQNaN | kTagTrue;
+} // namespace nanbox
+#endif
+
+
+// Enough for any number FormatNumber writes, and its '\0'
+constexpr size_t kNumberBufferSize = 32;
+
+// Writes the shortest text that reads back as the same number, without
+// allocating. Returns the length written.
+size_t FormatNumber(NumberType number, char* out);
+
+
 struct Value {
- public:
-  ValueType type;
-  bool assignable = true;
+ private:
+#ifdef FF_NAN_BOXING
+  uint64_t bits_;
+#else
+  ValueType type_;
   union {
     bool boolean;
     NumberType number;
     Obj* obj;
-  } as;
+  } as_;
+#endif
 
  public:
-  Value(const Value& rhs);
   Value(ValueType type = VAL_NULL);
   Value(bool val);
   Value(NumberType val);
   Value(Obj* obj);
 
  public:
+  ValueType GetType() const;
+
   bool AsBool() const;
   NumberType AsNumber() const;
   struct Obj* AsObj() const;
@@ -43,17 +78,158 @@ struct Value {
 
   bool IsType(ValueType expected_type) const;
   bool IsNumber() const;
+  bool IsObj() const;
   bool IsString() const;
+  bool IsText() const; // A string or a rope
   bool IsFalse() const;
 
-  bool operator==(const Value& rhs);
-  
+  bool operator==(const Value& rhs) const;
+
   std::string ToString() const;
   void Print() const;
 };
 
+static_assert(std::is_trivially_copyable<Value>::value, "Value must be trivially copyable");
+#ifdef FF_NAN_BOXING
+static_assert(sizeof(Value) == sizeof(uint64_t), "NaN-boxed Value must fit in 64 bits");
+#endif
 
-typedef std::vector<Value> ValueArray;
+
+#ifdef FF_NAN_BOXING
+
+inline Value::Value(ValueType type) {
+  switch (type) {
+    case VAL_BOOL:   bits_ = nanbox::kFalse; break;
+    case VAL_NUMBER: bits_ = 0; break;
+    case VAL_OBJ:    bits_ = nanbox::kSignBit | nanbox::kQNaN; break;
+    default:         bits_ = nanbox::kNull; break;
+  }
+}
+
+inline Value::Value(bool val) : bits_(val ? nanbox::kTrue : nanbox::kFalse) {}
+
+inline Value::Value(NumberType val) {
+  memcpy(&bits_, &val, sizeof(val));
+}
+
+inline Value::Value(Obj* obj)
+  : bits_(nanbox::kSignBit | nanbox::kQNaN | (uint64_t)(uintptr_t)obj) {}
+
+inline ValueType Value::GetType() const {
+  if (IsNumber()) return VAL_NUMBER;
+  if (IsObj()) return VAL_OBJ;
+  if (bits_ == nanbox::kNull) return VAL_NULL;
+  return VAL_BOOL;
+}
+
+inline bool Value::AsBool() const {
+  return bits_ == nanbox::kTrue;
+}
+
+inline NumberType Value::AsNumber() const {
+  NumberType number;
+  memcpy(&number, &bits_, sizeof(bits_));
+  return number;
+}
+
+inline struct Obj* Value::AsObj() const {
+  return (Obj*)(uintptr_t)(bits_ & ~(nanbox::kSignBit | nanbox::kQNaN));
+}
+
+inline bool Value::IsType(ValueType expected_type) const {
+  switch (expected_type) {
+    case VAL_NULL:   return bits_ == nanbox::kNull;
+    case VAL_BOOL:   return (bits_ | 1) == nanbox::kTrue;
+    case VAL_NUMBER: return IsNumber();
+    case VAL_OBJ:    return IsObj();
+  }
+  return false;
+}
+
+inline bool Value::IsNumber() const {
+  return (bits_ & nanbox::kQNaN) != nanbox::kQNaN;
+}
+
+inline bool Value::IsObj() const {
+  return (bits_ & (nanbox::kSignBit | nanbox::kQNaN)) == (nanbox::kSignBit | nanbox::kQNaN);
+}
+
+// Strings are interned, so objects are equal only to themselves
+inline bool Value::operator==(const Value& rhs) const {
+  if (IsNumber() && rhs.IsNumber()) return AsNumber() == rhs.AsNumber();
+  return bits_ == rhs.bits_;
+}
+
+#else
+
+inline Value::Value(ValueType type) : type_(type) {
+  as_.number = 0;
+}
+
+inline Value::Value(bool val) : type_(VAL_BOOL) {
+  as_.number = 0;
+  as_.boolean = val;
+}
+
+inline Value::Value(NumberType val) : type_(VAL_NUMBER) {
+  as_.number = val;
+}
+
+inline Value::Value(Obj* obj) : type_(VAL_OBJ) {
+  as_.obj = obj;
+}
+
+inline ValueType Value::GetType() const {
+  return type_;
+}
+
+inline bool Value::AsBool() const {
+  return as_.boolean;
+}
+
+inline NumberType Value::AsNumber() const {
+  return as_.number;
+}
+
+inline struct Obj* Value::AsObj() const {
+  return as_.obj;
+}
+
+inline bool Value::IsType(ValueType expected_type) const {
+  return type_ == expected_type;
+}
+
+inline bool Value::IsNumber() const {
+  return type_ == VAL_NUMBER;
+}
+
+inline bool Value::IsObj() const {
+  return type_ == VAL_OBJ;
+}
+
+// Strings are interned, so objects are equal only to themselves
+inline bool Value::operator==(const Value& rhs) const {
+  if (type_ != rhs.type_) return false;
+  switch (type_) {
+    case VAL_NULL:   return true;
+    case VAL_BOOL:   return as_.boolean == rhs.as_.boolean;
+    case VAL_NUMBER: return as_.number == rhs.as_.number;
+    case VAL_OBJ:    return as_.obj == rhs.as_.obj;
+  }
+  return false;
+}
 
 #endif
 
+inline ObjString* Value::AsString() const {
+  return (ObjString*)AsObj();
+}
+
+inline bool Value::IsFalse() const {
+  return IsType(VAL_NULL) || (IsType(VAL_BOOL) && !AsBool()) || (IsNumber() && AsNumber() == 0);
+}
+
+
+typedef std::vector<Value> ValueArray;
+
+#endif
@@ -3,17 +3,23 @@
 #include <iostream>
 #include <cstdarg>
 #include <cstdio>
+#include <unistd.h>
 
 #include "compiler/compiler.h"
+#include "compiler/regcompiler.h"
+#include "core/bytecode.h"
+#include "core/memory.h"
 #include "debug/disasm.h"
 #include "utils/abi.h"
 
 
-VMContext* current = nullptr;
+// The VM running on this thread, whose roots the collector marks
+FF_THREAD_LOCAL VMContext* current = nullptr;
 
 
 void SetCurrent(VM& vm) {
   current = &vm.this_context;
+  memory::Activate(&vm.heap_);
 }
 
 
@@ -30,12 +36,36 @@ static Value builtin_import(void* ctx, int argc, Value* args) {
 }
 
 
-VM::VM() : this_context(this) {
+VM::VM(Backend backend)
+    : heap_(kNurserySize), backend_(backend), output_(STDOUT_FILENO), this_context(this) {
   ResetStack();
 }
 
 
-VM::~VM() {}
+VM::~VM() {
+  memory::FreeHeap(&heap_);
+  if (current == &this_context) current = nullptr;
+}
+
+
+Backend VM::GetBackend() const {
+  return backend_;
+}
+
+
+void VM::SetBackend(Backend backend) {
+  backend_ = backend;
+}
+
+
+int VM::GetOptimizationLevel() const {
+  return optimization_level_;
+}
+
+
+void VM::SetOptimizationLevel(int level) {
+  optimization_level_ = level;
+}
 
 
 void VM::InitBuiltins() {
@@ -47,30 +77,60 @@ void VM::DefineNative(const char* name, NativeFn function) {
   std::string name_str(name);
   Push(ObjString::FromStr(name_str)->AsValue());
   Push(ObjNative::New(function));
-  stack_[1].assignable = false;
-  globals_[(ObjString*)(stack_[0].AsObj())] = stack_[1];
+  int slot = globals_.Resolve((ObjString*)(stack_[0].AsObj()));
+  globals_.Define(slot, stack_[1], false);
   Pop();
   Pop();
 }
 
 
 void VM::Import(ObjString* name) {
-  modules_.push_back(FFModule(name->str));
+  modules_.push_back(FFModule(name->chars));
   FFModule& mod = modules_.back();
 
   auto& symbols = mod.GetAllSymbols();
   for (auto& symbol : symbols) {
     std::string str_name = symbol.name;
     ObjString* symbol_name = ObjString::FromStr(str_name);
-    globals_[symbol_name] = ObjNative::New(symbol.function);
+    int slot = globals_.Resolve(symbol_name);
+    globals_.Define(slot, ObjNative::New(symbol.function));
+  }
+}
+
+
+void VM::MarkRoots() {
+  MarkStack();
+
+  for (auto& global : globals_) {
+    memory::MarkObject(global.name);
+    memory::MarkValue(global.value);
+  }
+}
+
+
+void VM::MarkStack() {
+  for (Value* slot = stack_; slot < stack_top_; slot++) {
+    memory::MarkValue(*slot);
+  }
+
+  for (int i = 0; i < frame_count_; i++) {
+    memory::MarkObject(frames_[i].function);
   }
 }
 
 
+void VM::EvacuateRoots() {
+  for (Value* slot = stack_; slot < stack_top_; slot++) {
+    memory::EvacuateValue(*slot);
+  }
+  globals_.EvacuateRemembered();
+}
+
+
 void VM::vRuntimeError(const char* fmt, va_list args) {
+  output_.Flush(); // What was printed before the error goes first
   CallFrame* frame = &frames_[frame_count_ - 1];
-  size_t offset = frame->ip - frame->function->chunk.code.data() - 1;
-  fprintf(stderr, "[line %d] RuntimeError: ", frame->function->chunk.GetLine(offset));
+  fprintf(stderr, "[line %d] RuntimeError: ", FrameLine(frame));
   vfprintf(stderr, fmt, args);
   fputs("\n", stderr);
   ResetStack();
@@ -89,42 +149,35 @@ void VM::StackTrace() {
   for (int i = frame_count_ - 1; i >= 0; i--) {
     CallFrame* stack_frame = &frames_[i];
     ObjFunction* function = stack_frame->function;
-    size_t instruction = stack_frame->ip - function->chunk.code.data() - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.GetLine(instruction));
+    fprintf(stderr, "[line %d] in ", FrameLine(stack_frame));
     if (function->name == nullptr) {
       fprintf(stderr, "script\n");
     } else {
-      fprintf(stderr, "%s()", function->name->str.c_str());
+      fprintf(stderr, "%s()", function->name->chars);
     }
   }
 }
 
 
-uint8_t VM::ReadByte() {
-  return *frame->ip++;
-}
-
-
-uint16_t VM::ReadShort() {
-  abi::NumericData data;
-  data.u8[0] = ReadByte();
-  data.u8[1] = ReadByte();
-  return data.u16[0];
+void VM::GetLocation(std::string& function, int& line) {
+  if (frame_count_ == 0) return;
+  CallFrame* frame = &frames_[frame_count_ - 1];
+  function = frame->function->name ? frame->function->name->chars : "script";
+  line = FrameLine(frame);
 }
 
 
-Value VM::ReadConstant() {
-  return frame->function->chunk.constants[ReadByte()];
+OutputBuffer& VM::GetOutput() {
+  return output_;
 }
 
 
-Value VM::ReadConstantLong() {
-  abi::NumericData idx;
-  idx.u8[0] = ReadByte();
-  idx.u8[1] = ReadByte();
-  idx.u8[2] = ReadByte();
-  idx.u8[3] = ReadByte();
-  return frame->function->chunk.constants[idx.i32];
+int VM::FrameLine(CallFrame* frame) const {
+  ObjFunction* function = frame->function;
+  if (frame->pc) {
+    return function->regchunk.GetLine(frame->pc - function->regchunk.code.data() - 1);
+  }
+  return function->chunk.GetLine(frame->ip - function->chunk.code.data() - 1);
 }
 
 
@@ -157,6 +210,10 @@ bool VM::CallValue(Value callee, int arg_count) {
       case OBJ_NATIVE: {
         ObjNative* native = (ObjNative*)(callee.AsObj());
         NativeFn func = native->function;
+        // Natives only know about strings
+        for (Value* arg = stack_top_ - arg_count; arg < stack_top_; arg++) {
+          FlattenValue(*arg);
+        }
         Value result = func(current, arg_count, stack_top_ - arg_count);
         stack_top_ -= arg_count + 1;
         Push(result);
@@ -181,6 +238,11 @@ bool VM::Call(ObjFunction* function, int arg_count) {
     return false;
   }
 
+  if (function->IsLazy() && !Compiler::CompileLazy(function, globals_, strings, optimization_level_)) {
+    RuntimeError("Could not compile function '%s'.", function->name->chars);
+    return false;
+  }
+
   if (frame_count_ == kFramesMax) {
     RuntimeError("Stack overflow.");
     return false;
@@ -190,286 +252,511 @@ bool VM::Call(ObjFunction* function, int arg_count) {
 
   function_frame->function = function;
   function_frame->ip = function->chunk.code.data();
+  function_frame->pc = nullptr;
   function_frame->slots = stack_top_ - arg_count - 1;
 
   return true;
 }
 
 
-InterpretResult VM::Run() {
-  for (;;) {
-    frame = &frames_[frame_count_ - 1];
+// The function's register code must have been generated
+bool VM::PrepareRegisterFrame() {
+  CallFrame* frame = &frames_[frame_count_ - 1];
+  ObjFunction* function = frame->function;
+
+  if (frame->slots + function->regchunk.register_count > stack_ + kStackMaxSize) {
+    frame_count_--;
+    RuntimeError("Stack overflow.");
+    return false;
+  }
+
+  frame->pc = function->regchunk.code.data();
+  stack_top_ = frame->slots + function->regchunk.register_count;
+  return true;
+}
+
+
+#if defined(_DEBUG_EXECUTION_TRACING) || defined(_DEBUG_TRACE_STACK) || defined(_DEBUG_STEP)
+bool VM::DebugHook() {
+  CallFrame* frame = &frames_[frame_count_ - 1];
+  output_.Flush();
 
 #ifdef _DEBUG_EXECUTION_TRACING
+  if (frame->pc) {
+    debug::DisassembleRegInstruction(frame->function->regchunk, frame->function->chunk,
+                                     (int)(frame->pc - frame->function->regchunk.code.data()));
+  } else {
     debug::DisassembleInstruction(frame->function->chunk, (int)(frame->ip - frame->function->chunk.code.data()));
+  }
 #endif
 
 #ifdef _DEBUG_STEP
-    int ch = getchar();
-    if (ch == 'h') {
-      printf("h - help  q - quit  s - stack  g - globals  t - trace");
-    } else if (ch == 'q') {
-      ResetStack();
-      return InterpretResult::kOk;
-    } else if (ch == 's') {
+  int ch = getchar();
+  if (ch == 'h') {
+    printf("h - help  q - quit  s - stack  g - globals  t - trace");
+  } else if (ch == 'q') {
+    ResetStack();
+    return false;
+  } else if (ch == 's') {
 #endif
 #if defined(_DEBUG_TRACE_STACK) || defined(_DEBUG_STEP)
-    for (Value* slot = stack_; slot < stack_top_; slot++) {
-      printf("[ ");
-      slot->Print();
-      printf(" ]");
-    }
-    printf("\n");
+  for (Value* slot = stack_; slot < stack_top_; slot++) {
+    printf("[ ");
+    slot->Print();
+    printf(" ]");
+  }
+  printf("\n");
 #endif
 #ifdef _DEBUG_STEP
-    } else if ('g') {
-      printf("globals:\n");
-      for (auto &p : globals_) {
-        std::cout << p.first->str << ": " << p.second.ToString() << "\n";
-      }
-    } else if (ch == 't') {
-      StackTrace();
+  } else if ('g') {
+    printf("globals:\n");
+    for (auto& global : globals_) {
+      if (!global.defined) continue;
+      std::cout << global.name->chars << ": " << global.value.ToString() << "\n";
     }
-    printf("\n");
+  } else if (ch == 't') {
+    StackTrace();
+  }
+  printf("\n");
 #endif
 
+  return true;
+}
+#define DEBUG_HOOK() \
+    do { STORE_FRAME(); if (!DebugHook()) return InterpretResult::kOk; } while (0)
+#else
+#define DEBUG_HOOK() do {} while (0)
+#endif
 
 
-    uint8_t instruction = ReadByte();
-    switch (instruction) {
-      case OP_CONSTANT: {
-        Value constant = ReadConstant();
-        Push(constant);
-        break;
-      }
-      case OP_CONSTANT_LONG: {
-        Push(ReadConstantLong());
-        break;
-      }
-      case OP_NULL: Push(Value()); break;
-      case OP_TRUE: Push(Value(true)); break;
-      case OP_FALSE: Push(Value(false)); break;
-      case OP_POP: Pop(); break;
-      case OP_DEFINE_GLOBAL: {
-        ObjString* name = ReadConstant().AsString();
-        globals_[name] = Peek(0);
-        Pop();
-        break;
-      }
-      case OP_DEFINE_GLOBAL_LONG: {
-        ObjString* name = ReadConstantLong().AsString();
-        globals_[name] = Peek(0);
-        Pop();
-        break;
-      }
-      case OP_GET_GLOBAL: {
-        ObjString* name = ReadConstant().AsString();
-        auto variable = globals_.find(name);
-        if (variable == globals_.end()) {
-          RuntimeError("Reference to undefined variable '%s'.", name->str.c_str());
-          return InterpretResult::kRuntimeError;
-        }
-        Push(variable->second);
-        break;
-      }
-      case OP_GET_GLOBAL_LONG: {
-        ObjString* name = ReadConstantLong().AsString();
-        auto variable = globals_.find(name);
-        if (variable == globals_.end()) {
-          RuntimeError("Reference to undefined variable '%s'.", name->str.c_str());
-          return InterpretResult::kRuntimeError;
-        }
-        Push(variable->second);
-        break;
-      }
-      case OP_SET_GLOBAL: {
-        ObjString* name = ReadConstant().AsString();
-        auto variable = globals_.find(name);
-        if (variable == globals_.end()) {
-          RuntimeError("Reference to undefined variable '%s'.", name->str.c_str());
-          return InterpretResult::kRuntimeError;
-        }
-        if (!variable->second.assignable) {
-          RuntimeError("Cant assign to const variable.");
-          return InterpretResult::kRuntimeError;
-        }
-        variable->second = Peek(0);
-        break;
-        
-      }
-      case OP_SET_GLOBAL_LONG: {
-        ObjString* name = ReadConstantLong().AsString();
-        auto variable = globals_.find(name);
-        if (variable == globals_.end()) {
-          RuntimeError("Reference to undefined variable '%s'.", name->str.c_str());
-          return InterpretResult::kRuntimeError;
-        }
-        if (!variable->second.assignable) {
-          RuntimeError("Cant assign to const variable.");
-          return InterpretResult::kRuntimeError;
-        }
-        variable->second = Peek(0);
-        break;        
-      }
-      case OP_GET_LOCAL: {
-        uint8_t slot = ReadByte();
-        Push(frame->slots[slot]);
-        break;
-      }
-      case OP_SET_LOCAL: {
-        uint8_t slot = ReadByte();
-        if (!stack_[slot].assignable) {
-          RuntimeError("Cant assign to const variable.");
-          return InterpretResult::kRuntimeError;
-        }
-        frame->slots[slot] = Peek(0);
-        break;
-      }
-      case OP_MAKECONST: {
-        Value val = Pop();
-        val.assignable = false;
-        Push(val);
-        break;
-      }
-      case OP_NOT:  Push(Value(Pop().IsFalse())); break;
-      case OP_NEGATE: {
-        if (!Peek(0).IsType(VAL_NUMBER)) {
-          RuntimeError("Operand must be a number.");
-          return InterpretResult::kRuntimeError;
-        }
-        Push(Value(-Pop().AsNumber()));
-        break;
-      }
-      case OP_EQUAL: {
-        Value b = Pop();
-        Value a = Pop();
-        Push(Value(a == b));
-        break;
-      }
-      case OP_GREATER: {
-        if (!Peek(0).IsType(VAL_NUMBER) || !Peek(1).IsType(VAL_NUMBER)) {
-          RuntimeError("Operands must be numbers.");
-          return InterpretResult::kRuntimeError;
-        }
-        Value b = Pop();
-        Value a = Pop();
-        Push(Value(a.AsNumber()>b.AsNumber()));
-        break;
-      }
-      case OP_LESS: {
-        if (!Peek(0).IsType(VAL_NUMBER) || !Peek(1).IsType(VAL_NUMBER)) {
-          RuntimeError("Operands must be numbers.");
-          return InterpretResult::kRuntimeError;
-        }
-        Value b = Pop();
-        Value a = Pop();
-        Push(Value(a.AsNumber()<b.AsNumber()));
-        break;
-      }
-      case OP_ADD: {
-        if (Peek(0).IsString() && Peek(1).IsString()) {
-          std::string b = Pop().AsString()->str;
-          std::string a = Pop().AsString()->str;
-          std::string s = a + b;
-          Push(Value(ObjString::FromStr(s)->AsObj()));
-        } else if (Peek(0).IsNumber() && Peek(1).IsNumber()) {
-          Value b = Pop();
-          Value a = Pop();
-          Push(Value(a.AsNumber()+b.AsNumber()));
-        } else if (Peek(0).IsNumber() && Peek(1).IsString()) { 
-          NumberType b = Pop().AsNumber();
-          std::string a = Pop().AsString()->str;
-          std::string s = a + std::to_string(b);
-          Push(Value(ObjString::FromStr(s)->AsObj()));
-        } else {
-          RuntimeError("Operands must be numbers or strings.");
-          return InterpretResult::kRuntimeError;
-        }
-        break;
-      }
-      case OP_SUBTRACT: {
-        if (!Peek(0).IsType(VAL_NUMBER) || !Peek(1).IsType(VAL_NUMBER)) {
-          RuntimeError("Operands must be numbers.");
-          return InterpretResult::kRuntimeError;
-        }
-        Value b = Pop();
-        Value a = Pop();
-        Push(Value(a.AsNumber()-b.AsNumber()));
-        break;
-      }
-      case OP_MULTIPLY: {
-        if (!Peek(0).IsType(VAL_NUMBER) || !Peek(1).IsType(VAL_NUMBER)) {
-          RuntimeError("Operands must be numbers.");
-          return InterpretResult::kRuntimeError;
-        }
-        Value b = Pop();
-        Value a = Pop();
-        Push(Value(a.AsNumber()*b.AsNumber()));
-        break;
-      }
-      case OP_DIVIDE: {
-        if (!Peek(0).IsType(VAL_NUMBER) || !Peek(1).IsType(VAL_NUMBER)) {
-          RuntimeError("Operands must be numbers.");
-          return InterpretResult::kRuntimeError;
-        }
-        Value b = Pop();
-        Value a = Pop();
-        Push(Value(a.AsNumber()/b.AsNumber()));
-        break;
-      }
-      case OP_JUMP: {
-        uint16_t offset = ReadShort();
-        frame->ip += offset;
-        break;
-      }
-      case OP_JUMP_IF_FALSE: {
-        uint16_t offset = ReadShort();
-        if (Peek(0).IsFalse()) frame->ip += offset;
-        break;
+InterpretResult VM::Run(int base_frame) {
+  // Hot interpreter state is kept in locals, and is only written back to
+  // the current CallFrame/stack_top_ when something outside of this loop
+  // needs to see it (calls, runtime errors, debug hooks).
+  CallFrame* frame;
+  uint8_t* ip;
+  Value* sp;
+  Value* constants;
+
+#define STORE_FRAME() \
+    (frame->ip = ip, stack_top_ = sp)
+#define LOAD_FRAME() \
+    (frame = &frames_[frame_count_ - 1], \
+     ip = frame->ip, \
+     sp = stack_top_, \
+     constants = frame->function->chunk.constants.data())
+
+#define READ_BYTE()     (*ip++)
+#define READ_SHORT()    (ip += 2, abi::ReadU16(ip - 2))
+#define READ_LONG()     (ip += 4, abi::ReadI32(ip - 4))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_CONSTANT_LONG() (constants[READ_LONG()])
+
+#define PUSH(value) (*sp++ = (value))
+#define POP()       (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+
+#define RUNTIME_ERROR(...) \
+    do { \
+      STORE_FRAME(); \
+      RuntimeError(__VA_ARGS__); \
+      return InterpretResult::kRuntimeError; \
+    } while (0)
+
+// Young objects may only move here, where nothing but the VM stack and the
+// globals refer to them. Incremental collection slices run here too, and
+// exceeding the memory limit is reported here.
+#define SAFEPOINT() \
+    do { \
+      if (memory::SafepointRequested()) { \
+        STORE_FRAME(); \
+        if (!memory::Safepoint()) RUNTIME_ERROR("Out of memory."); \
+      } \
+    } while (0)
+
+#ifdef FF_QUICKENING
+#define QUICKEN(op) (ip[-1] = (op))
+#else
+#define QUICKEN(op) ((void)0)
+#endif
+
+// Rewrites the current instruction back to its generic form and
+// re-executes it. Not wrapped in do/while, so VM_DISPATCH can continue.
+#define DEQUICKEN(op) \
+    { \
+      *--ip = (op); \
+      VM_DISPATCH(); \
+    }
+
+#define BINARY_NUMBER_OP(op, quickened) \
+    do { \
+      if (!PEEK(0).IsNumber() || !PEEK(1).IsNumber()) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
+      } \
+      QUICKEN(quickened); \
+      NumberType b = POP().AsNumber(); \
+      NumberType a = POP().AsNumber(); \
+      PUSH(Value(a op b)); \
+    } while (0)
+
+#define BINARY_NUMBER_OP_NUM(op, generic) \
+    { \
+      if (!PEEK(0).IsNumber() || !PEEK(1).IsNumber()) DEQUICKEN(generic); \
+      NumberType b = POP().AsNumber(); \
+      PEEK(0) = Value(PEEK(0).AsNumber() op b); \
+    }
+
+#define COMPARE_JUMP(op, when) \
+    do { \
+      uint16_t offset = READ_SHORT(); \
+      if (!PEEK(0).IsNumber() || !PEEK(1).IsNumber()) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
+      } \
+      NumberType b = POP().AsNumber(); \
+      NumberType a = POP().AsNumber(); \
+      if ((a op b) == (when)) ip += offset; \
+    } while (0)
+
+#define GET_GLOBAL(slot) \
+    do { \
+      GlobalVariable& global = globals_[slot]; \
+      if (!global.defined) { \
+        RUNTIME_ERROR("Reference to undefined variable '%s'.", global.name->chars); \
+      } \
+      PUSH(global.value); \
+    } while (0)
+
+#define SET_GLOBAL(slot) \
+    do { \
+      int index = (slot); \
+      GlobalVariable& global = globals_[index]; \
+      if (!global.defined) { \
+        RUNTIME_ERROR("Reference to undefined variable '%s'.", global.name->chars); \
+      } \
+      if (!global.assignable) { \
+        RUNTIME_ERROR("Cant assign to const variable."); \
+      } \
+      globals_.Set(index, PEEK(0)); \
+    } while (0)
+
+#ifdef FF_COMPUTED_GOTO
+  // Must list every OpCode, in declaration order
+  static void* dispatch_table[] = {
+    [OP_CONSTANT]                 = &&L_OP_CONSTANT,
+    [OP_CONSTANT_LONG]            = &&L_OP_CONSTANT_LONG,
+    [OP_NULL]                     = &&L_OP_NULL,
+    [OP_TRUE]                     = &&L_OP_TRUE,
+    [OP_FALSE]                    = &&L_OP_FALSE,
+    [OP_POP]                      = &&L_OP_POP,
+    [OP_DEFINE_GLOBAL]            = &&L_OP_DEFINE_GLOBAL,
+    [OP_DEFINE_GLOBAL_LONG]       = &&L_OP_DEFINE_GLOBAL_LONG,
+    [OP_DEFINE_CONST_GLOBAL]      = &&L_OP_DEFINE_CONST_GLOBAL,
+    [OP_DEFINE_CONST_GLOBAL_LONG] = &&L_OP_DEFINE_CONST_GLOBAL_LONG,
+    [OP_GET_GLOBAL]               = &&L_OP_GET_GLOBAL,
+    [OP_GET_GLOBAL_LONG]          = &&L_OP_GET_GLOBAL_LONG,
+    [OP_SET_GLOBAL]               = &&L_OP_SET_GLOBAL,
+    [OP_SET_GLOBAL_LONG]          = &&L_OP_SET_GLOBAL_LONG,
+    [OP_GET_LOCAL]                = &&L_OP_GET_LOCAL,
+    [OP_SET_LOCAL]                = &&L_OP_SET_LOCAL,
+    [OP_NOT]                      = &&L_OP_NOT,
+    [OP_NEGATE]                   = &&L_OP_NEGATE,
+    [OP_EQUAL]                    = &&L_OP_EQUAL,
+    [OP_GREATER]                  = &&L_OP_GREATER,
+    [OP_LESS]                     = &&L_OP_LESS,
+    [OP_ADD]                      = &&L_OP_ADD,
+    [OP_SUBTRACT]                 = &&L_OP_SUBTRACT,
+    [OP_MULTIPLY]                 = &&L_OP_MULTIPLY,
+    [OP_DIVIDE]                   = &&L_OP_DIVIDE,
+    [OP_JUMP]                     = &&L_OP_JUMP,
+    [OP_JUMP_IF_FALSE]            = &&L_OP_JUMP_IF_FALSE,
+    [OP_LOOP]                     = &&L_OP_LOOP,
+    [OP_PRINT]                    = &&L_OP_PRINT,
+    [OP_CALL]                     = &&L_OP_CALL,
+    [OP_RETURN]                   = &&L_OP_RETURN,
+    [OP_FORMAT]                   = &&L_OP_FORMAT,
+    [OP_POP_JUMP_IF_FALSE]        = &&L_OP_POP_JUMP_IF_FALSE,
+    [OP_POP_JUMP_IF_TRUE]         = &&L_OP_POP_JUMP_IF_TRUE,
+    [OP_JUMP_IF_LESS]             = &&L_OP_JUMP_IF_LESS,
+    [OP_JUMP_IF_NOT_LESS]         = &&L_OP_JUMP_IF_NOT_LESS,
+    [OP_JUMP_IF_GREATER]          = &&L_OP_JUMP_IF_GREATER,
+    [OP_JUMP_IF_NOT_GREATER]      = &&L_OP_JUMP_IF_NOT_GREATER,
+    [OP_ADD_NUM]                  = &&L_OP_ADD_NUM,
+    [OP_ADD_STR]                  = &&L_OP_ADD_STR,
+    [OP_SUBTRACT_NUM]             = &&L_OP_SUBTRACT_NUM,
+    [OP_MULTIPLY_NUM]             = &&L_OP_MULTIPLY_NUM,
+    [OP_DIVIDE_NUM]               = &&L_OP_DIVIDE_NUM,
+    [OP_GREATER_NUM]              = &&L_OP_GREATER_NUM,
+    [OP_LESS_NUM]                 = &&L_OP_LESS_NUM,
+  };
+  static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) == kOpCodeCount,
+                "dispatch_table is out of sync with OpCode");
+
+#define VM_CASE(op)   L_##op
+#define VM_DISPATCH() do { DEBUG_HOOK(); goto *dispatch_table[READ_BYTE()]; } while (0)
+#define VM_BEGIN()    VM_DISPATCH();
+#define VM_END()
+#else
+#define VM_CASE(op)   case op
+#define VM_DISPATCH() continue
+#define VM_BEGIN()    for (;;) { DEBUG_HOOK(); switch (READ_BYTE()) {
+#define VM_END()      } }
+#endif
+
+  LOAD_FRAME();
+
+  VM_BEGIN()
+    VM_CASE(OP_CONSTANT): {
+      PUSH(READ_CONSTANT());
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_CONSTANT_LONG): {
+      PUSH(READ_CONSTANT_LONG());
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_NULL): PUSH(Value()); VM_DISPATCH();
+    VM_CASE(OP_TRUE): PUSH(Value(true)); VM_DISPATCH();
+    VM_CASE(OP_FALSE): PUSH(Value(false)); VM_DISPATCH();
+    VM_CASE(OP_POP): --sp; VM_DISPATCH();
+    VM_CASE(OP_DEFINE_GLOBAL): {
+      globals_.Define(READ_BYTE(), POP());
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_DEFINE_GLOBAL_LONG): {
+      globals_.Define(READ_LONG(), POP());
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_DEFINE_CONST_GLOBAL): {
+      globals_.Define(READ_BYTE(), POP(), false);
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_DEFINE_CONST_GLOBAL_LONG): {
+      globals_.Define(READ_LONG(), POP(), false);
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_GET_GLOBAL): {
+      GET_GLOBAL(READ_BYTE());
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_GET_GLOBAL_LONG): {
+      GET_GLOBAL(READ_LONG());
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_SET_GLOBAL): {
+      SET_GLOBAL(READ_BYTE());
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_SET_GLOBAL_LONG): {
+      SET_GLOBAL(READ_LONG());
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_GET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      PUSH(frame->slots[slot]);
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_SET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      frame->slots[slot] = PEEK(0);
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_NOT): {
+      PEEK(0) = Value(PEEK(0).IsFalse());
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_NEGATE): {
+      if (!PEEK(0).IsType(VAL_NUMBER)) {
+        RUNTIME_ERROR("Operand must be a number.");
       }
-      case OP_LOOP: {
-        uint16_t offset = ReadShort();
-        frame->ip -= offset;
-        break;
+      PEEK(0) = Value(-PEEK(0).AsNumber());
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_EQUAL): {
+      if (IsRope(PEEK(0)) || IsRope(PEEK(1))) {
+        STORE_FRAME(); // Interned strings are equal only if they're the same
+        FlattenValue(PEEK(0));
+        FlattenValue(PEEK(1));
       }
-      case OP_PRINT: {
-        Pop().Print();
-        std::cout << std::endl;
-        break;
+      Value b = POP();
+      Value a = POP();
+      PUSH(Value(a == b));
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_GREATER):  BINARY_NUMBER_OP(>, OP_GREATER_NUM); VM_DISPATCH();
+    VM_CASE(OP_LESS):     BINARY_NUMBER_OP(<, OP_LESS_NUM); VM_DISPATCH();
+    VM_CASE(OP_ADD): {
+      STORE_FRAME(); // Allocating strings may run the collector
+      if (PEEK(0).IsText() && PEEK(1).IsText()) {
+        QUICKEN(OP_ADD_STR);
+        Obj* b = POP().AsObj();
+        Obj* a = POP().AsObj();
+        PUSH(ObjRope::Concat(a, b)->AsValue());
+      } else if (PEEK(0).IsNumber() && PEEK(1).IsNumber()) {
+        QUICKEN(OP_ADD_NUM);
+        NumberType b = POP().AsNumber();
+        NumberType a = POP().AsNumber();
+        PUSH(Value(a + b));
+      } else if (PEEK(0).IsNumber() && PEEK(1).IsText()) {
+        NumberType b = POP().AsNumber();
+        Obj* a = POP().AsObj();
+        PUSH(ObjRope::Concat(a, b)->AsValue());
+      } else {
+        RUNTIME_ERROR("Operands must be numbers or strings.");
       }
-      case OP_CALL: {
-        int arg_count = ReadByte();
-        if (!CallValue(Peek(arg_count), arg_count)) {
-          return InterpretResult::kRuntimeError;
-        }
-        frame = &frames_[frame_count_ - 1];
-        break;
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_SUBTRACT): BINARY_NUMBER_OP(-, OP_SUBTRACT_NUM); VM_DISPATCH();
+    VM_CASE(OP_MULTIPLY): BINARY_NUMBER_OP(*, OP_MULTIPLY_NUM); VM_DISPATCH();
+    VM_CASE(OP_DIVIDE):   BINARY_NUMBER_OP(/, OP_DIVIDE_NUM); VM_DISPATCH();
+    VM_CASE(OP_ADD_NUM):      BINARY_NUMBER_OP_NUM(+, OP_ADD); VM_DISPATCH();
+    VM_CASE(OP_ADD_STR): {
+      if (!PEEK(0).IsText() || !PEEK(1).IsText()) DEQUICKEN(OP_ADD);
+      STORE_FRAME();
+      Obj* b = POP().AsObj();
+      PEEK(0) = ObjRope::Concat(PEEK(0).AsObj(), b)->AsValue();
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_SUBTRACT_NUM): BINARY_NUMBER_OP_NUM(-, OP_SUBTRACT); VM_DISPATCH();
+    VM_CASE(OP_MULTIPLY_NUM): BINARY_NUMBER_OP_NUM(*, OP_MULTIPLY); VM_DISPATCH();
+    VM_CASE(OP_DIVIDE_NUM):   BINARY_NUMBER_OP_NUM(/, OP_DIVIDE); VM_DISPATCH();
+    VM_CASE(OP_GREATER_NUM):  BINARY_NUMBER_OP_NUM(>, OP_GREATER); VM_DISPATCH();
+    VM_CASE(OP_LESS_NUM):     BINARY_NUMBER_OP_NUM(<, OP_LESS); VM_DISPATCH();
+    VM_CASE(OP_JUMP): {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_JUMP_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      if (PEEK(0).IsFalse()) ip += offset;
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_LOOP): {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      SAFEPOINT();
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_POP_JUMP_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      if (POP().IsFalse()) ip += offset;
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_POP_JUMP_IF_TRUE): {
+      uint16_t offset = READ_SHORT();
+      if (!POP().IsFalse()) ip += offset;
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_JUMP_IF_LESS):        COMPARE_JUMP(<, true); VM_DISPATCH();
+    VM_CASE(OP_JUMP_IF_NOT_LESS):    COMPARE_JUMP(<, false); VM_DISPATCH();
+    VM_CASE(OP_JUMP_IF_GREATER):     COMPARE_JUMP(>, true); VM_DISPATCH();
+    VM_CASE(OP_JUMP_IF_NOT_GREATER): COMPARE_JUMP(>, false); VM_DISPATCH();
+    VM_CASE(OP_PRINT): {
+      output_.WriteValue(POP());
+      output_.EndLine();
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_CALL): {
+      int arg_count = READ_BYTE();
+      SAFEPOINT();
+      STORE_FRAME();
+      if (!CallValue(PEEK(arg_count), arg_count)) {
+        return InterpretResult::kRuntimeError;
       }
-      case OP_RETURN: {
-        Value result = Pop();
-
-        frame_count_--;
-        if (frame_count_ == 0) {
-          Pop();
-          return InterpretResult::kOk;
-        }
-
-        stack_top_ = frame->slots;
-        Push(result);
+      LOAD_FRAME();
+      VM_DISPATCH();
+    }
+    VM_CASE(OP_RETURN): {
+      Value result = POP();
 
-        frame = &frames_[frame_count_ - 1];
-        break;
+      frame_count_--;
+      if (frame_count_ == 0) {
+        stack_top_ = sp - 1;
+        return InterpretResult::kOk;
       }
+
+      stack_top_ = frame->slots;
+      *stack_top_++ = result;
+      // Back to the register code that called a stack-only function
+      if (frame_count_ == base_frame) return InterpretResult::kOk;
+      LOAD_FRAME();
+      SAFEPOINT();
+      VM_DISPATCH();
     }
-  }
+    VM_CASE(OP_FORMAT): {
+      int count = READ_BYTE();
+      STORE_FRAME(); // Allocating strings may run the collector
+      Value result = ObjString::Format(sp - count, count)->AsValue();
+      sp -= count;
+      PUSH(result);
+      VM_DISPATCH();
+    }
+  VM_END()
+
+#undef VM_END
+#undef VM_BEGIN
+#undef VM_DISPATCH
+#undef VM_CASE
+#undef SET_GLOBAL
+#undef GET_GLOBAL
+#undef COMPARE_JUMP
+#undef BINARY_NUMBER_OP_NUM
+#undef BINARY_NUMBER_OP
+#undef DEQUICKEN
+#undef QUICKEN
+#undef SAFEPOINT
+#undef RUNTIME_ERROR
+#undef PEEK
+#undef POP
+#undef PUSH
+#undef READ_CONSTANT_LONG
+#undef READ_CONSTANT
+#undef READ_LONG
+#undef READ_SHORT
+#undef READ_BYTE
+#undef LOAD_FRAME
+#undef STORE_FRAME
+
+  return InterpretResult::kRuntimeError;
 }
 
-InterpretResult VM::Interpret(std::string& source) {
-  Compiler compiler(source);
-  ObjFunction* function = compiler.Compile();
+InterpretResult VM::Interpret(std::string_view source) {
+  ObjFunction* function = Compile(source);
   if (!function) return InterpretResult::kCompileError;
+  return Interpret(function);
+}
 
+InterpretResult VM::Interpret(ObjFunction* function) {
   Push(function->AsValue());
   CallValue(function->AsValue(), 0);
-  return Run();
+
+  // Scripts the register code generator can't handle run on the stack VM
+  InterpretResult result;
+  if (backend_ == Backend::kRegister && RegCompiler::Compile(function)) {
+    PrepareRegisterFrame();
+    result = RunRegister();
+  } else {
+    result = Run();
+  }
+  output_.Flush();
+  return result;
+}
+
+ObjFunction* VM::Compile(std::string_view source, bool lazy) {
+  // Whatever the last script left over the memory limit can be collected now
+  memory::_out_of_memory = false;
+
+  Compiler compiler(source, globals_, strings);
+  compiler.SetLazy(lazy);
+  compiler.SetOptimizationLevel(optimization_level_);
+  return compiler.Compile();
+}
+
+ObjFunction* VM::LoadBytecode(std::string_view image, const uint64_t* source_hash) {
+  memory::_out_of_memory = false;
+  int level = source_hash ? optimization_level_ : -1;
+  return BytecodeReader::Load(image, globals_, source_hash, level);
+}
+
+bool VM::SaveBytecode(const std::string& path, ObjFunction* function, uint64_t source_hash) const {
+  return BytecodeWriter::Write(path, function, globals_, source_hash, optimization_level_);
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define FF_CORE_VM_H_
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cstdarg>
 #include <unordered_map>
@@ -11,7 +12,11 @@
 #include "core/value.h"
 #include "core/object.h"
 #include "core/module.h"
+#include "core/output.h"
+#include "core/globals.h"
+#include "core/stringtable.h"
 #include "core/config.h"
+#include "core/memory.h"
 
 enum class InterpretResult {
   kOk,
@@ -20,65 +25,101 @@ enum class InterpretResult {
 };
 
 
+// Which code a VM executes. kRegister runs the RegChunk of each function,
+// generated from its stack code on the first call.
+enum class Backend {
+  kStack,
+  kRegister,
+};
+
+
 struct CallFrame {
   ObjFunction* function;
   uint8_t* ip;
+  const RegInstruction* pc; // nullptr for frames running stack code
   Value* slots;
 };
 
 
 class VM {
  friend class VMContext;
+ friend class Snapshot;
+ friend void SetCurrent(VM& vm);
 
  private:
+  memory::Heap heap_; // Every object of the VM, see SetCurrent
+
   Value stack_[kStackMaxSize];
   Value* stack_top_;
 
   CallFrame frames_[kFramesMax];
   int frame_count_;
-  CallFrame* frame = nullptr;
 
-  std::unordered_map<ObjString*, Value> globals_;
+  GlobalTable globals_;
   std::vector<FFModule> modules_;
 
+  Backend backend_;
+  int optimization_level_ = kDefaultOptimizationLevel;
+  OutputBuffer output_;
+
  public:
-  std::unordered_map<std::string, ObjString*> strings;
+  StringTable strings;
 
   VMContext this_context;
 
  public:
-  VM();
+  VM(Backend backend = Backend::kStack);
   ~VM();
 
-  InterpretResult Interpret(std::string& source);
+  Backend GetBackend() const;
+  void SetBackend(Backend backend);
+  // Of everything it compiles from now on, see Optimizer::Optimize
+  int GetOptimizationLevel() const;
+  void SetOptimizationLevel(int level);
+
+  InterpretResult Interpret(std::string_view source);
+  InterpretResult Interpret(ObjFunction* function); // A script Compile or LoadBytecode made
+  // Lazily, see Compiler::SetLazy
+  ObjFunction* Compile(std::string_view source, bool lazy = false);
+  // See BytecodeReader::Load and BytecodeWriter::Write. An image of a
+  // source is only loaded if it was compiled at this VM's level.
+  ObjFunction* LoadBytecode(std::string_view image, const uint64_t* source_hash = nullptr);
+  bool SaveBytecode(const std::string& path, ObjFunction* function, uint64_t source_hash) const;
   void InitBuiltins();
   void DefineNative(const char* name, NativeFn function);
   void Import(ObjString* name);
+  void MarkRoots();
+  void MarkStack();
+  void EvacuateRoots();
+  void GetLocation(std::string& function, int& line); // Of the running code
+  OutputBuffer& GetOutput();
 
  private:
   void vRuntimeError(const char* fmt, va_list args);
   void RuntimeError(const char* fmt, ...);
   void StackTrace();
+  int FrameLine(CallFrame* frame) const;
 
  private:
-  uint8_t ReadByte();
-  uint16_t ReadShort();
-  
-  Value ReadConstant();
-  Value ReadConstantLong();
-
   void ResetStack();
   void Push(Value value);
   Value Pop();
   Value Peek(int distance) const;
 
-  bool CallValue(Value callee, int arg_count);;
+  bool CallValue(Value callee, int arg_count);
   bool Call(ObjFunction* function, int arg_count);
+  bool PrepareRegisterFrame();
 
  private:
-  InterpretResult Run();
+  bool DebugHook();
+  // Returns when a frame above base_frame returns to it, or with the script
+  InterpretResult Run(int base_frame = 0);
+  InterpretResult RunRegister();
 };
 
+// Makes it the VM running on this thread, with its heap. A VM can only be
+// current on one thread at a time, but any number of VMs can each run on
+// their own thread, since they share nothing.
 void SetCurrent(VM& vm);
 
 #endif
@@ -8,12 +8,22 @@ static inline int SimpleInstruction(const char* name, int offset) {
   return offset+1;
 }
 
+static inline int QuickenedInstruction(const char* name, const char* generic, int offset) {
+  printf("%-16s (%s)\n", name, generic);
+  return offset+1;
+}
+
 static inline int ByteInstruction(const char* name, const Chunk& chunk, int offset) {
   uint8_t slot = chunk.code[offset+1];
   printf("%-16s %4d\n", name, slot);
   return offset+2;
 }
 
+static inline int LongInstruction(const char* name, const Chunk& chunk, int offset) {
+  printf("%-16s %4d\n", name, abi::ReadI32(&chunk.code[offset+1]));
+  return offset+5;
+}
+
 static inline int ConstantInstruction(const char* name, const Chunk& chunk, int offset) {
   uint8_t constant = chunk.code[offset+1];
   printf("%-16s %4d '", name, constant);
@@ -52,36 +62,51 @@ int debug::DisassembleInstruction(const Chunk& chunk, int offset) {
 
   uint8_t instruction = chunk.code[offset];
   switch (instruction) {
-    case OP_RETURN:             return SimpleInstruction("OP_RETURN", offset);
-    case OP_CALL:               return ByteInstruction("OP_CALL", chunk, offset);
-    case OP_JUMP:               return JumpInstruction("OP_JUMP", 1, chunk, offset);
-    case OP_JUMP_IF_FALSE:      return JumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
-    case OP_LOOP:               return JumpInstruction("OP_LOOP", -1, chunk, offset);
-    case OP_PRINT:              return SimpleInstruction("OP_PRINT", offset);
-    case OP_CONSTANT:           return ConstantInstruction("OP_CONSTANT", chunk, offset);
-    case OP_CONSTANT_LONG:      return ConstantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
-    case OP_NULL:               return SimpleInstruction("OP_NULL", offset);
-    case OP_TRUE:               return SimpleInstruction("OP_TRUE", offset);
-    case OP_FALSE:              return SimpleInstruction("OP_FALSE", offset);
-    case OP_POP:                return SimpleInstruction("OP_POP", offset);
-    case OP_DEFINE_GLOBAL:      return ConstantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-    case OP_DEFINE_GLOBAL_LONG: return ConstantLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
-    case OP_GET_GLOBAL:         return ConstantInstruction("OP_GET_GLOBAL", chunk, offset);
-    case OP_GET_GLOBAL_LONG:    return ConstantLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
-    case OP_SET_GLOBAL:         return ConstantInstruction("OP_SET_GLOBAL", chunk, offset);
-    case OP_SET_GLOBAL_LONG:    return ConstantLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
-    case OP_GET_LOCAL:          return ByteInstruction("OP_GET_LOCAL", chunk, offset);
-    case OP_SET_LOCAL:          return ByteInstruction("OP_SET_LOCAL", chunk, offset);
-    case OP_MAKECONST:          return SimpleInstruction("OP_MAKECONST", offset);
-    case OP_NOT:                return SimpleInstruction("OP_NOT", offset);
-    case OP_NEGATE:             return SimpleInstruction("OP_NEGATE", offset);
-    case OP_EQUAL:              return SimpleInstruction("OP_EQUAL", offset);
-    case OP_GREATER:            return SimpleInstruction("OP_GREATER", offset);
-    case OP_LESS:               return SimpleInstruction("OP_LESS", offset);
-    case OP_ADD:                return SimpleInstruction("OP_ADD", offset);
-    case OP_SUBTRACT:           return SimpleInstruction("OP_SUBTRACT", offset);
-    case OP_MULTIPLY:           return SimpleInstruction("OP_MULTIPLY", offset);
-    case OP_DIVIDE:             return SimpleInstruction("OP_DIVIDE", offset);
+    case OP_RETURN:                   return SimpleInstruction("OP_RETURN", offset);
+    case OP_CALL:                     return ByteInstruction("OP_CALL", chunk, offset);
+    case OP_FORMAT:                   return ByteInstruction("OP_FORMAT", chunk, offset);
+    case OP_JUMP:                     return JumpInstruction("OP_JUMP", 1, chunk, offset);
+    case OP_JUMP_IF_FALSE:            return JumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_LOOP:                     return JumpInstruction("OP_LOOP", -1, chunk, offset);
+    case OP_POP_JUMP_IF_FALSE:        return JumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_POP_JUMP_IF_TRUE:         return JumpInstruction("OP_POP_JUMP_IF_TRUE", 1, chunk, offset);
+    case OP_JUMP_IF_LESS:             return JumpInstruction("OP_JUMP_IF_LESS", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_LESS:         return JumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+    case OP_JUMP_IF_GREATER:          return JumpInstruction("OP_JUMP_IF_GREATER", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER:      return JumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+    case OP_PRINT:                    return SimpleInstruction("OP_PRINT", offset);
+    case OP_CONSTANT:                 return ConstantInstruction("OP_CONSTANT", chunk, offset);
+    case OP_CONSTANT_LONG:            return ConstantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+    case OP_NULL:                     return SimpleInstruction("OP_NULL", offset);
+    case OP_TRUE:                     return SimpleInstruction("OP_TRUE", offset);
+    case OP_FALSE:                    return SimpleInstruction("OP_FALSE", offset);
+    case OP_POP:                      return SimpleInstruction("OP_POP", offset);
+    case OP_DEFINE_GLOBAL:            return ByteInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    case OP_DEFINE_GLOBAL_LONG:       return LongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+    case OP_DEFINE_CONST_GLOBAL:      return ByteInstruction("OP_DEFINE_CONST_GLOBAL", chunk, offset);
+    case OP_DEFINE_CONST_GLOBAL_LONG: return LongInstruction("OP_DEFINE_CONST_GLOBAL_LONG", chunk, offset);
+    case OP_GET_GLOBAL:               return ByteInstruction("OP_GET_GLOBAL", chunk, offset);
+    case OP_GET_GLOBAL_LONG:          return LongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+    case OP_SET_GLOBAL:               return ByteInstruction("OP_SET_GLOBAL", chunk, offset);
+    case OP_SET_GLOBAL_LONG:          return LongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+    case OP_GET_LOCAL:                return ByteInstruction("OP_GET_LOCAL", chunk, offset);
+    case OP_SET_LOCAL:                return ByteInstruction("OP_SET_LOCAL", chunk, offset);
+    case OP_NOT:                      return SimpleInstruction("OP_NOT", offset);
+    case OP_NEGATE:                   return SimpleInstruction("OP_NEGATE", offset);
+    case OP_EQUAL:                    return SimpleInstruction("OP_EQUAL", offset);
+    case OP_GREATER:                  return SimpleInstruction("OP_GREATER", offset);
+    case OP_LESS:                     return SimpleInstruction("OP_LESS", offset);
+    case OP_ADD:                      return SimpleInstruction("OP_ADD", offset);
+    case OP_SUBTRACT:                 return SimpleInstruction("OP_SUBTRACT", offset);
+    case OP_MULTIPLY:                 return SimpleInstruction("OP_MULTIPLY", offset);
+    case OP_DIVIDE:                   return SimpleInstruction("OP_DIVIDE", offset);
+    case OP_ADD_NUM:                  return QuickenedInstruction("OP_ADD_NUM", "OP_ADD", offset);
+    case OP_ADD_STR:                  return QuickenedInstruction("OP_ADD_STR", "OP_ADD", offset);
+    case OP_SUBTRACT_NUM:             return QuickenedInstruction("OP_SUBTRACT_NUM", "OP_SUBTRACT", offset);
+    case OP_MULTIPLY_NUM:             return QuickenedInstruction("OP_MULTIPLY_NUM", "OP_MULTIPLY", offset);
+    case OP_DIVIDE_NUM:               return QuickenedInstruction("OP_DIVIDE_NUM", "OP_DIVIDE", offset);
+    case OP_GREATER_NUM:              return QuickenedInstruction("OP_GREATER_NUM", "OP_GREATER", offset);
+    case OP_LESS_NUM:                 return QuickenedInstruction("OP_LESS_NUM", "OP_LESS", offset);
     default:
       printf("Unknown opcode: %d\n", instruction);
       return offset+1;
@@ -97,3 +122,100 @@ void debug::DisassembleChunk(const Chunk& chunk, const std::string& name) {
   }
 }
 
+
+
+static inline int RegABInstruction(const char* name, RegInstruction instruction, int offset) {
+  printf("%-20s %4d %4d\n", name, instruction.a, instruction.b);
+  return offset+1;
+}
+
+static inline int RegABCInstruction(const char* name, RegInstruction instruction, int offset) {
+  printf("%-20s %4d %4d %4d\n", name, instruction.a, instruction.b, instruction.c);
+  return offset+1;
+}
+
+static inline int RegABKInstruction(const char* name, RegInstruction instruction, const Chunk& chunk, int offset) {
+  printf("%-20s %4d %4d %4d '", name, instruction.a, instruction.b, instruction.c);
+  chunk.constants[instruction.c].Print();
+  printf("'\n");
+  return offset+1;
+}
+
+static inline int RegAInstruction(const char* name, RegInstruction instruction, int offset) {
+  printf("%-20s %4d\n", name, instruction.a);
+  return offset+1;
+}
+
+static inline int RegABxInstruction(const char* name, RegInstruction instruction, int offset) {
+  printf("%-20s %4d %4d\n", name, instruction.a, instruction.Bx());
+  return offset+1;
+}
+
+static inline int RegConstantInstruction(const char* name, RegInstruction instruction, const Chunk& chunk, int offset) {
+  printf("%-20s %4d %4d '", name, instruction.a, instruction.Bx());
+  chunk.constants[instruction.Bx()].Print();
+  printf("'\n");
+  return offset+1;
+}
+
+static inline int RegJumpInstruction(const char* name, RegInstruction instruction, int offset) {
+  printf("%-20s %4d -> %d\n", name, instruction.a, offset + 1 + instruction.SBx());
+  return offset+1;
+}
+
+int debug::DisassembleRegInstruction(const RegChunk& regchunk, const Chunk& chunk, int offset) {
+  printf("%04d: ", offset);
+  if (offset > 0 && regchunk.GetLine(offset) == regchunk.GetLine(offset-1)) {
+    printf("   | ");
+  } else {
+    printf("%4d ", regchunk.GetLine(offset));
+  }
+
+  RegInstruction instruction = regchunk.code[offset];
+  switch (instruction.op) {
+    case ROP_MOVE:                return RegABInstruction("ROP_MOVE", instruction, offset);
+    case ROP_LOADK:               return RegConstantInstruction("ROP_LOADK", instruction, chunk, offset);
+    case ROP_LOADNULL:            return RegAInstruction("ROP_LOADNULL", instruction, offset);
+    case ROP_LOADTRUE:            return RegAInstruction("ROP_LOADTRUE", instruction, offset);
+    case ROP_LOADFALSE:           return RegAInstruction("ROP_LOADFALSE", instruction, offset);
+    case ROP_DEFINE_GLOBAL:       return RegABxInstruction("ROP_DEFINE_GLOBAL", instruction, offset);
+    case ROP_DEFINE_CONST_GLOBAL: return RegABxInstruction("ROP_DEFINE_CONST_GLOBAL", instruction, offset);
+    case ROP_GET_GLOBAL:          return RegABxInstruction("ROP_GET_GLOBAL", instruction, offset);
+    case ROP_SET_GLOBAL:          return RegABxInstruction("ROP_SET_GLOBAL", instruction, offset);
+    case ROP_NOT:                 return RegABInstruction("ROP_NOT", instruction, offset);
+    case ROP_NEGATE:              return RegABInstruction("ROP_NEGATE", instruction, offset);
+    case ROP_EQUAL:               return RegABCInstruction("ROP_EQUAL", instruction, offset);
+    case ROP_GREATER:             return RegABCInstruction("ROP_GREATER", instruction, offset);
+    case ROP_LESS:                return RegABCInstruction("ROP_LESS", instruction, offset);
+    case ROP_ADD:                 return RegABCInstruction("ROP_ADD", instruction, offset);
+    case ROP_SUBTRACT:            return RegABCInstruction("ROP_SUBTRACT", instruction, offset);
+    case ROP_MULTIPLY:            return RegABCInstruction("ROP_MULTIPLY", instruction, offset);
+    case ROP_DIVIDE:              return RegABCInstruction("ROP_DIVIDE", instruction, offset);
+    case ROP_EQUALK:              return RegABKInstruction("ROP_EQUALK", instruction, chunk, offset);
+    case ROP_GREATERK:            return RegABKInstruction("ROP_GREATERK", instruction, chunk, offset);
+    case ROP_LESSK:               return RegABKInstruction("ROP_LESSK", instruction, chunk, offset);
+    case ROP_ADDK:                return RegABKInstruction("ROP_ADDK", instruction, chunk, offset);
+    case ROP_SUBTRACTK:           return RegABKInstruction("ROP_SUBTRACTK", instruction, chunk, offset);
+    case ROP_MULTIPLYK:           return RegABKInstruction("ROP_MULTIPLYK", instruction, chunk, offset);
+    case ROP_DIVIDEK:             return RegABKInstruction("ROP_DIVIDEK", instruction, chunk, offset);
+    case ROP_JUMP:                return RegJumpInstruction("ROP_JUMP", instruction, offset);
+    case ROP_JUMP_IF_FALSE:       return RegJumpInstruction("ROP_JUMP_IF_FALSE", instruction, offset);
+    case ROP_JUMP_IF_TRUE:        return RegJumpInstruction("ROP_JUMP_IF_TRUE", instruction, offset);
+    case ROP_PRINT:               return RegAInstruction("ROP_PRINT", instruction, offset);
+    case ROP_CALL:                return RegABInstruction("ROP_CALL", instruction, offset);
+    case ROP_RETURN:              return RegAInstruction("ROP_RETURN", instruction, offset);
+    case ROP_FORMAT:              return RegABInstruction("ROP_FORMAT", instruction, offset);
+    default:
+      printf("Unknown opcode: %d\n", instruction.op);
+      return offset+1;
+  }
+}
+
+
+void debug::DisassembleRegChunk(const RegChunk& regchunk, const Chunk& chunk, const std::string& name) {
+  printf("=== %s (registers: %d) ===\n", name.c_str(), regchunk.register_count);
+
+  for (int offset = 0; offset < (int)regchunk.code.size(); ) {
+    offset = DisassembleRegInstruction(regchunk, chunk, offset);
+  }
+}
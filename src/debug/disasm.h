@@ -4,11 +4,15 @@
 #include <string>
 
 #include "core/chunk.h"
+#include "core/regchunk.h"
 
 
 namespace debug {
 void DisassembleChunk(const Chunk& chunk, const std::string& name);
 int DisassembleInstruction(const Chunk& chunk, int offset);
+
+void DisassembleRegChunk(const RegChunk& regchunk, const Chunk& chunk, const std::string& name);
+int DisassembleRegInstruction(const RegChunk& regchunk, const Chunk& chunk, int offset);
 } // namespace debug
 
 #endif
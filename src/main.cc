@@ -1,20 +1,32 @@
+#include "core/bytecode.h"
 #include "core/vm.h"
+#include "core/memory.h"
 #include "utils/die.h"
+#include "utils/mapped_file.h"
 #include "version.h"
 
+#include <algorithm>
 #include <iostream>
-#include <sstream>
-#include <fstream>
+#include <cctype>
 #include <cstdio>
+#include <cstring>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <readline/readline.h>
 #include <readline/history.h>
 
 constexpr auto kReplPrompt = "> ";
 
+static Backend backend = Backend::kStack;
+static bool eager = false;
+static int optimization_level = kDefaultOptimizationLevel;
+
 static void Repl() {
-  VM vm;
+  VM vm(backend);
+  // Lines are compiled one at a time, the IR tier isn't worth it there
+  vm.SetOptimizationLevel(std::min(optimization_level, 1));
   SetCurrent(vm);
   vm.InitBuiltins();
   char* buffer = NULL;
@@ -32,27 +44,106 @@ static void Repl() {
   }
 }
 
+// A file written by --compile runs as it is, a source file runs from the
+// one next to it while that was compiled from the same source. Function
+// bodies in the source are compiled on their first call, unless --eager.
 static void RunFile(std::string filename) {
-  std::ifstream file(filename);
-  std::stringstream buffer;
-  buffer << file.rdbuf();
-  std::string source = buffer.str();
-  VM vm;
+  MappedFile file(filename);
+  if (!file.IsOpen()) {
+    fprintf(stderr, "Could not read file '%s'.\n", filename.c_str());
+    die(74);
+  }
+  VM vm(backend);
+  vm.SetOptimizationLevel(optimization_level);
   SetCurrent(vm);
   vm.InitBuiltins();
 
-  InterpretResult result = vm.Interpret(source);
+  ObjFunction* script = nullptr;
+  if (BytecodeReader::IsBytecode(file.View())) {
+    script = vm.LoadBytecode(file.View());
+    if (!script) {
+      fprintf(stderr, "'%s' is damaged, or wasn't compiled by this version of ff.\n", filename.c_str());
+      die(65);
+    }
+  } else {
+    MappedFile compiled(filename + "c");
+    if (compiled.IsOpen()) {
+      uint64_t source_hash = HashSource(file.View());
+      script = vm.LoadBytecode(compiled.View(), &source_hash);
+    }
+    if (!script) script = vm.Compile(file.View(), !eager);
+    if (!script) die(65);
+  }
+
+  InterpretResult result = vm.Interpret(script);
   if (result == InterpretResult::kCompileError) die(65);
   if (result == InterpretResult::kRuntimeError) die(70);
 }
 
+// Writes each compiled script next to its source, with a 'c' appended. The
+// files are compiled in parallel, on one thread per core unless -j says.
+static void CompileFiles(const std::vector<std::string>& filenames, unsigned jobs) {
+  std::vector<std::unique_ptr<MappedFile>> files;
+  std::vector<std::string_view> sources;
+  for (const std::string& filename : filenames) {
+    files.push_back(std::make_unique<MappedFile>(filename));
+    if (!files.back()->IsOpen()) {
+      fprintf(stderr, "Could not read file '%s'.\n", filename.c_str());
+      die(74);
+    }
+    sources.push_back(files.back()->View());
+  }
+
+  std::vector<std::string> images = BytecodeWriter::CompileAll(sources, jobs, optimization_level);
+  int exit_code = 0;
+  for (size_t i = 0; i < images.size(); i++) {
+    if (images[i].empty()) {
+      fprintf(stderr, "Could not compile file '%s'.\n", filenames[i].c_str());
+      exit_code = 65;
+      continue;
+    }
+    std::string path = filenames[i] + "c";
+    if (!BytecodeWriter::WriteImage(path, images[i])) {
+      fprintf(stderr, "Could not write file '%s'.\n", path.c_str());
+      die(73);
+    }
+  }
+  if (exit_code) die(exit_code);
+}
+
 int main(int argc, char ** argv) {
-  if (argc == 1) {
+  bool compile = false;
+  unsigned jobs = 0;
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    if (!strcmp(argv[arg], "-r") || !strcmp(argv[arg], "--register")) {
+      backend = Backend::kRegister;
+    } else if (!strcmp(argv[arg], "-i") || !strcmp(argv[arg], "--incremental-gc")) {
+      memory::SetIncremental(true);
+    } else if (!strcmp(argv[arg], "--compile")) {
+      compile = true;
+    } else if ((!strcmp(argv[arg], "-j") || !strcmp(argv[arg], "--jobs")) && arg + 1 < argc) {
+      jobs = strtoul(argv[++arg], nullptr, 10);
+    } else if (!strcmp(argv[arg], "--eager")) {
+      eager = true;
+    } else if (argv[arg][1] == 'O' && isdigit(argv[arg][2]) && argv[arg][3] == '\0') {
+      optimization_level = argv[arg][2] - '0';
+    } else if ((!strcmp(argv[arg], "-m") || !strcmp(argv[arg], "--memory-limit")) && arg + 1 < argc) {
+      memory::SetMemoryLimit(strtoull(argv[++arg], nullptr, 10) * 1024 * 1024);
+    } else {
+      break;
+    }
+  }
+
+  if (arg == argc && !compile) {
     Repl();
-  } else if (argc == 2) {
-    RunFile(argv[1]);
+  } else if (compile && arg < argc) {
+    CompileFiles(std::vector<std::string>(argv + arg, argv + argc), jobs);
+  } else if (arg == argc - 1) {
+    RunFile(argv[arg]);
   } else {
-    fprintf(stderr, "Usage: %s [FILE]\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-O0|-O1|-O2] [-r|--register] [-i|--incremental-gc] [-m|--memory-limit MB] [--eager] [FILE]\n"
+                    "       %s [-O0|-O1|-O2] [-j|--jobs N] --compile FILE...\n", argv[0], argv[0]);
     die();
   }
 
@@ -1,14 +1,19 @@
 #include "ff.h"
 
-#include <iostream>
+#include <sstream>
 
 Value dev_print_globals(void* ctx, int argc, Value* args) {
   VMContext* context = (VMContext*)ctx;
 
   if (context) {
+    OutputBuffer& output = context->GetOutput();
     auto& globals = context->GetGlobals();
     for (auto& global : globals) {
-      std::cout << global.first->str << " = " << global.second.ToString() << "\n";
+      if (!global.defined) continue;
+      output.Write(global.name->View());
+      output.Write(" = ");
+      output.WriteValue(global.value);
+      output.EndLine();
     }
     return Value(true);
   }
@@ -20,8 +25,10 @@ Value dev_print_stack(void* ctx, int argc, Value* args) {
   VMContext* context = (VMContext*)ctx;
 
   if (context) {
+    OutputBuffer& output = context->GetOutput();
     for (int i = 0; i < context->GetStackSize(); i++) {
-      std::cout << context->Peek(i).ToString() << "\n";
+      output.WriteValue(context->Peek(i));
+      output.EndLine();
     }
     return Value(true);
   }
@@ -29,14 +36,99 @@ Value dev_print_stack(void* ctx, int argc, Value* args) {
   return Value(false);
 }
 
+Value dev_gc_max_pause(void* ctx, int argc, Value* args) {
+  VMContext* context = (VMContext*)ctx;
+
+  if (context) {
+    return Value(context->GetMaxGCPause());
+  }
+
+  return Value(VAL_NULL);
+}
+
+static const char* type_names[kObjTypeCount] = {"string", "native", "function", "closure", "rope"};
+
+// Prints one line of JSON
+Value dev_print_heap_stats(void* ctx, int argc, Value* args) {
+  VMContext* context = (VMContext*)ctx;
+
+  if (context) {
+    memory::HeapStats stats = context->GetHeapStats();
+    std::ostringstream out;
+    out << "{\"bytes\": " << stats.bytes
+              << ", \"peak_bytes\": " << stats.peak_bytes
+              << ", \"nursery_bytes\": " << stats.nursery_bytes
+              << ", \"allocations\": " << stats.allocations
+              << ", \"gc_cycles\": " << stats.gc_cycles
+              << ", \"minor_gc_cycles\": " << stats.minor_gc_cycles
+              << ", \"memory_limit\": " << stats.memory_limit
+              << ", \"types\": {";
+    for (int i = 0; i < kObjTypeCount; i++) {
+      out << (i ? ", " : "") << "\"" << type_names[i] << "\": {\"objects\": "
+                << stats.types[i].objects << ", \"bytes\": " << stats.types[i].bytes << "}";
+    }
+    out << "}}";
+    context->GetOutput().Write(out.str());
+    context->GetOutput().EndLine();
+    return Value(true);
+  }
+
+  return Value(false);
+}
+
+Value dev_profile_allocations(void* ctx, int argc, Value* args) {
+  VMContext* context = (VMContext*)ctx;
+
+  if (context && argc == 1) {
+    context->SetAllocationProfiling(!args[0].IsFalse());
+    return Value(true);
+  }
+
+  return Value(false);
+}
+
+// Prints one line of JSON per allocation site, most bytes first
+Value dev_print_alloc_profile(void* ctx, int argc, Value* args) {
+  VMContext* context = (VMContext*)ctx;
+
+  if (context) {
+    std::ostringstream out;
+    for (auto& site : context->GetAllocationProfile()) {
+      out << "{\"function\": \"" << site.function << "\", \"line\": " << site.line
+                << ", \"type\": \"" << type_names[site.type] << "\", \"count\": " << site.count
+                << ", \"bytes\": " << site.bytes << "}\n";
+    }
+    context->GetOutput().Write(out.str());
+    return Value(true);
+  }
+
+  return Value(false);
+}
+
+Value dev_set_memory_limit(void* ctx, int argc, Value* args) {
+  VMContext* context = (VMContext*)ctx;
+
+  if (context && argc == 1 && args[0].IsNumber() && args[0].AsNumber() >= 0) {
+    context->SetMemoryLimit((size_t)args[0].AsNumber());
+    return Value(true);
+  }
+
+  return Value(false);
+}
+
 
 FFModuleSymbol symbols[] {
   {"print_globals", "", dev_print_globals},
-  {"print_stack", "", dev_print_stack}
+  {"print_stack", "", dev_print_stack},
+  {"gc_max_pause", "Longest garbage collector pause so far, in microseconds", dev_gc_max_pause},
+  {"print_heap_stats", "Heap usage and collector counters, as JSON", dev_print_heap_stats},
+  {"profile_allocations", "Starts (true) or stops (false) counting allocations per line", dev_profile_allocations},
+  {"print_alloc_profile", "Allocations per function, line and type, as JSON lines", dev_print_alloc_profile},
+  {"set_memory_limit", "Heap size in bytes past which the vm stops with an error, 0 for none", dev_set_memory_limit}
 };
 
 FF_SYMBOL_EXPORT FFModuleInfo FF_MODULE_MOD_INFO {
   "dev",
   symbols,
-  2
+  7
 };
\ No newline at end of file
@@ -1,13 +1,16 @@
 #include "ff.h"
 
-#include <iostream>
-
 
 Value builtin_println(void* ctx, int argc, Value* args) {
+  VMContext* context = (VMContext*)ctx;
+  if (!context) return Value(VAL_NULL);
+
+  OutputBuffer& output = context->GetOutput();
   for (int i = 0; i < argc; i++) {
-    std::cout << args[i].ToString() << " ";
+    output.WriteValue(args[i]);
+    output.Write(' ');
   }
-  std::cout << std::endl;
+  output.EndLine();
   return Value(VAL_NULL);
 }
 
@@ -15,14 +18,22 @@ Value builtin_printf(void* ctx, int argc, Value* args) {
   return builtin_println(ctx, argc, args);
 }
 
+// Writes out whatever was printed but is still buffered
+Value builtin_flush(void* ctx, int argc, Value* args) {
+  VMContext* context = (VMContext*)ctx;
+  if (context) context->GetOutput().Flush();
+  return Value(VAL_NULL);
+}
+
 
 FFModuleSymbol symbols[] {
   {"println", "", builtin_println},
-  {"printf", "", builtin_printf}
+  {"printf", "", builtin_printf},
+  {"flush", "", builtin_flush}
 };
 
 FF_SYMBOL_EXPORT FFModuleInfo FF_MODULE_MOD_INFO {
   "io",
   symbols,
-  2
+  3
 };
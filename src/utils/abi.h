@@ -14,6 +14,22 @@ union NumericData {
   float     f;
 };
 
+inline uint16_t ReadU16(const uint8_t* bytes) {
+  NumericData data;
+  data.u8[0] = bytes[0];
+  data.u8[1] = bytes[1];
+  return data.u16[0];
+}
+
+inline int32_t ReadI32(const uint8_t* bytes) {
+  NumericData data;
+  data.u8[0] = bytes[0];
+  data.u8[1] = bytes[1];
+  data.u8[2] = bytes[2];
+  data.u8[3] = bytes[3];
+  return data.i32;
+}
+
 } // namespace abi
 
 #endif
@@ -0,0 +1,45 @@
+#include "utils/mapped_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      data_ = data;
+      size_ = st.st_size;
+      open_ = true;
+      close(fd);
+      return;
+    }
+  }
+
+  char chunk[64 * 1024];
+  ssize_t count;
+  while ((count = read(fd, chunk, sizeof(chunk))) > 0) {
+    buffer_.append(chunk, count);
+  }
+  open_ = count == 0;
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (data_) munmap(data_, size_);
+}
+
+bool MappedFile::IsOpen() const {
+  return open_;
+}
+
+std::string_view MappedFile::View() const {
+  if (data_) return std::string_view((const char*)data_, size_);
+  return buffer_;
+}
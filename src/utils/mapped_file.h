@@ -0,0 +1,27 @@
+#ifndef FF_UTILS_MAPPED_FILE_H_
+#define FF_UTILS_MAPPED_FILE_H_
+
+#include <string>
+#include <string_view>
+
+// A file mapped read-only into memory. Files that can't be mapped (pipes,
+// /dev/stdin) are read into a buffer instead.
+class MappedFile {
+ private:
+  void* data_ = nullptr;
+  size_t size_ = 0;
+  std::string buffer_;
+  bool open_ = false;
+
+ public:
+  MappedFile(const std::string& path);
+  MappedFile(const MappedFile& rhs) = delete;
+  ~MappedFile();
+
+  MappedFile& operator=(const MappedFile& rhs) = delete;
+
+  bool IsOpen() const;
+  std::string_view View() const;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#include "utils/thread_pool.h"
+
+#include <algorithm>
+
+
+ThreadPool::ThreadPool(unsigned threads) {
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned i = 0; i < threads; i++) {
+    threads_.emplace_back(&ThreadPool::Work, this);
+  }
+}
+
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  job_added_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+
+void ThreadPool::Run(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.push_back(std::move(job));
+  }
+  job_added_.notify_one();
+}
+
+
+void ThreadPool::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  job_done_.wait(lock, [this] { return jobs_.empty() && running_ == 0; });
+}
+
+
+unsigned ThreadPool::Size() const {
+  return threads_.size();
+}
+
+
+void ThreadPool::Work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    job_added_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+    if (jobs_.empty()) return;
+
+    std::function<void()> job = std::move(jobs_.front());
+    jobs_.pop_front();
+    running_++;
+    lock.unlock();
+    job();
+    lock.lock();
+    running_--;
+    if (jobs_.empty() && running_ == 0) job_done_.notify_all();
+  }
+}
@@ -0,0 +1,39 @@
+#ifndef FF_UTILS_THREAD_POOL_H_
+#define FF_UTILS_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads, running jobs in the order they were added. The
+// threads live as long as the pool, so what a job leaves in thread_local
+// state is there for the next job on the same thread.
+class ThreadPool {
+ private:
+  std::vector<std::thread> threads_;
+  std::deque<std::function<void()>> jobs_;
+  std::mutex mutex_;
+  std::condition_variable job_added_;
+  std::condition_variable job_done_;
+  size_t running_ = 0;
+  bool stopping_ = false;
+
+ public:
+  ThreadPool(unsigned threads = 0); // 0 for one per core
+  ThreadPool(const ThreadPool& rhs) = delete;
+  ~ThreadPool(); // Runs the jobs left first
+
+  ThreadPool& operator=(const ThreadPool& rhs) = delete;
+
+  void Run(std::function<void()> job);
+  void Wait(); // Until every job added so far is done
+  unsigned Size() const;
+
+ private:
+  void Work();
+};
+
+#endif
@@ -0,0 +1,104 @@
+// Host for bench_isolates and bench_snapshot: runs a request script over
+// and over on each of n threads, every run in a new VM, and prints the runs
+// per second. A fresh VM runs the prelude first, a clone is made from a
+// snapshot of a VM that ran it.
+
+#include "core/snapshot.h"
+#include "core/vm.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static const char* kPrelude = R"(
+fn fib(n) {
+  if (n < 2) return n;
+  return fib(n - 1) + fib(n - 2);
+}
+
+fn join(count) {
+  var s = "";
+  for (var i = 0; i < count; i = i + 1) {
+    s = s + "item " + i + ", ";
+  }
+  return s;
+}
+
+const greeting = "Hello from the prelude";
+)";
+
+static const char* kRequest = R"(
+print fib(15);
+print join(200) == "";
+print greeting;
+)";
+
+static void Check(InterpretResult result) {
+  if (result != InterpretResult::kOk) exit(70);
+}
+
+static void RunFresh(int runs) {
+  for (int i = 0; i < runs; i++) {
+    VM vm;
+    SetCurrent(vm);
+    vm.InitBuiltins();
+    Check(vm.Interpret(kPrelude));
+    Check(vm.Interpret(kRequest));
+  }
+}
+
+static void RunClones(const Snapshot* snapshot, int runs) {
+  for (int i = 0; i < runs; i++) {
+    std::unique_ptr<VM> vm = snapshot->Clone();
+    SetCurrent(*vm);
+    Check(vm->Interpret(kRequest));
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 4 || (strcmp(argv[3], "fresh") != 0 && strcmp(argv[3], "clone") != 0)) {
+    fprintf(stderr, "Usage: bench_isolates threads runs_per_thread fresh|clone\n");
+    return 64;
+  }
+  int threads = atoi(argv[1]);
+  int runs = atoi(argv[2]);
+  bool clone = strcmp(argv[3], "clone") == 0;
+
+  // Every VM writes its result to stdout
+  int null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd >= 0) dup2(null_fd, STDOUT_FILENO);
+
+  std::unique_ptr<Snapshot> snapshot;
+  if (clone) {
+    VM warm;
+    SetCurrent(warm);
+    warm.InitBuiltins();
+    Check(warm.Interpret(kPrelude));
+    snapshot = Snapshot::Take(warm);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (int i = 0; i < threads; i++) {
+    if (clone) {
+      workers.emplace_back(RunClones, snapshot.get(), runs);
+    } else {
+      workers.emplace_back(RunFresh, runs);
+    }
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  fprintf(stderr, "%d threads, %s VMs: %.0f runs/s\n", threads, clone ? "cloned" : "fresh",
+          threads * runs / elapsed.count());
+  return 0;
+}
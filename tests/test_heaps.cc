@@ -0,0 +1,41 @@
+// Two VMs on one thread: each VMContext reports and configures the heap of
+// its own VM, whichever is current
+
+#include "core/vm.h"
+
+#include <cstdio>
+
+static void Check(bool ok) {
+  printf("%s\n", ok ? "true" : "false");
+}
+
+int main() {
+  VM a;
+  VM b;
+  SetCurrent(b);
+  b.InitBuiltins();
+  SetCurrent(a);
+  a.InitBuiltins();
+
+  // Set on b while a is current
+  b.this_context.SetMemoryLimit(1 << 20);
+  Check(a.this_context.GetHeapStats().memory_limit == 0);
+  Check(b.this_context.GetHeapStats().memory_limit == 1 << 20);
+  SetCurrent(b);
+  Check(b.this_context.GetHeapStats().memory_limit == 1 << 20);
+  Check(a.this_context.GetHeapStats().memory_limit == 0);
+
+  // Only a's objects are counted for a
+  a.this_context.SetAllocationProfiling(true);
+  SetCurrent(a);
+  a.Interpret("var s = \"\"; for (var i = 0; i < 500; i = i + 1) { s = s + \"item \" + i; }");
+  Check(a.this_context.GetHeapStats().bytes > b.this_context.GetHeapStats().bytes);
+  Check(!a.this_context.GetAllocationProfile().empty());
+  Check(b.this_context.GetAllocationProfile().empty());
+
+  // The limit still applies to b once it runs
+  SetCurrent(b);
+  b.Interpret("var t = \"\"; for (var i = 0; i < 100; i = i + 1) { t = t + i; }");
+  Check(b.this_context.GetHeapStats().memory_limit == 1 << 20);
+  return 0;
+}